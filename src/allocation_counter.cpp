@@ -0,0 +1,104 @@
+#include "allocation_counter.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace /* anonymous */
+{
+    // Per thread, so that counting doesn't synchronize threads
+    thread_local std::size_t counter = 0;
+
+    void *counted_malloc(std::size_t size)
+    {
+        ++counter;
+        // malloc(0) may return a null pointer
+        if (void *ptr = std::malloc(size == 0 ? 1 : size)) {
+            return ptr;
+        }
+        throw std::bad_alloc();
+    }
+} // namespace anonymous
+
+std::size_t allocation_count()
+{
+    return counter;
+}
+
+void *operator new(std::size_t size)
+{
+    return counted_malloc(size);
+}
+
+void *operator new[](std::size_t size)
+{
+    return counted_malloc(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    ++counter;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    ++counter;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    ++counter;
+    // aligned_alloc requires the size to be a multiple of the alignment
+    std::size_t align = static_cast<std::size_t>(alignment);
+    size = (size + align - 1) / align * align;
+    if (void *ptr = std::aligned_alloc(align, size == 0 ? align : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
@@ -0,0 +1,16 @@
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <cstddef>
+
+/**
+ * \brief Returns the number of heap allocations made so far by the calling
+ *        thread.
+ *
+ * Every call to the global <tt>operator new</tt> is counted.
+ * Only available in executables that link \c allocation_counter.cpp, which
+ * replaces the global allocation functions.
+ */
+std::size_t allocation_count();
+
+#endif // ALLOCATION_COUNTER_H
@@ -0,0 +1,253 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "compact.h"
+#include "dz_kernels.h"
+#include "event_generator.h"
+#include "geometry.h"
+#include "ghost_hits.h"
+#include "hitutils.h"
+
+namespace /* anonymous */
+{
+    using clock_type = std::chrono::steady_clock;
+
+    /// \brief Half width of the phi window, as in \c cpu_doublet_finder
+    const constexpr std::int16_t window_width = radians_to_compact(0.04);
+
+    /// \brief A search window of the outer layer for one inner hit
+    struct window
+    {
+        dz_inner_hit inner;
+        std::size_t begin, end;
+    };
+
+    /// \brief The windows of all events for one layer pair
+    struct pair_windows
+    {
+        std::vector<window> windows;
+
+        /// \brief Outer hits of all events, padded with ghosts, one event after the other
+        std::vector<std::int16_t> dr;
+        std::vector<std::int32_t> z;
+
+        std::size_t candidates = 0;
+    };
+
+    /**
+     * \brief The \c dz check of the 0-1 pair as it was first written, before
+     *        the kernels: radii folded in as constants and one branch per hit
+     *        pair. Used as the baseline.
+     */
+    std::size_t check_dz_baseline(const dz_inner_hit &inner,
+                                  const std::int16_t *outer_dr,
+                                  const std::int32_t *outer_z,
+                                  std::size_t begin,
+                                  std::size_t end,
+                                  std::uint32_t *output)
+    {
+        const constexpr int layer_2_r = length_to_compact<int>(6.8);
+
+        std::size_t count = 0;
+        for (std::size_t i = begin; i < end; ++i) {
+            int outer_r = layer_2_r + outer_dr[i];
+
+            int dz = outer_z[i] - inner.z;
+            int dr = outer_r - inner.r;
+
+            dz >>= 8;
+            dr >>= 8;
+
+            int dz_times_dr = dr * inner.b_dz - dz * inner.num_xi;
+
+            int bound = length_to_compact<int>(11) * std::abs(dr) >> 8;
+
+            if (std::abs(dz_times_dr) < bound) {
+                output[count++] = inner.index | std::uint32_t(i) << 16;
+            }
+        }
+        return count;
+    }
+
+    /**
+     * \brief Builds the windows of \c pair for generated events, the way
+     *        \c cpu_doublet_finder does
+     */
+    pair_windows make_windows(const geom::layer_pair &pair,
+                              const std::vector<event> &events)
+    {
+        const int inner_layer_r = length_to_compact<int>(geom::pixel_barrel_radius[pair.inner]);
+        const int outer_layer_r = length_to_compact<int>(geom::pixel_barrel_radius[pair.outer]);
+
+        pair_windows result;
+        ghost_padded_layer<std::int32_t, std::int16_t, std::int32_t> outer;
+        for (const event &e : events) {
+            const compact_beam_spot bs = {
+                length_to_compact<std::int32_t>(e.bs.r),
+                length_to_compact<std::int32_t>(e.bs.z),
+                radians_to_compact(e.bs.phi)
+            };
+
+            std::array<compact_hit_columns, 2> layers;
+            for (std::size_t i = 0; i < e.hits.size(); ++i) {
+                const hit h = e.hits[i];
+                if (!hit_is_pixel_barrel(h)) {
+                    continue;
+                }
+                const int layer = hit_pixel_barrel_layer(h);
+                if (layer == pair.inner) {
+                    layers[0].push_back(compact_hit(h, layer));
+                } else if (layer == pair.outer) {
+                    layers[1].push_back(compact_hit(h, layer));
+                }
+            }
+            sort_by_phi(layers[0]);
+            sort_by_phi(layers[1]);
+
+            const compact_hit_columns &in = layers[0], &out = layers[1];
+            outer.fill(out.phi.data(), out.dr.data(), out.z.data(), out.size(),
+                       1 << 16, window_width);
+
+            // Windows index the outer hits of all events
+            const std::size_t offset = result.dr.size();
+            result.dr.insert(result.dr.end(), outer.r.begin(), outer.r.end());
+            result.z.insert(result.z.end(), outer.z.begin(), outer.z.end());
+
+            for (std::size_t i = 0; i < in.size(); ++i) {
+                const compact_hit h = in[i];
+                const int rb_proj = std::cos(compact_to_radians(bs.phi - h.phi)) * bs.r;
+
+                window w;
+                w.inner.r = inner_layer_r + h.dr;
+                w.inner.z = h.z;
+                w.inner.num_xi = (w.inner.r - rb_proj) >> 8;
+                w.inner.b_dz = (h.z - bs.z) >> 8;
+                w.inner.outer_r = outer_layer_r;
+                w.inner.index = i;
+                w.begin = offset + (std::lower_bound(outer.phi.begin(), outer.phi.end(),
+                                                     h.phi - window_width)
+                                    - outer.phi.begin());
+                w.end = offset + (std::upper_bound(outer.phi.begin(), outer.phi.end(),
+                                                   h.phi + window_width)
+                                  - outer.phi.begin());
+                result.candidates += w.end - w.begin;
+                result.windows.push_back(w);
+            }
+        }
+        return result;
+    }
+
+    /**
+     * \brief Runs \c kernel on all windows \c repetitions times
+     *
+     * \return The average time per candidate (ns)
+     */
+    double time_kernel(dz_kernel kernel,
+                       const pair_windows &input,
+                       std::vector<std::uint32_t> &output,
+                       int repetitions,
+                       std::size_t &accepted)
+    {
+        std::size_t candidates = 0;
+        auto start = clock_type::now();
+        for (int rep = 0; rep < repetitions; ++rep) {
+            std::size_t count = 0;
+            for (const window &w : input.windows) {
+                count += kernel(w.inner, input.dr.data(), input.z.data(), w.begin, w.end,
+                                output.data() + count);
+                candidates += w.end - w.begin;
+            }
+            accepted = count;
+        }
+        std::chrono::duration<double, std::nano> total = clock_type::now() - start;
+        return total.count() / std::max<std::size_t>(candidates, 1);
+    }
+
+    /// \brief Returns whether two kernels accepted the same hit pairs
+    bool same_output(const std::vector<std::uint32_t> &a, std::size_t accepted_a,
+                     const std::vector<std::uint32_t> &b, std::size_t accepted_b)
+    {
+        return accepted_a == accepted_b
+            && std::equal(a.begin(), a.begin() + accepted_a, b.begin());
+    }
+} // namespace anonymous
+
+int main(int argc, char **argv)
+{
+    int repetitions = argc > 1 ? std::max(1, std::atoi(argv[1])) : 200;
+    const std::size_t event_count = 10;
+
+    // Around the pileup of the input files
+    event_generator::settings config;
+    config.vertices = argc > 2 ? std::max(1, std::atoi(argv[2])) : 50;
+    event_generator generator(config);
+    std::vector<event> events(event_count);
+    for (event &e : events) {
+        generator.generate(e);
+    }
+
+    std::cout << "Using the " << selected_dz_kernel_name() << " dz kernels on "
+              << event_count << " events with " << config.vertices << " vertices" << std::endl;
+    std::cout << std::setw(8) << "pair"
+              << std::setw(12) << "candidates"
+              << std::setw(10) << "accepted"
+              << std::setw(16) << "baseline (ns)"
+              << std::setw(15) << "dynamic (ns)"
+              << std::setw(19) << "specialized (ns)"
+              << std::setw(14) << "vs baseline"
+              << std::setw(13) << "vs dynamic" << std::endl;
+
+    for (const geom::layer_pair &pair : geom::consecutive_layer_pairs) {
+        const pair_windows input = make_windows(pair, events);
+
+        std::vector<std::uint32_t> output_dynamic(input.candidates + dz_kernel_padding);
+        std::vector<std::uint32_t> output_specialized(output_dynamic.size());
+
+        std::size_t accepted_dynamic = 0, accepted_specialized = 0;
+        double dynamic = time_kernel(select_dz_kernel(), input,
+                                     output_dynamic, repetitions, accepted_dynamic);
+        double specialized = time_kernel(select_dz_kernel(pair), input,
+                                         output_specialized, repetitions, accepted_specialized);
+
+        // Both must accept the same pairs
+        if (!same_output(output_dynamic, accepted_dynamic,
+                         output_specialized, accepted_specialized)) {
+            std::cerr << "Specialized kernel gives a different result!" << std::endl;
+            return 1;
+        }
+
+        std::cout << std::setw(6) << pair.inner << "-" << pair.outer
+                  << std::setw(12) << input.candidates / event_count
+                  << std::setw(9) << std::fixed << std::setprecision(1)
+                  << 100. * accepted_specialized / std::max<std::size_t>(input.candidates, 1) << "%"
+                  << std::defaultfloat << std::setprecision(6);
+
+        // The baseline only existed for the 0-1 pair
+        if (pair.inner == 0 && pair.outer == 1) {
+            std::vector<std::uint32_t> output_baseline(output_dynamic.size());
+            std::size_t accepted_baseline = 0;
+            double baseline = time_kernel(check_dz_baseline, input,
+                                          output_baseline, repetitions, accepted_baseline);
+            if (!same_output(output_baseline, accepted_baseline,
+                             output_specialized, accepted_specialized)) {
+                std::cerr << std::endl << "Baseline kernel gives a different result!" << std::endl;
+                return 1;
+            }
+            std::cout << std::setw(16) << baseline
+                      << std::setw(15) << dynamic
+                      << std::setw(19) << specialized
+                      << std::setw(14) << baseline / specialized;
+        } else {
+            std::cout << std::setw(16) << "-"
+                      << std::setw(15) << dynamic
+                      << std::setw(19) << specialized
+                      << std::setw(14) << "-";
+        }
+        std::cout << std::setw(13) << dynamic / specialized << std::endl;
+    }
+}
@@ -0,0 +1,368 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory_resource>
+#include <thread>
+#include <vector>
+
+#include "doublet_finder.h"
+#include "event_generator.h"
+#include "geometry.h"
+#include "hitutils.h"
+
+namespace /* anonymous */
+{
+    using clock_type = std::chrono::steady_clock;
+    using duration_type = std::chrono::duration<double, std::nano>;
+
+    /// \brief Pixel barrel hits of one generated event, split by layer
+    using layer_hits = std::array<hit_columns, geom::pixel_barrel_radius.size()>;
+
+    /// \brief Accumulated time spent in every step of a finder
+    struct stage_times
+    {
+        duration_type convert{}, sort{}, find{}, get_doublets{};
+        std::size_t hits = 0, doublets = 0;
+    };
+
+    /**
+     * \brief Runs \c Finder on all consecutive layer pairs of \c events,
+     *        \c repetitions times, and times every step separately
+     */
+    template<class Finder>
+    stage_times time_finder(const std::vector<layer_hits> &events,
+                            const beam_spot &bs,
+                            int repetitions)
+    {
+        Finder finder;
+        std::array<typename Finder::hit_container_type, geom::pixel_barrel_radius.size()> layers;
+        std::pmr::vector<typename Finder::doublet_type> doublets;
+
+        stage_times times;
+        for (int rep = 0; rep < repetitions; ++rep) {
+            for (const layer_hits &event : events) {
+                auto start = clock_type::now();
+                const auto converted_bs = finder.convert(bs);
+                for (std::size_t l = 0; l < layers.size(); ++l) {
+                    layers[l] = finder.convert(event[l], l);
+                }
+                times.convert += clock_type::now() - start;
+
+                start = clock_type::now();
+                for (auto &layer : layers) {
+                    finder.sort_hits(layer);
+                }
+                times.sort += clock_type::now() - start;
+
+                for (const geom::layer_pair &pair : geom::consecutive_layer_pairs) {
+                    start = clock_type::now();
+                    finder.find(converted_bs, pair, layers[pair.inner], layers[pair.outer]);
+                    times.find += clock_type::now() - start;
+
+                    doublets.clear();
+                    start = clock_type::now();
+                    while (finder.get_doublets(doublets) != 0) {
+                    }
+                    times.get_doublets += clock_type::now() - start;
+                    times.doublets += doublets.size();
+                }
+
+                for (const hit_columns &layer : event) {
+                    times.hits += layer.size();
+                }
+            }
+        }
+        return times;
+    }
+
+    /// \brief Time spent finding doublets in events one by one and in a batch
+    struct batch_times
+    {
+        duration_type single{}, batch{};
+        std::size_t hits = 0;
+        bool same = true; ///< \brief Same doublets in every event and pair
+    };
+
+    /**
+     * \brief Runs \c Finder through \c doublet_finder_wrapper on \c events,
+     *        one event at a time and as a single batch
+     */
+    template<class Finder>
+    batch_times time_batch(std::vector<layer_hits> &events,
+                           const beam_spot &bs,
+                           int repetitions)
+    {
+        using wrapper_type = doublet_finder_wrapper<Finder>;
+        wrapper_type wrapper;
+
+        std::vector<typename wrapper_type::batch_event> batch(events.size());
+        for (std::size_t e = 0; e < events.size(); ++e) {
+            batch[e].bs = bs;
+            for (std::size_t l = 0; l < events[e].size(); ++l) {
+                batch[e].hits_per_layer[l] = events[e][l];
+            }
+        }
+
+        // Check first, untimed: the sorted doublets of every event and pair
+        // must be the same
+        using doublet_list = std::vector<typename wrapper_type::doublet_type>;
+        std::vector<doublet_list> single_doublets;
+        for (layer_hits &event : events) {
+            const auto r = wrapper.find(bs, event);
+            for (std::size_t p = 0; p + 1 < r.pair_offsets.size(); ++p) {
+                single_doublets.emplace_back(r.doublets.begin() + r.pair_offsets[p],
+                                             r.doublets.begin() + r.pair_offsets[p + 1]);
+                std::sort(single_doublets.back().begin(), single_doublets.back().end());
+            }
+        }
+
+        batch_times times;
+        {
+            // Pair p of event e is entry e * pairs.size() + p on both sides
+            const auto r = wrapper.find_batch(batch.data(), batch.size());
+            times.same = r.pair_offsets.size() == single_doublets.size() + 1;
+            for (std::size_t i = 0; times.same && i < single_doublets.size(); ++i) {
+                doublet_list doublets(r.doublets.begin() + r.pair_offsets[i],
+                                      r.doublets.begin() + r.pair_offsets[i + 1]);
+                std::sort(doublets.begin(), doublets.end());
+                times.same = doublets == single_doublets[i];
+            }
+        }
+
+        for (int rep = 0; rep < repetitions; ++rep) {
+            auto start = clock_type::now();
+            for (layer_hits &event : events) {
+                wrapper.find(bs, event);
+            }
+            times.single += clock_type::now() - start;
+
+            start = clock_type::now();
+            wrapper.find_batch(batch.data(), batch.size());
+            times.batch += clock_type::now() - start;
+
+            for (const layer_hits &event : events) {
+                for (const hit_columns &layer : event) {
+                    times.hits += layer.size();
+                }
+            }
+        }
+        return times;
+    }
+
+    /// \brief Prints one line of the batch table
+    void print(const char *name, int vertices, const batch_times &times, std::size_t runs)
+    {
+        const double hits = std::max<std::size_t>(times.hits, 1);
+        std::cout << std::setw(6) << name
+                  << std::setw(8) << vertices
+                  << std::setw(10) << times.hits / runs
+                  << std::setw(12) << times.single.count() / hits
+                  << std::setw(12) << times.batch.count() / hits
+                  << std::setw(10) << times.single.count() / times.batch.count()
+                  << (times.same ? "" : "  MISMATCH")
+                  << std::endl;
+    }
+
+    /// \brief Latency of the search in events split in phi sectors
+    struct thread_times
+    {
+        duration_type find{};
+        std::size_t events = 0;
+        bool same = true; ///< \brief Same doublets as with a single thread
+    };
+
+    /**
+     * \brief Runs the CPU finder on \c threads threads on all consecutive
+     *        layer pairs of \c events, and compares the doublets with
+     *        \c reference (filled if empty)
+     */
+    thread_times time_threads(const std::vector<layer_hits> &events,
+                              const beam_spot &bs,
+                              std::size_t threads,
+                              int repetitions,
+                              std::vector<std::pmr::vector<cpu_doublet_finder::doublet_type>> &reference)
+    {
+        cpu_doublet_finder finder;
+        finder.set_threads(threads);
+
+        // Sorting is not part of the search, do it once
+        const auto converted_bs = finder.convert(bs);
+        std::vector<std::array<cpu_doublet_finder::hit_container_type,
+                               geom::pixel_barrel_radius.size()>> layers(events.size());
+        for (std::size_t e = 0; e < events.size(); ++e) {
+            for (std::size_t l = 0; l < layers[e].size(); ++l) {
+                layers[e][l] = finder.convert(events[e][l], l);
+                finder.sort_hits(layers[e][l]);
+            }
+        }
+
+        const bool fill = reference.empty();
+        std::pmr::vector<cpu_doublet_finder::doublet_type> doublets;
+        thread_times times;
+        for (int rep = 0; rep < repetitions; ++rep) {
+            std::size_t index = 0;
+            for (const auto &event : layers) {
+                for (const geom::layer_pair &pair : geom::consecutive_layer_pairs) {
+                    doublets.clear();
+                    const auto start = clock_type::now();
+                    finder.find(converted_bs, pair, event[pair.inner], event[pair.outer]);
+                    while (finder.get_doublets(doublets) != 0) {
+                    }
+                    times.find += clock_type::now() - start;
+
+                    if (rep == 0) {
+                        // Chunks may come in a different order
+                        std::sort(doublets.begin(), doublets.end());
+                        if (fill) {
+                            reference.push_back(doublets);
+                        } else {
+                            times.same = times.same && reference[index] == doublets;
+                        }
+                    }
+                    ++index;
+                }
+                ++times.events;
+            }
+        }
+        return times;
+    }
+
+    /// \brief Generates \c count events with \c vertices primary vertices
+    std::vector<layer_hits> generate(int vertices, std::size_t count, beam_spot &bs)
+    {
+        event_generator::settings config;
+        config.vertices = vertices;
+        event_generator generator(config);
+        bs = config.bs;
+
+        std::vector<layer_hits> events(count);
+        event e;
+        for (layer_hits &layers : events) {
+            generator.generate(e);
+            for (std::size_t i = 0; i < e.hits.size(); ++i) {
+                const hit h = e.hits[i];
+                if (hit_is_pixel_barrel(h)) {
+                    layers[hit_pixel_barrel_layer(h)].push_back(h);
+                }
+            }
+        }
+        return events;
+    }
+
+    /// \brief Prints one line of the results table
+    void print(const char *name, int vertices, const stage_times &times, std::size_t runs)
+    {
+        const double hits = std::max<std::size_t>(times.hits, 1);
+        const double doublets = std::max<std::size_t>(times.doublets, 1);
+        std::cout << std::setw(6) << name
+                  << std::setw(8) << vertices
+                  << std::setw(10) << times.hits / runs
+                  << std::setw(12) << times.doublets / runs
+                  << std::setw(12) << times.convert.count() / hits
+                  << std::setw(12) << times.sort.count() / hits
+                  << std::setw(12) << times.find.count() / hits
+                  << std::setw(14) << times.get_doublets.count() / doublets
+                  << std::endl;
+    }
+} // namespace anonymous
+
+int main(int argc, char **argv)
+{
+    int repetitions = argc > 1 ? std::max(1, std::atoi(argv[1])) : 20;
+    const std::size_t event_count = 10;
+
+    std::cout << std::setw(6) << "finder"
+              << std::setw(8) << "nvtx"
+              << std::setw(10) << "hits"
+              << std::setw(12) << "doublets"
+              << std::setw(12) << "convert"
+              << std::setw(12) << "sort_hits"
+              << std::setw(12) << "find"
+              << std::setw(14) << "get_doublets" << std::endl;
+    std::cout << std::setw(6) << ""
+              << std::setw(8) << ""
+              << std::setw(10) << "/event"
+              << std::setw(12) << "/event"
+              << std::setw(12) << "ns/hit"
+              << std::setw(12) << "ns/hit"
+              << std::setw(12) << "ns/hit"
+              << std::setw(14) << "ns/doublet" << std::endl;
+
+    // From a quiet event to well beyond the pileup of the input files
+    for (int vertices : { 10, 25, 50, 75, 100, 140 }) {
+        beam_spot bs;
+        const std::vector<layer_hits> events = generate(vertices, event_count, bs);
+
+        const std::size_t runs = event_count * repetitions;
+        print("cpu", vertices,
+              time_finder<cpu_doublet_finder>(events, bs, repetitions), runs);
+        print("grid", vertices,
+              time_finder<grid_doublet_finder>(events, bs, repetitions), runs);
+        print("float", vertices,
+              time_finder<float_doublet_finder>(events, bs, repetitions), runs);
+    }
+
+    // Fixed costs matter most for small events
+    const std::size_t batch_size = 64;
+    std::cout << std::endl
+              << std::setw(6) << "finder"
+              << std::setw(8) << "nvtx"
+              << std::setw(10) << "hits"
+              << std::setw(12) << "single"
+              << std::setw(12) << "batch"
+              << std::setw(10) << "speedup" << std::endl;
+    std::cout << std::setw(6) << ""
+              << std::setw(8) << ""
+              << std::setw(10) << "/event"
+              << std::setw(12) << "ns/hit"
+              << std::setw(12) << "ns/hit" << std::endl;
+    for (int vertices : { 1, 2, 5, 10, 50 }) {
+        beam_spot bs;
+        std::vector<layer_hits> events = generate(vertices, batch_size, bs);
+
+        const std::size_t runs = batch_size * repetitions;
+        print("cpu", vertices,
+              time_batch<cpu_doublet_finder>(events, bs, repetitions), runs);
+        print("grid", vertices,
+              time_batch<grid_doublet_finder>(events, bs, repetitions), runs);
+        print("float", vertices,
+              time_batch<float_doublet_finder>(events, bs, repetitions), runs);
+    }
+
+    // Splitting events in phi sectors only pays off for large events
+    std::cout << std::endl
+              << std::setw(6) << "finder"
+              << std::setw(8) << "nvtx"
+              << std::setw(10) << "threads"
+              << std::setw(12) << "find"
+              << std::setw(10) << "speedup" << std::endl;
+    std::cout << std::setw(6) << ""
+              << std::setw(8) << ""
+              << std::setw(10) << ""
+              << std::setw(12) << "us/event" << std::endl;
+    const std::size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int vertices : { 50, 140, 200 }) {
+        beam_spot bs;
+        const std::vector<layer_hits> events = generate(vertices, event_count, bs);
+
+        std::vector<std::pmr::vector<cpu_doublet_finder::doublet_type>> reference;
+        double single = 0;
+        for (std::size_t threads = 1; threads <= max_threads; threads *= 2) {
+            const thread_times times = time_threads(events, bs, threads, repetitions, reference);
+            const double latency = times.find.count() / 1000 / times.events;
+            if (threads == 1) {
+                single = latency;
+            }
+            std::cout << std::setw(6) << "cpu"
+                      << std::setw(8) << vertices
+                      << std::setw(10) << threads
+                      << std::setw(12) << latency
+                      << std::setw(10) << single / latency
+                      << (times.same ? "" : "  MISMATCH")
+                      << std::endl;
+        }
+    }
+}
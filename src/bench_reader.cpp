@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <TROOT.h>
+#include <TSystem.h>
+
+#include "eventreader.h"
+
+namespace /* anonymous */
+{
+    /// \brief Result of reading a file once
+    struct read_result
+    {
+        long long events = 0;
+        long long bytes = 0;
+        double seconds = 0;
+    };
+
+    /**
+     * \brief Drops the pages of \c filename from the page cache, so that the
+     *        next read comes from the disk.
+     *
+     * Only clean pages are dropped, which is all of them for an input file.
+     */
+    void drop_page_cache(const std::string &filename)
+    {
+        char *path = gSystem->ExpandPathName(filename.c_str());
+        int fd = open(path, O_RDONLY);
+        delete[] path;
+        if (fd < 0) {
+            return;
+        }
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+
+    /// \brief Reads up to \c max_events events of \c filename, cold
+    read_result read_file(const std::string &filename,
+                          const event_reader::io_settings &io,
+                          long long max_events)
+    {
+        drop_page_cache(filename);
+
+        // The columns used by find_doublets without validation
+        event_reader::columns columns;
+        columns.tracks = false;
+        columns.seeds = false;
+
+        read_result result;
+        auto start = std::chrono::steady_clock::now();
+        {
+            event_reader in(filename, columns, io);
+            event e;
+            while (result.events < max_events && in.next()) {
+                in.get(e);
+                result.events++;
+            }
+            result.bytes = in.bytes_read();
+        }
+        result.seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+    /// \brief Prints one line of the results table
+    void print(const char *name, const read_result &result, const read_result &baseline)
+    {
+        std::cout << std::setw(16) << name
+                  << std::setw(10) << result.events
+                  << std::setw(12) << result.seconds
+                  << std::setw(12) << (result.events / std::max(result.seconds, 1e-9))
+                  << std::setw(12) << (1e-6 * result.bytes / std::max(result.seconds, 1e-9))
+                  << std::setw(10) << (baseline.seconds / std::max(result.seconds, 1e-9))
+                  << std::endl;
+    }
+} // namespace anonymous
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " input.root [events] [read_ahead]" << std::endl;
+        return 1;
+    }
+    const std::string filename = argv[1];
+    const long long max_events = argc > 2 ? std::atoll(argv[2]) : -1;
+    const std::size_t read_ahead = argc > 3 ? std::atoi(argv[3]) : 64;
+    const long long events = max_events > 0 ? max_events : (1ll << 62);
+
+    // Decompression tasks run on this pool
+    ROOT::EnableImplicitMT();
+    std::cout << "ROOT thread pool: " << ROOT::GetThreadPoolSize() << " threads" << std::endl;
+
+    std::cout << std::setw(16) << "settings"
+              << std::setw(10) << "events"
+              << std::setw(12) << "seconds"
+              << std::setw(12) << "events/s"
+              << std::setw(12) << "MB/s"
+              << std::setw(10) << "speedup" << std::endl;
+
+    // Plain on-demand reading, as the reader used to do
+    event_reader::io_settings io;
+    io.cache_bytes = 0;
+    io.parallel_unzip = false;
+    io.read_ahead = 0;
+    const read_result baseline = read_file(filename, io, events);
+    print("plain", baseline, baseline);
+
+    io.cache_bytes = event_reader::io_settings().cache_bytes;
+    print("cache", read_file(filename, io, events), baseline);
+
+    io.parallel_unzip = true;
+    print("cache+unzip", read_file(filename, io, events), baseline);
+
+    io.read_ahead = read_ahead;
+    print("cache+unzip+ra", read_file(filename, io, events), baseline);
+}
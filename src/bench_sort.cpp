@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+#include "compact.h"
+#include "hitutils.h"
+#include "radix_sort.h"
+
+namespace /* anonymous */
+{
+    using clock_type = std::chrono::steady_clock;
+
+    /**
+     * \brief Returns the average time (ns) taken by \c sort on copies of
+     *        \c hits
+     */
+    template<class Sort>
+    double time_sort(const compact_hit_columns &hits, int repetitions, Sort &&sort)
+    {
+        compact_hit_columns copy;
+        std::chrono::duration<double, std::nano> total{};
+        for (int i = 0; i < repetitions; ++i) {
+            copy = hits;
+            auto start = clock_type::now();
+            sort(copy);
+            total += clock_type::now() - start;
+        }
+        return total.count() / repetitions;
+    }
+} // namespace anonymous
+
+int main(int argc, char **argv)
+{
+    int repetitions = argc > 1 ? std::max(1, std::atoi(argv[1])) : 2000;
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> phi(-32768, 32767);
+    std::uniform_int_distribution<int> z(-length_to_compact<int>(28),
+                                         length_to_compact<int>(28));
+    std::uniform_int_distribution<int> dr(-2000, 2000);
+
+    std::cout << std::setw(8) << "hits"
+              << std::setw(16) << "std::sort (ns)"
+              << std::setw(12) << "ns/hit"
+              << std::setw(16) << "radix (ns)"
+              << std::setw(12) << "ns/hit"
+              << std::setw(10) << "speedup" << std::endl;
+
+    // Covers the range of hit_count_1 and hit_count_2 in find_doublets
+    for (std::size_t count = 100; count <= 1500; count += 100) {
+        compact_hit_columns hits;
+        for (std::size_t i = 0; i < count; ++i) {
+            hits.push_back(compact_hit(dr(rng), phi(rng), z(rng)));
+        }
+
+        // Both must give the same phi sequence
+        compact_hit_columns a = hits, b = hits;
+        sort_by_phi(a);
+        radix_sort_by_phi(b);
+        if (a.phi != b.phi) {
+            std::cerr << "Radix sort gives a different result!" << std::endl;
+            return 1;
+        }
+
+        double comparison = time_sort(hits, repetitions, [](compact_hit_columns &h) {
+            sort_by_phi(h);
+        });
+        double radix = time_sort(hits, repetitions, [](compact_hit_columns &h) {
+            radix_sort_by_phi(h);
+        });
+
+        std::cout << std::setw(8) << count
+                  << std::setw(16) << comparison
+                  << std::setw(12) << comparison / count
+                  << std::setw(16) << radix
+                  << std::setw(12) << radix / count
+                  << std::setw(10) << comparison / radix << std::endl;
+    }
+}
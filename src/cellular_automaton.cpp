@@ -0,0 +1,187 @@
+#include "cellular_automaton.h"
+
+#include <algorithm>
+
+void cellular_automaton::run(
+        const std::array<hit_span, geom::pixel_barrel_radius.size()> &layers,
+        const std::vector<geom::layer_pair> &pairs,
+        const std::pmr::vector<doublet_type> &doublets,
+        const std::pmr::vector<std::size_t> &pair_offsets)
+{
+    const std::size_t cells = doublets.size();
+    _tracks.clear();
+    _links.clear();
+
+    _cell_pair.resize(cells);
+    for (std::size_t p = 0; p < pairs.size(); ++p) {
+        std::fill(_cell_pair.begin() + pair_offsets[p],
+                  _cell_pair.begin() + pair_offsets[p + 1],
+                  std::uint8_t(p));
+    }
+
+    // Index the cells of every pair by inner hit (counting sort)
+    _by_inner.resize(pairs.size());
+    _by_inner_cells.resize(cells);
+    for (std::size_t p = 0; p < pairs.size(); ++p) {
+        std::vector<std::uint32_t> &offsets = _by_inner[p];
+        offsets.assign(layers[pairs[p].inner].size() + 1, 0);
+
+        for (std::size_t d = pair_offsets[p]; d < pair_offsets[p + 1]; ++d) {
+            ++offsets[doublets[d].first + 1];
+        }
+        offsets[0] = pair_offsets[p];
+        for (std::size_t i = 1; i < offsets.size(); ++i) {
+            offsets[i] += offsets[i - 1];
+        }
+        for (std::size_t d = pair_offsets[p]; d < pair_offsets[p + 1]; ++d) {
+            _by_inner_cells[offsets[doublets[d].first]++] = d;
+        }
+        // Every offset was moved to the next one, shift them back
+        for (std::size_t i = offsets.size() - 1; i > 0; --i) {
+            offsets[i] = offsets[i - 1];
+        }
+        offsets[0] = pair_offsets[p];
+    }
+
+    // Connect the cells sharing a hit
+    for (std::size_t p = 0; p < pairs.size(); ++p) {
+        const hit_span &layer1 = layers[pairs[p].inner];
+        const hit_span &layer2 = layers[pairs[p].outer];
+
+        for (std::size_t q = 0; q < pairs.size(); ++q) {
+            if (pairs[q].inner != pairs[p].outer) {
+                continue;
+            }
+            const std::vector<std::uint32_t> &next = _by_inner[q];
+            const hit_span &layer3 = layers[pairs[q].outer];
+
+            for (std::size_t d = pair_offsets[p]; d < pair_offsets[p + 1]; ++d) {
+                const std::uint16_t i1 = doublets[d].first;
+                const std::uint16_t i2 = doublets[d].second;
+
+                for (std::uint32_t k = next[i2]; k < next[i2 + 1]; ++k) {
+                    const std::uint32_t outer = _by_inner_cells[k];
+                    const std::uint16_t i3 = doublets[outer].second;
+
+                    if (triplet_finder::pass_triplet_cuts(
+                            layer1.phi[i1], layer1.z[i1],
+                            layer2.phi[i2], layer2.z[i2],
+                            layer3.phi[i3], layer3.z[i3])) {
+                        _links.emplace_back(d, outer);
+                    }
+                }
+            }
+        }
+    }
+
+    // Store the inner neighbours of every cell contiguously (counting sort)
+    _neighbour_offsets.assign(cells + 1, 0);
+    _has_outer.assign(cells, 0);
+    for (const auto &link : _links) {
+        ++_neighbour_offsets[link.second + 1];
+        _has_outer[link.first] = 1;
+    }
+    for (std::size_t c = 1; c <= cells; ++c) {
+        _neighbour_offsets[c] += _neighbour_offsets[c - 1];
+    }
+    _neighbours.resize(_links.size());
+    for (const auto &link : _links) {
+        _neighbours[_neighbour_offsets[link.second]++] = link.first;
+    }
+    for (std::size_t c = cells; c > 0; --c) {
+        _neighbour_offsets[c] = _neighbour_offsets[c - 1];
+    }
+    _neighbour_offsets[0] = 0;
+
+    // Evolve. A chain can't be longer than the number of pairs it goes
+    // through, which is at most one less than the number of layers.
+    _state.assign(cells, 1);
+    _next_state.resize(cells);
+    std::size_t ranges = 1;
+    if (_pool != nullptr) {
+        ranges = std::max<std::size_t>(
+            1, std::min(_pool->threads(), cells / min_cells_per_range));
+    }
+    for (std::size_t step = 1; step < max_hits - 1; ++step) {
+        bool changed = false;
+        if (ranges == 1) {
+            changed = evolve(0, cells);
+        } else {
+            // Every range writes its own flag
+            std::array<std::uint8_t, max_threads> range_changed{};
+            _pool->run(ranges, [&](std::size_t i) {
+                range_changed[i] = evolve(cells * i / ranges, cells * (i + 1) / ranges);
+            });
+            for (std::size_t i = 0; i < ranges; ++i) {
+                changed |= range_changed[i] != 0;
+            }
+        }
+        std::swap(_state, _next_state);
+        if (!changed) {
+            break;
+        }
+    }
+
+    // Read the candidates from the outer end of the chains
+    for (std::uint32_t c = 0; c < cells; ++c) {
+        if (_has_outer[c] || _state[c] + 1u < min_hits) {
+            continue;
+        }
+
+        // Collect the hits from the outside in
+        track_candidate t;
+        t.size = 0;
+        const geom::layer_pair &last = pairs[_cell_pair[c]];
+        t.layers[t.size] = last.outer;
+        t.hits[t.size++] = doublets[c].second;
+
+        std::uint32_t cell = c;
+        while (true) {
+            const geom::layer_pair &pair = pairs[_cell_pair[cell]];
+            t.layers[t.size] = pair.inner;
+            t.hits[t.size++] = doublets[cell].first;
+
+            if (_state[cell] == 1 || t.size == max_hits) {
+                break;
+            }
+            for (std::uint32_t k = _neighbour_offsets[cell]; k < _neighbour_offsets[cell + 1]; ++k) {
+                if (_state[_neighbours[k]] + 1 == _state[cell]) {
+                    cell = _neighbours[k];
+                    break;
+                }
+            }
+        }
+
+        std::reverse(t.layers.begin(), t.layers.begin() + t.size);
+        std::reverse(t.hits.begin(), t.hits.begin() + t.size);
+        _tracks.push_back(t);
+    }
+}
+
+bool cellular_automaton::evolve(std::size_t begin, std::size_t end)
+{
+    bool changed = false;
+    for (std::size_t c = begin; c < end; ++c) {
+        const std::uint8_t state = _state[c];
+        std::uint8_t next = state;
+        for (std::uint32_t k = _neighbour_offsets[c]; k < _neighbour_offsets[c + 1]; ++k) {
+            if (_state[_neighbours[k]] == state) {
+                next = state + 1;
+                break;
+            }
+        }
+        _next_state[c] = next;
+        changed |= next != state;
+    }
+    return changed;
+}
+
+void cellular_automaton::set_threads(std::size_t threads)
+{
+    threads = std::min<std::size_t>(threads, max_threads);
+    if (threads <= 1) {
+        _pool.reset();
+    } else if (_pool == nullptr || _pool->threads() != threads) {
+        _pool = std::make_unique<fork_join_pool>(threads);
+    }
+}
@@ -0,0 +1,137 @@
+#ifndef CELLULAR_AUTOMATON_H
+#define CELLULAR_AUTOMATON_H
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <utility>
+#include <vector>
+
+#include "event.h"
+#include "fork_join_pool.h"
+#include "geometry.h"
+#include "triplet_finder.h"
+
+/**
+ * \brief Builds track candidates from doublets with a cellular automaton.
+ *
+ * Every doublet is a cell. Two cells are neighbours when the outer hit of the
+ * inner one is the inner hit of the outer one and the three hits pass the
+ * triplet cuts of \ref triplet_finder. The neighbours of all cells are stored
+ * in one flat array, so no allocation is made per cell (and none at all once
+ * the buffers have grown to the size of a typical event).
+ *
+ * The state of a cell is the number of cells in the longest chain ending with
+ * it. All cells start at 1; at every step, a cell whose inner neighbour has
+ * the same state as itself is incremented. The states of a step only depend on
+ * those of the previous step, so the update is data-parallel over cells: with
+ * \ref set_threads, every step splits the cells in ranges evolved on several
+ * threads. It converges after at most one step per layer.
+ *
+ * Candidates are then read starting from the cells without outer neighbours,
+ * following inner neighbours whose state is one less than the current one.
+ */
+class cellular_automaton
+{
+public:
+    /// \brief Maximum number of hits in a track candidate
+    static const constexpr std::size_t max_hits = geom::pixel_barrel_radius.size();
+
+    /// \brief Minimum number of hits in a track candidate
+    static const constexpr std::size_t min_hits = 3;
+
+    /// \brief A doublet, represented as indices within the two layers
+    using doublet_type = std::pair<std::uint16_t, std::uint16_t>;
+
+    /**
+     * \brief A track candidate.
+     *
+     * Hit \c i is <tt>hits[i]</tt> in layer <tt>layers[i]</tt>, from the inside
+     * out, for \c i smaller than \c size.
+     */
+    struct track_candidate
+    {
+        std::uint8_t size;
+        std::array<std::uint8_t, max_hits> layers;
+        std::array<std::uint16_t, max_hits> hits;
+    };
+
+    /**
+     * \brief Builds the track candidates.
+     *
+     * \param layers       Hits of every layer, as seen by the doublet finder
+     * \param pairs        Layer pairs the doublets were found in
+     * \param doublets     Doublets of all pairs
+     * \param pair_offsets The doublets of <tt>pairs[i]</tt> are
+     *                     <tt>doublets[pair_offsets[i]]</tt> to
+     *                     <tt>doublets[pair_offsets[i + 1]]</tt> (excluded)
+     */
+    void run(const std::array<hit_span, geom::pixel_barrel_radius.size()> &layers,
+             const std::vector<geom::layer_pair> &pairs,
+             const std::pmr::vector<doublet_type> &doublets,
+             const std::pmr::vector<std::size_t> &pair_offsets);
+
+    /// \brief Minimum number of cells in each range evolved by a thread
+    static const constexpr std::size_t min_cells_per_range = 4096;
+
+    /// \brief Maximum number of threads used by \ref set_threads
+    static const constexpr std::size_t max_threads = 64;
+
+    /**
+     * \brief Evolves the cells on \c threads threads (including the calling
+     *        one).
+     *
+     * Events with fewer than <tt>2 * min_cells_per_range</tt> cells are
+     * evolved on the calling thread only.
+     */
+    void set_threads(std::size_t threads);
+
+    /// \brief Returns the candidates found by the last call to \ref run
+    const std::vector<track_candidate> &tracks() const { return _tracks; }
+
+    /// \brief Returns the number of cell connections made by the last call to \ref run
+    std::size_t connections() const { return _neighbours.size(); }
+
+private:
+    /// \brief Runs one evolution step. Returns \c true if any state changed.
+    bool evolve(std::size_t begin, std::size_t end);
+
+    /// \brief Pair index of every cell
+    std::vector<std::uint8_t> _cell_pair;
+
+    /**
+     * \brief Cells of every pair, indexed by inner hit.
+     *
+     * The cells of pair \c p starting at inner hit \c i are
+     * <tt>_by_inner_cells[_by_inner[p][i]]</tt> to
+     * <tt>_by_inner_cells[_by_inner[p][i + 1]]</tt> (excluded).
+     */
+    std::vector<std::vector<std::uint32_t>> _by_inner;
+    std::vector<std::uint32_t> _by_inner_cells;
+
+    /// \brief Cell connections, as (inner cell, outer cell)
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> _links;
+
+    /**
+     * \brief Inner neighbours of every cell.
+     *
+     * The inner neighbours of cell \c c are <tt>_neighbours[_neighbour_offsets[c]]</tt>
+     * to <tt>_neighbours[_neighbour_offsets[c + 1]]</tt> (excluded).
+     */
+    std::vector<std::uint32_t> _neighbour_offsets;
+    std::vector<std::uint32_t> _neighbours;
+
+    /// \brief Whether a cell has an outer neighbour
+    std::vector<std::uint8_t> _has_outer;
+
+    /// \brief Cell states, current and next step
+    std::vector<std::uint8_t> _state, _next_state;
+
+    std::vector<track_candidate> _tracks;
+
+    /// \brief Runs the evolution steps, if more than one thread is used
+    std::unique_ptr<fork_join_pool> _pool;
+};
+
+#endif // CELLULAR_AUTOMATON_H
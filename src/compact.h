@@ -2,6 +2,8 @@
 #define COMPACT_H
 
 #include <cstdint>
+#include <memory_resource>
+#include <vector>
 
 #include "geometry.h"
 #include "event.h"
@@ -85,6 +87,15 @@ struct compact_hit
      */
     std::int32_t z;
 
+    /**
+     * \brief Constructor
+     */
+    compact_hit(std::int16_t dr, std::int16_t phi, std::int32_t z) :
+        dr(dr),
+        phi(phi),
+        z(z)
+    {}
+
     /**
      * \brief Constructor
      */
@@ -96,4 +107,123 @@ struct compact_hit
 };
 static_assert(sizeof(compact_hit) == 8);
 
+/**
+ * \brief Holds a collection of compact hits as separate columns.
+ *
+ * See \ref compact_hit for the encoding of each column.
+ */
+struct compact_hit_columns
+{
+    std::pmr::vector<std::int16_t> dr;  ///< \brief See \ref compact_hit::dr
+    std::pmr::vector<std::int16_t> phi; ///< \brief See \ref compact_hit::phi
+    std::pmr::vector<std::int32_t> z;   ///< \brief See \ref compact_hit::z
+
+    compact_hit_columns() = default;
+
+    /// \brief Constructor, the columns are allocated from \c resource
+    explicit compact_hit_columns(std::pmr::memory_resource *resource) :
+        dr(resource), phi(resource), z(resource)
+    {}
+
+    /// \brief Returns the memory resource the columns are allocated from
+    std::pmr::memory_resource *resource() const { return dr.get_allocator().resource(); }
+
+    /// \brief Returns the number of hits
+    std::size_t size() const { return dr.size(); }
+
+    /// \brief Returns \c true if there are no hits
+    bool empty() const { return dr.empty(); }
+
+    /// \brief Removes all hits, keeping the allocated memory
+    void clear()
+    {
+        dr.clear();
+        phi.clear();
+        z.clear();
+    }
+
+    /// \brief Reserves memory for \c n hits
+    void reserve(std::size_t n)
+    {
+        dr.reserve(n);
+        phi.reserve(n);
+        z.reserve(n);
+    }
+
+    /// \brief Appends a hit
+    void push_back(const compact_hit &h)
+    {
+        dr.push_back(h.dr);
+        phi.push_back(h.phi);
+        z.push_back(h.z);
+    }
+
+    /// \brief Gathers hit \c i
+    compact_hit operator[](std::size_t i) const
+    {
+        return compact_hit(dr[i], phi[i], z[i]);
+    }
+
+    /// \brief Gathers hit \c i, with bounds checking
+    compact_hit at(std::size_t i) const
+    {
+        return compact_hit(dr.at(i), phi.at(i), z.at(i));
+    }
+
+    /// \brief Reorders the hits, see \ref hit_columns::permute
+    template<class Order>
+    void permute(const Order &order)
+    {
+        hit_columns::permute_column(dr, order);
+        hit_columns::permute_column(phi, order);
+        hit_columns::permute_column(z, order);
+    }
+};
+
+/**
+ * \brief Non-owning view of compact hits stored as columns.
+ *
+ * Can point to a \ref compact_hit_columns or to any other memory (eg a mapped
+ * file).
+ */
+struct compact_hit_span
+{
+    const std::int16_t *dr = nullptr;  ///< \brief See \ref compact_hit::dr
+    const std::int16_t *phi = nullptr; ///< \brief See \ref compact_hit::phi
+    const std::int32_t *z = nullptr;   ///< \brief See \ref compact_hit::z
+    std::size_t count = 0;             ///< \brief Number of hits
+
+    compact_hit_span() = default;
+
+    /// \brief Constructor
+    compact_hit_span(const std::int16_t *dr, const std::int16_t *phi,
+                     const std::int32_t *z, std::size_t count) :
+        dr(dr), phi(phi), z(z), count(count)
+    {}
+
+    /// \brief Views all hits in \c hits
+    compact_hit_span(const compact_hit_columns &hits) :
+        dr(hits.dr.data()), phi(hits.phi.data()), z(hits.z.data()),
+        count(hits.size())
+    {}
+
+    /// \brief Returns the number of hits
+    std::size_t size() const { return count; }
+
+    /// \brief Returns \c true if there are no hits
+    bool empty() const { return count == 0; }
+
+    /// \brief Gathers hit \c i
+    compact_hit operator[](std::size_t i) const
+    {
+        return compact_hit(dr[i], phi[i], z[i]);
+    }
+
+    /// \brief Views \c n hits starting at \c first
+    compact_hit_span subspan(std::size_t first, std::size_t n) const
+    {
+        return compact_hit_span(dr + first, phi + first, z + first, n);
+    }
+};
+
 #endif // COMPACT_H
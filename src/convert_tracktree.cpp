@@ -0,0 +1,131 @@
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "compact.h"
+#include "eventreader.h"
+#include "hitutils.h"
+#include "native_format.h"
+
+namespace /* anonymous */
+{
+    /**
+     * \brief Writes \c bytes bytes at \c offset, padding with zeros as needed.
+     */
+    void write_at(std::ofstream &out, std::uint64_t offset,
+                  const void *data, std::uint64_t bytes)
+    {
+        static const char zeros[native::alignment] = {};
+        while (std::uint64_t(out.tellp()) < offset) {
+            out.write(zeros, std::min<std::uint64_t>(offset - out.tellp(),
+                                                     sizeof(zeros)));
+        }
+        out.write(static_cast<const char *>(data), bytes);
+    }
+} // namespace anonymous
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " input.root output.trkl" << std::endl;
+        return 1;
+    }
+
+    // Only the hits, the beam spot and the number of vertices are stored
+    event_reader::columns read_columns;
+    read_columns.tracks = false;
+    read_columns.seeds = false;
+    event_reader in(argv[1], read_columns);
+
+    std::vector<native::event_record> events;
+    std::array<std::vector<std::uint64_t>, native::layer_count> offsets;
+    std::array<compact_hit_columns, native::layer_count> columns;
+    for (auto &layer_offsets : offsets) {
+        layer_offsets.push_back(0);
+    }
+
+    event e;
+    std::array<compact_hit_columns, native::layer_count> hits_per_layer;
+    while (in.next()) {
+        in.get(e);
+
+        for (auto &layer : hits_per_layer) {
+            layer.clear();
+        }
+        for (std::size_t ih = 0; ih < e.hits.size(); ++ih) {
+            const hit h = e.hits[ih];
+            if (hit_is_pixel_barrel(h)) {
+                int layer = hit_pixel_barrel_layer(h);
+                hits_per_layer[layer].push_back(compact_hit(h, layer));
+            }
+        }
+
+        for (std::size_t l = 0; l < native::layer_count; ++l) {
+            sort_by_phi(hits_per_layer[l]);
+
+            compact_hit_columns &out = columns[l];
+            const compact_hit_columns &layer = hits_per_layer[l];
+            out.dr.insert(out.dr.end(), layer.dr.begin(), layer.dr.end());
+            out.phi.insert(out.phi.end(), layer.phi.begin(), layer.phi.end());
+            out.z.insert(out.z.end(), layer.z.begin(), layer.z.end());
+            offsets[l].push_back(out.size());
+        }
+
+        events.push_back({ e.bs.r, e.bs.phi, e.bs.z, e.nvtx });
+    }
+
+    // Lay out the sections
+    native::file_header header = {};
+    std::memcpy(header.magic, native::magic, sizeof(header.magic));
+    header.version = native::version;
+    header.layer_count = native::layer_count;
+    header.event_count = events.size();
+
+    std::uint64_t position = sizeof(header);
+    auto allocate = [&position](std::uint64_t bytes) {
+        position = (position + native::alignment - 1)
+                   / native::alignment * native::alignment;
+        std::uint64_t offset = position;
+        position += bytes;
+        return offset;
+    };
+
+    header.events = allocate(events.size() * sizeof(native::event_record));
+    for (std::size_t l = 0; l < native::layer_count; ++l) {
+        native::layer_record &layer = header.layers[l];
+        layer.hit_count = columns[l].size();
+        layer.offsets = allocate(offsets[l].size() * sizeof(std::uint64_t));
+        layer.dr = allocate(layer.hit_count * sizeof(std::int16_t));
+        layer.phi = allocate(layer.hit_count * sizeof(std::int16_t));
+        layer.z = allocate(layer.hit_count * sizeof(std::int32_t));
+    }
+
+    // Write them
+    std::ofstream out(argv[2], std::ios::binary | std::ios::trunc);
+    write_at(out, 0, &header, sizeof(header));
+    write_at(out, header.events, events.data(),
+             events.size() * sizeof(native::event_record));
+    for (std::size_t l = 0; l < native::layer_count; ++l) {
+        const native::layer_record &layer = header.layers[l];
+        write_at(out, layer.offsets, offsets[l].data(),
+                 offsets[l].size() * sizeof(std::uint64_t));
+        write_at(out, layer.dr, columns[l].dr.data(),
+                 layer.hit_count * sizeof(std::int16_t));
+        write_at(out, layer.phi, columns[l].phi.data(),
+                 layer.hit_count * sizeof(std::int16_t));
+        write_at(out, layer.z, columns[l].z.data(),
+                 layer.hit_count * sizeof(std::int32_t));
+    }
+
+    if (!out) {
+        std::cerr << "Error while writing " << argv[2] << std::endl;
+        return 1;
+    }
+
+    std::cout << "Converted " << events.size() << " events" << std::endl;
+    for (std::size_t l = 0; l < native::layer_count; ++l) {
+        std::cout << "  layer " << l << ":   " << columns[l].size() << " hits" << std::endl;
+    }
+}
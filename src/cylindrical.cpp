@@ -0,0 +1,159 @@
+#include "cylindrical.h"
+
+#include "compact.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#   define CYLINDRICAL_HAVE_AVX2
+#   include <immintrin.h>
+#endif
+
+namespace /* anonymous */
+{
+    /// \brief Factor to convert radians to the compact representation
+    const constexpr float compact_scale = float(1 << 15) / pi;
+
+    void to_cylindrical_scalar(const float *x, const float *y,
+                               std::size_t begin, std::size_t end,
+                               float *r, float *phi)
+    {
+        for (std::size_t i = begin; i < end; ++i) {
+            r[i] = std::sqrt(x[i] * x[i] + y[i] * y[i]);
+            phi[i] = fast_atan2(y[i], x[i]);
+        }
+    }
+
+    void to_cylindrical_compact_scalar(const float *x, const float *y,
+                                       std::size_t begin, std::size_t end,
+                                       float *r, std::int16_t *phi)
+    {
+        for (std::size_t i = begin; i < end; ++i) {
+            r[i] = std::sqrt(x[i] * x[i] + y[i] * y[i]);
+            // Go through int32 so that pi wraps around to -pi
+            std::int32_t compact = fast_atan2(y[i], x[i]) * compact_scale;
+            phi[i] = std::int16_t(compact);
+        }
+    }
+
+#ifdef CYLINDRICAL_HAVE_AVX2
+    /**
+     * \brief Checks (once) whether the CPU supports the AVX2 kernels
+     */
+    bool have_avx2()
+    {
+        static const bool result = __builtin_cpu_supports("avx2")
+                                   && __builtin_cpu_supports("fma");
+        return result;
+    }
+
+    /**
+     * \brief Vector version of \ref fast_atan2 and the radius, for 8 points.
+     */
+    __attribute__((target("avx2,fma")))
+    inline void cylindrical_avx2(__m256 x, __m256 y, __m256 &r, __m256 &phi)
+    {
+        const __m256 sign_mask = _mm256_set1_ps(-0.f);
+
+        r = _mm256_sqrt_ps(_mm256_fmadd_ps(x, x, _mm256_mul_ps(y, y)));
+
+        __m256 ax = _mm256_andnot_ps(sign_mask, x);
+        __m256 ay = _mm256_andnot_ps(sign_mask, y);
+        __m256 max = _mm256_max_ps(ax, ay);
+        __m256 min = _mm256_min_ps(ax, ay);
+
+        // a = min / max, or 0 at the origin
+        __m256 a = _mm256_div_ps(min, max);
+        a = _mm256_and_ps(a, _mm256_cmp_ps(max, _mm256_setzero_ps(), _CMP_GT_OQ));
+        __m256 s = _mm256_mul_ps(a, a);
+
+        __m256 poly = _mm256_set1_ps(-0.01172120f);
+        poly = _mm256_fmadd_ps(poly, s, _mm256_set1_ps(0.05265332f));
+        poly = _mm256_fmadd_ps(poly, s, _mm256_set1_ps(-0.11643287f));
+        poly = _mm256_fmadd_ps(poly, s, _mm256_set1_ps(0.19354346f));
+        poly = _mm256_fmadd_ps(poly, s, _mm256_set1_ps(-0.33262347f));
+        poly = _mm256_fmadd_ps(poly, s, _mm256_set1_ps(0.99997726f));
+        __m256 angle = _mm256_mul_ps(poly, a);
+
+        __m256 swap = _mm256_cmp_ps(ay, ax, _CMP_GT_OQ);
+        angle = _mm256_blendv_ps(angle,
+                                 _mm256_sub_ps(_mm256_set1_ps(1.57079637f), angle),
+                                 swap);
+        // The sign bit of x is set for negative values
+        angle = _mm256_blendv_ps(angle,
+                                 _mm256_sub_ps(_mm256_set1_ps(3.14159274f), angle),
+                                 _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+        // copysign(angle, y)
+        phi = _mm256_or_ps(angle, _mm256_and_ps(sign_mask, y));
+    }
+
+    __attribute__((target("avx2,fma")))
+    void to_cylindrical_avx2(const float *x, const float *y, std::size_t count,
+                             float *r, float *phi)
+    {
+        std::size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256 vr, vphi;
+            cylindrical_avx2(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i),
+                             vr, vphi);
+            _mm256_storeu_ps(r + i, vr);
+            _mm256_storeu_ps(phi + i, vphi);
+        }
+        to_cylindrical_scalar(x, y, i, count, r, phi);
+    }
+
+    __attribute__((target("avx2,fma")))
+    void to_cylindrical_compact_avx2(const float *x, const float *y,
+                                     std::size_t count,
+                                     float *r, std::int16_t *phi)
+    {
+        const __m256 scale = _mm256_set1_ps(compact_scale);
+
+        std::size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m256 r_lo, phi_lo, r_hi, phi_hi;
+            cylindrical_avx2(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i),
+                             r_lo, phi_lo);
+            cylindrical_avx2(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8),
+                             r_hi, phi_hi);
+            _mm256_storeu_ps(r + i, r_lo);
+            _mm256_storeu_ps(r + i + 8, r_hi);
+
+            // Truncate to int32, then keep the low 16 bits so that pi wraps
+            // around like in the scalar version (packs would saturate)
+            const __m256i low_16 = _mm256_set1_epi32(0xffff);
+            __m256i c_lo = _mm256_and_si256(
+                _mm256_cvttps_epi32(_mm256_mul_ps(phi_lo, scale)), low_16);
+            __m256i c_hi = _mm256_and_si256(
+                _mm256_cvttps_epi32(_mm256_mul_ps(phi_hi, scale)), low_16);
+            // packus works within 128-bit lanes, fix the order afterwards
+            __m256i packed = _mm256_packus_epi32(c_lo, c_hi);
+            packed = _mm256_permute4x64_epi64(packed, 0xd8);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(phi + i), packed);
+        }
+        to_cylindrical_compact_scalar(x, y, i, count, r, phi);
+    }
+#endif // CYLINDRICAL_HAVE_AVX2
+} // namespace anonymous
+
+void to_cylindrical(const float *x, const float *y, std::size_t count,
+                    float *r, float *phi)
+{
+#ifdef CYLINDRICAL_HAVE_AVX2
+    if (have_avx2()) {
+        to_cylindrical_avx2(x, y, count, r, phi);
+        return;
+    }
+#endif
+    to_cylindrical_scalar(x, y, 0, count, r, phi);
+}
+
+void to_cylindrical_compact(const float *x, const float *y, std::size_t count,
+                            float *r, std::int16_t *phi)
+{
+#ifdef CYLINDRICAL_HAVE_AVX2
+    if (have_avx2()) {
+        to_cylindrical_compact_avx2(x, y, count, r, phi);
+        return;
+    }
+#endif
+    to_cylindrical_compact_scalar(x, y, 0, count, r, phi);
+}
@@ -0,0 +1,64 @@
+#ifndef CYLINDRICAL_H
+#define CYLINDRICAL_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * \brief Approximation of \c std::atan2 used by the batch conversion kernels.
+ *
+ * The maximum error is 2.5e-6 rad, or about 1/40 of the resolution of the
+ * compact \c phi representation (see \ref compact_hit::phi). The result is in
+ * the range [-pi, pi].
+ */
+inline float fast_atan2(float y, float x)
+{
+    float ax = std::abs(x);
+    float ay = std::abs(y);
+    float max = ax > ay ? ax : ay;
+    float min = ax > ay ? ay : ax;
+
+    // atan(a) for a in [0, 1], minimax polynomial
+    float a = max > 0 ? min / max : 0;
+    float s = a * a;
+    float angle = a * (0.99997726f
+                       + s * (-0.33262347f
+                       + s * (0.19354346f
+                       + s * (-0.11643287f
+                       + s * (0.05265332f
+                       + s * -0.01172120f)))));
+
+    if (ay > ax) {
+        angle = 1.57079637f - angle;
+    }
+    if (x < 0) {
+        angle = 3.14159274f - angle;
+    }
+    return std::copysign(angle, y);
+}
+
+/**
+ * \brief Converts points from Cartesian to cylindrical coordinates.
+ *
+ * Computes <tt>r = sqrt(x^2 + y^2)</tt> and <tt>phi = atan2(y, x)</tt> for
+ * \c count points, using AVX2 when the CPU supports it. \c phi is computed with
+ * the precision of \ref fast_atan2. The \c z coordinate is left untouched.
+ */
+void to_cylindrical(const float *x, const float *y, std::size_t count,
+                    float *r, float *phi);
+
+/**
+ * \brief Converts points from Cartesian to cylindrical coordinates, with \c phi
+ *        in the compact representation.
+ *
+ * Same as \ref to_cylindrical, but \c phi is written directly in the format of
+ * \ref compact_hit::phi (truncated like \ref radians_to_compact). Because of
+ * the approximation, the result can differ by one unit from
+ * <tt>radians_to_compact(std::atan2(y, x))</tt> close to bin edges. An angle of
+ * exactly pi is stored as -pi.
+ */
+void to_cylindrical_compact(const float *x, const float *y, std::size_t count,
+                            float *r, std::int16_t *phi);
+
+#endif // CYLINDRICAL_H
@@ -1,55 +1,96 @@
 #include "doublet_finder.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cmath>
+#include <numeric>
+#include <type_traits>
 
+#include "dz_kernels.h"
 #include "fast_sincos.h"
+#include "hitutils.h"
+#include "radix_sort.h"
 
-std::vector<cpu_doublet_finder::hit_type> cpu_doublet_finder::convert(
-        const std::vector<hit> &hits, int layer) const
+cpu_doublet_finder::hit_container_type cpu_doublet_finder::convert(
+        const hit_columns &hits, int layer) const
 {
-    std::vector<hit_type> res;
+    // Allocated like the input, eg in the arena of the event
+    hit_container_type res(hits.resource());
     res.reserve(hits.size());
-    for (const hit &h : hits) {
-        res.emplace_back(h, 1);
+    for (std::size_t i = 0; i < hits.size(); ++i) {
+        res.push_back(compact_hit(hits[i], layer));
     }
     return res;
 }
 
-std::size_t cpu_doublet_finder::get_doublets(
-    std::vector<cpu_doublet_finder::doublet_type> &output)
+void cpu_doublet_finder::sort_hits(cpu_doublet_finder::hit_container_type &layer)
 {
-    if (output.size() == 0) {
-        std::swap(_doublets, output);
-        return output.size();
-    } else {
-        std::size_t count = _doublets.size();
-        std::copy(_doublets.begin(), _doublets.end(),
-                  std::back_inserter(output));
-        _doublets.clear();
-        return count;
-    }
+#ifdef TRACKELLA_RADIX_SORT
+    radix_sort_by_phi(layer);
+#else
+    sort_by_phi(layer);
+#endif
 }
 
-void cpu_doublet_finder::sort_hits(
-        std::vector<cpu_doublet_finder::hit_type> &layer1,
-        std::vector<cpu_doublet_finder::hit_type> &layer2)
+void cpu_doublet_finder::sort_hits(cpu_doublet_finder::hit_container_type &layer,
+                                   const std::pmr::vector<std::size_t> &offsets)
 {
-    std::sort(layer1.begin(),
-              layer1.end(),
-              [](const hit_type &a, const hit_type &b) {
-                  return a.phi < b.phi;
-              });
-    std::sort(layer2.begin(),
-              layer2.end(),
-              [](const hit_type &a, const hit_type &b) {
-                  return a.phi < b.phi;
-              });
+#ifdef TRACKELLA_RADIX_SORT
+    // Allocated like the hits, eg in the arena of the event
+    std::pmr::vector<std::uint32_t> order(layer.resource()), scratch(layer.resource());
+    segmented_radix_sort_order(layer.phi.data(), offsets, order, scratch);
+    layer.permute(order);
+#else
+    segmented_sort_by_phi(layer, offsets);
+#endif
 }
 
 namespace /* anonymous */
 {
+    /// \brief Half width of the phi window
+    const constexpr std::int16_t window_width = radians_to_compact(0.04);
+
+    /**
+     * \brief Returns <tt>cos(angle) * 2^8</tt> for a compact angle.
+     *
+     * Uses a table with 1024 entries. The error on the result is at most 0.6%
+     * of 2^8, which is negligible when multiplied by the beam spot radius.
+     */
+    int cos_times_256(std::int16_t angle)
+    {
+        static const std::array<std::int16_t, 1024> table = []() {
+            std::array<std::int16_t, 1024> result;
+            for (std::size_t i = 0; i < result.size(); ++i) {
+                float radians = compact_to_radians(std::int16_t(i << 6));
+                result[i] = std::lround(std::cos(radians) * (1 << 8));
+            }
+            return result;
+        }();
+        // Round to the closest entry
+        return table[(std::uint16_t(angle + (1 << 5)) >> 6) & 1023];
+    }
+
+    /// \brief Returns the average radius of a pixel barrel layer
+    int layer_radius(int layer)
+    {
+        return length_to_compact<int>(geom::pixel_barrel_radius[layer]);
+    }
+
+    /**
+     * \brief Returns the radius of the inner or outer layer of \c Pair, or
+     *        \c runtime for a \ref dynamic_layer_pair
+     */
+    template<class Pair>
+    constexpr int layer_radius(int runtime, bool inner)
+    {
+        if constexpr (std::is_same<Pair, dynamic_layer_pair>::value) {
+            return runtime;
+        } else {
+            return inner ? Pair::inner_r : Pair::outer_r;
+        }
+    }
+
     /**
      * \brief Checks that the z component of the impact parameter is within the
      *        beam spot
@@ -57,18 +98,18 @@ namespace /* anonymous */
      * The error on the computed value is about 1.4mm.
      */
     bool check_dz(const compact_hit &inner,
-                  const compact_hit &outer,
+                  std::int16_t outer_dr,
+                  std::int32_t outer_z,
                   int rb_proj,
-                  int b_dz)
+                  int b_dz,
+                  int inner_layer_r,
+                  int outer_layer_r)
     {
-        const constexpr int layer_1_r = length_to_compact<int>(3);
-        const constexpr int layer_2_r = length_to_compact<int>(6.8);
-
-        int inner_r = layer_1_r + inner.dr;
-        int outer_r = layer_2_r + outer.dr;
+        int inner_r = inner_layer_r + inner.dr;
+        int outer_r = outer_layer_r + outer_dr;
 
         int num_xi = inner_r - rb_proj;
-        int dz = outer.z - inner.z;
+        int dz = outer_z - inner.z;
 
         int dr = outer_r - inner_r;
 
@@ -82,168 +123,488 @@ namespace /* anonymous */
 
         return std::abs(dz_times_dr) < bound;
     }
+
+    /**
+     * \brief Returns where a hit pair crosses the beam line, relative to the
+     *        beam spot (cm), computed like in \ref check_dz
+     */
+    float impact_z(const dz_inner_hit &inner,
+                   std::int16_t outer_dr,
+                   std::int32_t outer_z)
+    {
+        int dz = (outer_z - inner.z) >> 8;
+        int dr = (inner.outer_r + outer_dr - inner.r) >> 8;
+
+        int dz_times_dr = dr * inner.b_dz - dz * inner.num_xi;
+
+        return compact_to_length(float(dz_times_dr) / dr * (1 << 8));
+    }
+
+    /// \brief Same as above, with the arguments of \ref check_dz
+    float impact_z(const compact_hit &inner,
+                   std::int16_t outer_dr,
+                   std::int32_t outer_z,
+                   int rb_proj,
+                   int b_dz,
+                   int inner_layer_r,
+                   int outer_layer_r)
+    {
+        const int inner_r = inner_layer_r + inner.dr;
+        const dz_inner_hit hit{
+            inner_r, inner.z, (inner_r - rb_proj) >> 8, b_dz, outer_layer_r, 0
+        };
+        return impact_z(hit, outer_dr, outer_z);
+    }
+
+    /**
+     * \brief Returns where a doublet crosses the beam line, relative to the
+     *        beam spot (cm), computed like in \ref check_dz.
+     *
+     * Only depends on the two hits, so the doublets kept by the vertex
+     * windows don't depend on the chunk they are produced in.
+     */
+    float impact_z(const compact_hit &inner,
+                   std::int16_t outer_dr,
+                   std::int32_t outer_z,
+                   const compact_beam_spot &bs,
+                   int inner_layer_r,
+                   int outer_layer_r)
+    {
+        const int rb_proj = cos_times_256(bs.phi - inner.phi) * bs.r >> 8;
+        return impact_z(inner, outer_dr, outer_z, rb_proj, (inner.z - bs.z) >> 8,
+                        inner_layer_r, outer_layer_r);
+    }
+
+    /**
+     * \brief Returns \c inner with the exact projection of the beam spot used
+     *        by the above instead of the approximate one, for \c hit
+     */
+    dz_inner_hit impact_inner_hit(dz_inner_hit inner,
+                                  const compact_hit &hit,
+                                  const compact_beam_spot &bs)
+    {
+        inner.num_xi = (inner.r - (cos_times_256(bs.phi - hit.phi) * bs.r >> 8)) >> 8;
+        return inner;
+    }
+
+    // The dz kernels write doublets as packed 32-bit integers
+    static_assert(sizeof(cpu_doublet_finder::doublet_type) == sizeof(std::uint32_t),
+                  "doublets must be packed to be written by the dz kernels");
 } // namespace anonymous
 
 void cpu_doublet_finder::find(
         const cpu_doublet_finder::beam_spot_type &bs,
-        const std::vector<cpu_doublet_finder::hit_type> &layer1,
-        const std::vector<cpu_doublet_finder::hit_type> &layer2)
+        const geom::layer_pair &layers,
+        const cpu_doublet_finder::hit_span_type &inner,
+        const cpu_doublet_finder::hit_span_type &outer)
 {
-    if (layer1.empty() || layer2.empty()) {
+    _bs = bs;
+    _inner_hits = outer.empty() ? hit_span_type() : inner;
+    _outer_hits = outer;
+    _inner_layer_r = layer_radius(layers.inner);
+    _outer_layer_r = layer_radius(layers.outer);
+    _kernel = select_dz_kernel(layers);
+
+    // Use a specialized loop if there is one
+    const constexpr std::size_t pair_count = geom::consecutive_layer_pairs.size();
+    static const std::array<produce_function, pair_count> table =
+        make_produce_table(std::make_index_sequence<pair_count>());
+    _produce = &cpu_doublet_finder::produce<dynamic_layer_pair>;
+    for (std::size_t i = 0; i < pair_count; ++i) {
+        if (geom::consecutive_layer_pairs[i].inner == layers.inner
+            && geom::consecutive_layer_pairs[i].outer == layers.outer) {
+            _produce = table[i];
+        }
+    }
+
+    _sector_count = 1;
+    _sectors[0] = sector();
+
+    if (_inner_hits.empty()) {
         return;
     }
 
-    std::size_t index = 0;
+    // With ghost hits around +-pi, the window never wraps around and a single
+    // pass covers the whole circle
+    _outer.fill(outer.phi, outer.dr, outer.z, outer.size(),
+                1 << 16, window_width);
+
+    // Split the inner layer in sectors with the same number of hits. The
+    // boundaries are multiples of 64, where produce resynchronizes the sine
+    // and cosine, so the doublets are the same as with a single sector.
+    const std::size_t size1 = _inner_hits.size();
+    if (_pool != nullptr) {
+        _sector_count = std::min({ _pool->threads(),
+                                   size1 / min_hits_per_sector,
+                                   _chunk_capacity });
+        _sector_count = std::max<std::size_t>(_sector_count, 1);
+    }
+    if (_sectors.size() < _sector_count) {
+        _sectors.resize(_sector_count);
+    }
 
-    _doublets.resize(layer1.size() * layer2.size() / 64);
+    const std::int32_t *phi2_begin = _outer.phi.data();
+    const std::int32_t *phi2_end = phi2_begin + _outer.size();
+    for (std::size_t i = 0; i < _sector_count; ++i) {
+        sector &s = _sectors[i];
+        const std::size_t begin = (size1 * i / _sector_count) & ~std::size_t(63);
+        s.end = (i + 1 == _sector_count ? size1 : (size1 * (i + 1) / _sector_count) & ~std::size_t(63));
+        s.i1 = begin;
+        s.in_window = false;
+        s.candidates = 0;
+        s.sincos = fast_sincos(bs.phi - inner.phi[begin]);
+
+        // The windows only move forward, start from the one of the first hit
+        const std::int32_t phi_low = inner.phi[begin] - window_width;
+        s.range_begin = std::lower_bound(phi2_begin, phi2_end, phi_low) - phi2_begin;
+        s.range_end = s.range_begin;
+    }
+}
 
-    const std::int16_t window_width = radians_to_compact(0.04);
+template<class Pair>
+std::size_t cpu_doublet_finder::produce(cpu_doublet_finder::sector &s,
+                                        std::size_t capacity) const
+{
+    // The kernels store whole vectors
+    s.doublets.resize(capacity + dz_kernel_padding);
+    std::size_t count = 0;
 
-    fast_sincos sincos(bs.phi - layer1.front().phi);
-    std::size_t iterations = 0;
+    // The phi scan only ever touches this column
+    const std::int32_t *phi2 = _outer.phi.data();
+    const std::size_t size2 = _outer.size();
 
-    auto range_begin = layer2.begin();
-    auto range_end = range_begin;
+    const int inner_layer_r = layer_radius<Pair>(_inner_layer_r, true);
+    const int outer_layer_r = layer_radius<Pair>(_outer_layer_r, false);
 
-    for (auto it1 = layer1.begin(); it1 != layer1.end(); ++it1) {
-        const auto &inner = *it1;
+    // The windows can be set in the middle of the window of an inner hit
+    if (_windows != nullptr && s.in_window) {
+        s.impact = impact_inner_hit(s.inner, _inner_hits[s.i1], _bs);
+    }
 
-        sincos.step(bs.phi - inner.phi);
-        if (iterations % 64 == 0) {
-            sincos.sync(bs.phi - inner.phi);
-        }
-        iterations++;
+    while (s.i1 < s.end && count < capacity) {
+        if (!s.in_window) {
+            const compact_hit inner = _inner_hits[s.i1];
 
-        int rb_proj = sincos.cos_times(bs.r);
-        int b_dz = (inner.z - bs.z) >> 8;
+            s.sincos.step(_bs.phi - inner.phi);
+            if (s.i1 % 64 == 0) {
+                s.sincos.sync(_bs.phi - inner.phi);
+            }
 
-        // We can't use an int16 here, else it wraps around in the first
-        // iteration, gets negative and the condition in the while loop is
-        // always false
-        const int phi_low = inner.phi - window_width;
-        while (range_begin->phi < phi_low && range_begin != layer2.end()) {
-            ++range_begin;
-        }
+            int rb_proj = s.sincos.cos_times(_bs.r);
 
-        // We can't use an int16 here, else it wraps around and the break
-        // below happens too early.
-        const int phi_high = inner.phi + window_width;
-        while (range_end->phi <= phi_high && range_end != layer2.end()) {
-            ++range_end;
-        }
+            // Computed as int, the window extends beyond +-pi like the ghosts
+            const int phi_low = inner.phi - window_width;
+            while (s.range_begin != size2 && phi2[s.range_begin] < phi_low) {
+                ++s.range_begin;
+            }
 
-        for (auto it2 = range_begin; it2 != range_end; ++it2) {
-            if (check_dz(inner, *it2, rb_proj, b_dz)) {
-                _doublets[index].first = std::distance(layer1.begin(), it1);
-                _doublets[index].second = std::distance(layer2.begin(), it2);
-                ++index;
+            const int phi_high = inner.phi + window_width;
+            while (s.range_end != size2 && phi2[s.range_end] <= phi_high) {
+                ++s.range_end;
             }
-        }
-    }
 
-    /* Edge cases
-     * ----------
-     *
-     * When the first hit is close to -pi or pi, the search window in the
-     * second layer extends to both the beginning and the end of the list.
-     * The loop above only takes care of the case where both signs are
-     * equal, so we compensate below.
-     */
+            s.candidates += s.range_end - s.range_begin;
 
-    // Recover efficiency near -pi
-    for (auto it1 = layer1.begin(); it1 != layer1.end(); ++it1) {
-        const auto &inner = *it1;
+            s.inner.r = inner_layer_r + inner.dr;
+            s.inner.z = inner.z;
+            s.inner.num_xi = (s.inner.r - rb_proj) >> 8;
+            s.inner.b_dz = (inner.z - _bs.z) >> 8;
+            s.inner.outer_r = outer_layer_r;
+            s.inner.index = s.i1;
 
-        // Here we want to check for the wraparound, so we need int16
-        const std::int16_t phi_low = inner.phi - window_width;
-        if (phi_low < 0) {
-            // Wrapped around
-            break;
-        }
+            if (_windows != nullptr) {
+                // Like z0, without the approximate sine and cosine
+                s.impact = impact_inner_hit(s.inner, inner, _bs);
+            }
 
-        // Need a float to compute the cos
-        float cos = std::cos(compact_to_radians(bs.phi - inner.phi));
-        int rb_proj = bs.r * cos;
-        int b_dz = (inner.z - bs.z) >> 8;
+            s.i2 = s.range_begin;
+            s.in_window = true;
+        }
 
-        for (auto it2 = layer2.rbegin(); it2 != layer2.rend(); ++it2) {
-            if (it2->phi < phi_low) {
-                break;
+        // Stop in the middle of the window if the chunk is full
+        const std::size_t end = std::min(s.range_end, s.i2 + capacity - count);
+        // Vectorized check_dz for the contiguous part of the window
+        const std::size_t found = _kernel(
+            s.inner, _outer.r.data(), _outer.z.data(), s.i2, end,
+            reinterpret_cast<std::uint32_t *>(&s.doublets[count]));
+
+        // Map ghosts back to the hits they were copied from
+        const std::size_t found_end = count + found;
+        if (_windows == nullptr) {
+            for (std::size_t i = count; i < found_end; ++i) {
+                s.doublets[i].second = _outer.index[s.doublets[i].second];
             }
-            if (check_dz(inner, *it2, rb_proj, b_dz)) {
-                _doublets[index].first = std::distance(layer1.begin(), it1);
-                _doublets[index].second = std::distance(it2, layer2.rend()) - 1;
-                ++index;
+            count = found_end;
+        } else {
+            // Only keep the doublets pointing to a vertex. Every doublet is
+            // written to avoid mispredicted branches.
+            for (std::size_t i = count; i < found_end; ++i) {
+                const std::uint16_t j = s.doublets[i].second;
+                const bool keep = _windows->contains(impact_z(s.impact, _outer.r[j], _outer.z[j]));
+                s.doublets[count].first = s.doublets[i].first;
+                s.doublets[count].second = _outer.index[j];
+                count += keep;
             }
         }
+
+        s.i2 = end;
+        if (s.i2 == s.range_end) {
+            s.in_window = false;
+            ++s.i1;
+        }
     }
 
-    // Recover efficiency near +pi
-    for (auto it1 = layer1.rbegin(); it1 != layer1.rend(); ++it1) {
-        const auto &inner = *it1;
+    return count;
+}
 
-        // Here we want to check for the wraparound, so we need int16
-        const std::int16_t phi_high = inner.phi + window_width;
-        if (phi_high > 0) {
-            // Wrapped around
-            break;
-        }
+template<std::size_t... I>
+std::array<cpu_doublet_finder::produce_function, sizeof...(I)>
+    cpu_doublet_finder::make_produce_table(std::index_sequence<I...>)
+{
+    return {{
+        &cpu_doublet_finder::produce<
+            static_layer_pair<geom::consecutive_layer_pairs[I].inner,
+                              geom::consecutive_layer_pairs[I].outer>>...
+    }};
+}
+
+std::size_t cpu_doublet_finder::get_doublets(
+    std::pmr::vector<cpu_doublet_finder::doublet_type> &output)
+{
+    if (_produce == nullptr) {
+        return 0;
+    }
+
+    if (_sector_count == 1) {
+        sector &s = _sectors[0];
+        const std::size_t count = (this->*_produce)(s, _chunk_capacity);
+        output.insert(output.end(), s.doublets.begin(), s.doublets.begin() + count);
+        return count;
+    }
+
+    // Every sector gets a share of the chunk. The output is concatenated in
+    // sector order, so it doesn't depend on the scheduling.
+    const std::size_t capacity = _chunk_capacity / _sector_count;
+    std::array<std::size_t, 64> counts{};
+    _pool->run(_sector_count, [&](std::size_t i) {
+        counts[i] = (this->*_produce)(_sectors[i], capacity);
+    });
+
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < _sector_count; ++i) {
+        const sector &s = _sectors[i];
+        output.insert(output.end(), s.doublets.begin(), s.doublets.begin() + counts[i]);
+        total += counts[i];
+    }
+    return total;
+}
+
+void cpu_doublet_finder::set_threads(std::size_t threads)
+{
+    threads = std::min<std::size_t>(threads, max_threads);
+    if (threads <= 1) {
+        _pool.reset();
+    } else if (_pool == nullptr || _pool->threads() != threads) {
+        _pool = std::make_unique<fork_join_pool>(threads);
+    }
+}
+
+std::size_t cpu_doublet_finder::candidates() const
+{
+    std::size_t candidates = 0;
+    for (std::size_t i = 0; i < _sector_count; ++i) {
+        candidates += _sectors[i].candidates;
+    }
+    return candidates;
+}
+
+float cpu_doublet_finder::z0(const cpu_doublet_finder::doublet_type &doublet) const
+{
+    // Same as the check against the vertex windows in produce
+    const compact_hit outer = _outer_hits[doublet.second];
+    return impact_z(_inner_hits[doublet.first], outer.dr, outer.z, _bs,
+                    _inner_layer_r, _outer_layer_r);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void grid_doublet_finder::sort_hits(grid_doublet_finder::hit_container_type &)
+{
+}
+
+void grid_doublet_finder::sort_hits(grid_doublet_finder::hit_container_type &,
+                                    const std::pmr::vector<std::size_t> &)
+{
+}
+
+void grid_doublet_finder::find(
+        const grid_doublet_finder::beam_spot_type &bs,
+        const geom::layer_pair &layers,
+        const grid_doublet_finder::hit_span_type &inner,
+        const grid_doublet_finder::hit_span_type &outer)
+{
+    static_assert((1 << bin_shift) >= window_width,
+                  "The window must not extend further than the next bin");
+    static_assert(bin_count >= 3, "Neighbouring bins must be distinct");
+
+    _bs = bs;
+    _inner_hits = outer.empty() ? hit_span_type() : inner;
+    _outer_hits = outer;
+    _inner_layer_r = layer_radius(layers.inner);
+    _outer_layer_r = layer_radius(layers.outer);
+    _i1 = 0;
+    _in_window = false;
+    _candidates = 0;
+
+    if (_inner_hits.empty()) {
+        return;
+    }
+
+    // Build the grid with a counting sort on the cell index
+    _cell_offsets.assign(cell_count + 1, 0);
+    std::int16_t min_dr = outer.dr[0], max_dr = outer.dr[0];
+    for (std::size_t i = 0; i < outer.size(); ++i) {
+        ++_cell_offsets[cell(outer.phi[i], outer.z[i]) + 1];
+        min_dr = std::min(min_dr, outer.dr[i]);
+        max_dr = std::max(max_dr, outer.dr[i]);
+    }
+    std::partial_sum(_cell_offsets.begin(), _cell_offsets.end(), _cell_offsets.begin());
+
+    _cells.dr.resize(outer.size());
+    _cells.phi.resize(outer.size());
+    _cells.z.resize(outer.size());
+    _cell_hit_index.resize(outer.size());
+    _cell_next.assign(_cell_offsets.begin(), _cell_offsets.end() - 1);
+    for (std::uint32_t i = 0; i < outer.size(); ++i) {
+        std::uint32_t j = _cell_next[cell(outer.phi[i], outer.z[i])]++;
+        _cells.dr[j] = outer.dr[i];
+        _cells.phi[j] = outer.phi[i];
+        _cells.z[j] = outer.z[i];
+        _cell_hit_index[j] = i;
+    }
+
+    // Used to bound the extrapolation to the second layer
+    _outer_r_min = compact_to_length(_outer_layer_r + min_dr);
+    _outer_r_max = compact_to_length(_outer_layer_r + max_dr);
+}
 
-        // Need a float to compute the cos
-        float cos = std::cos(compact_to_radians(bs.phi - inner.phi));
-        int rb_proj = bs.r * cos;
-        int b_dz = (inner.z - bs.z) >> 8;
+std::size_t grid_doublet_finder::get_doublets(
+    std::pmr::vector<grid_doublet_finder::doublet_type> &output)
+{
+    _doublets.resize(_chunk_capacity);
+    std::size_t count = 0;
+
+    const float bs_z = compact_to_length(_bs.z);
+
+    // Covers the approximations made in check_dz
+    const float z_margin = 0.5;
+
+    while (_i1 < _inner_hits.size() && count < _chunk_capacity) {
+        if (!_in_window) {
+            _inner = _inner_hits[_i1];
+            _rb_proj = cos_times_256(_bs.phi - _inner.phi) * _bs.r >> 8;
+            _b_dz = (_inner.z - _bs.z) >> 8;
+            _range_count = 0;
+            _range = 0;
+            _in_window = true;
+
+            // z range on the second layer for lines that cross the beam line
+            // within 11 cm of the beam spot, or within the vertex windows:
+            //   z2 = z1 + (z1 - z0) * (r2 - r1) / (r1 - rb)
+            const float inner_r = compact_to_length(_inner_layer_r + _inner.dr);
+            const float inner_z = compact_to_length(_inner.z);
+            const float lever = inner_r - compact_to_length(_rb_proj);
+            const float t_min = (_outer_r_min - inner_r) / lever;
+            const float t_max = (_outer_r_max - inner_r) / lever;
+            const float z0_high = _windows == nullptr ? 11 : _windows->high();
+            const float z0_low = _windows == nullptr ? -11 : _windows->low();
+            const float dz_low = inner_z - (bs_z + z0_high);
+            const float dz_high = inner_z - (bs_z + z0_low);
+            const float z_low = std::max(-100.f, inner_z - z_margin
+                                         + std::min(dz_low * t_min, dz_low * t_max));
+            const float z_high = std::min(100.f, inner_z + z_margin
+                                          + std::max(dz_high * t_min, dz_high * t_max));
+            if (z_low <= z_high) {
+                const int first_z_bin = z_bin(length_to_compact<std::int32_t>(z_low));
+                const int last_z_bin = z_bin(length_to_compact<std::int32_t>(z_high));
+
+                // Bins overlapping with the window (2 or 3), can be out of range
+                const int first = (_inner.phi + (1 << 15) - window_width) >> bin_shift;
+                const int last = (_inner.phi + (1 << 15) + window_width) >> bin_shift;
+                for (int b = first; b <= last; ++b) {
+                    // Wrap around at +-pi
+                    const int wrapped = b & (bin_count - 1);
+
+                    // The z bins of a phi bin are contiguous
+                    const std::uint32_t begin = _cell_offsets[wrapped * z_bin_count + first_z_bin];
+                    const std::uint32_t end = _cell_offsets[wrapped * z_bin_count + last_z_bin + 1];
+                    _candidates += end - begin;
+                    _ranges[_range_count++] = { begin, end };
+                }
+            }
+            if (_range_count > 0) {
+                _i2 = _ranges[0].first;
+            }
+        }
 
-        for (auto it2 = layer2.begin(); it2 != layer2.end(); ++it2) {
-            if (it2->phi > phi_high) {
-                break;
+        while (_range < _range_count && count < _chunk_capacity) {
+            const std::size_t end = _ranges[_range].second;
+            for (; _i2 < end && count < _chunk_capacity; ++_i2) {
+                // Wraps around like the angle
+                const std::int16_t dphi = _cells.phi[_i2] - _inner.phi;
+                if (std::abs(dphi) <= window_width
+                    && check_dz(_inner, _cells.dr[_i2], _cells.z[_i2], _rb_proj, _b_dz,
+                                _inner_layer_r, _outer_layer_r)
+                    && (_windows == nullptr
+                        || _windows->contains(impact_z(_inner, _cells.dr[_i2], _cells.z[_i2],
+                                                         _rb_proj, _b_dz,
+                                                         _inner_layer_r, _outer_layer_r)))) {
+                    _doublets[count].first = _i1;
+                    _doublets[count].second = _cell_hit_index[_i2];
+                    ++count;
+                }
             }
-            if (check_dz(inner, *it2, rb_proj, b_dz)) {
-                _doublets[index].first = std::distance(it1, layer1.rend()) - 1;
-                _doublets[index].second = std::distance(layer2.begin(), it2);
-                ++index;
+            if (_i2 == end && ++_range < _range_count) {
+                _i2 = _ranges[_range].first;
             }
         }
+
+        if (_range == _range_count) {
+            _in_window = false;
+            ++_i1;
+        }
     }
 
-    _doublets.resize(index);
+    output.insert(output.end(), _doublets.begin(), _doublets.begin() + count);
+    return count;
+}
+
+float grid_doublet_finder::z0(const grid_doublet_finder::doublet_type &doublet) const
+{
+    // Same as the check against the vertex windows in get_doublets
+    const compact_hit outer = _outer_hits[doublet.second];
+    return impact_z(_inner_hits[doublet.first], outer.dr, outer.z, _bs,
+                    _inner_layer_r, _outer_layer_r);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-std::size_t float_doublet_finder::get_doublets(
-    std::vector<float_doublet_finder::doublet_type> &output)
+void float_doublet_finder::sort_hits(float_doublet_finder::hit_container_type &layer)
 {
-    if (output.size() == 0) {
-        std::swap(_doublets, output);
-        return output.size();
-    } else {
-        std::size_t count = _doublets.size();
-        std::copy(_doublets.begin(), _doublets.end(),
-                  std::back_inserter(output));
-        _doublets.clear();
-        return count;
-    }
+    sort_by_phi(layer);
 }
 
-void float_doublet_finder::sort_hits(
-        std::vector<float_doublet_finder::hit_type> &layer1,
-        std::vector<float_doublet_finder::hit_type> &layer2)
+void float_doublet_finder::sort_hits(float_doublet_finder::hit_container_type &layer,
+                                     const std::pmr::vector<std::size_t> &offsets)
 {
-    std::sort(layer1.begin(),
-              layer1.end(),
-              [](const hit_type &a, const hit_type &b) {
-                  return a.phi < b.phi;
-              });
-    std::sort(layer2.begin(),
-              layer2.end(),
-              [](const hit_type &a, const hit_type &b) {
-                  return a.phi < b.phi;
-              });
+    segmented_sort_by_phi(layer, offsets);
 }
 
 namespace /* anonymous */
 {
+    /// \brief Half width of the phi window (rad)
+    const constexpr float float_window_width = 0.04f;
+
     /**
      * \brief Checks that the z component of the impact parameter is within the
      *        beam spot
@@ -251,14 +612,15 @@ namespace /* anonymous */
      * The error on the computed value is about 1.4mm.
      */
     bool float_check_dz(const hit &inner,
-                  const hit &outer,
-                  float rb_proj,
-                  float b_dz)
+                        float outer_r,
+                        float outer_z,
+                        float rb_proj,
+                        float b_dz)
     {
         float num_xi = inner.r - rb_proj;
-        float dz = outer.z - inner.z;
+        float dz = outer_z - inner.z;
 
-        float dr = outer.r - inner.r;
+        float dr = outer_r - inner.r;
 
         float dz_times_dr = dr * b_dz - dz * num_xi;
 
@@ -266,122 +628,127 @@ namespace /* anonymous */
 
         return std::abs(dz_times_dr) < bound;
     }
+
+    /**
+     * \brief Returns where a hit pair crosses the beam line, relative to the
+     *        beam spot (cm), computed like in \ref float_check_dz
+     */
+    float float_impact_z(const hit &inner,
+                         float outer_r,
+                         float outer_z,
+                         float rb_proj,
+                         float b_dz)
+    {
+        float num_xi = inner.r - rb_proj;
+        float dz = outer_z - inner.z;
+
+        float dr = outer_r - inner.r;
+
+        return b_dz - dz * num_xi / dr;
+    }
 } // namespace anonymous
 
 void float_doublet_finder::find(
         const float_doublet_finder::beam_spot_type &bs,
-        const std::vector<float_doublet_finder::hit_type> &layer1,
-        const std::vector<float_doublet_finder::hit_type> &layer2)
+        const geom::layer_pair &,
+        const float_doublet_finder::hit_span_type &inner,
+        const float_doublet_finder::hit_span_type &outer)
 {
-    if (layer1.empty() || layer2.empty()) {
+    _bs = bs;
+    _inner_hits = outer.empty() ? hit_span_type() : inner;
+    _outer_hits = outer;
+    _i1 = 0;
+    _range_begin = 0;
+    _range_end = 0;
+    _in_window = false;
+    _candidates = 0;
+
+    if (_inner_hits.empty()) {
         return;
     }
 
-    std::size_t index = 0;
-
-    _doublets.resize(layer1.size() * layer2.size() / 64);
-
-    const float window_width = 0.04f;
+    // With ghost hits around +-pi, the window never wraps around and a single
+    // pass covers the whole circle
+    _outer.fill(outer.phi, outer.r, outer.z, outer.size(),
+                2 * pi, float_window_width);
 
-    fast_float_sincos sincos(bs.phi - layer1.front().phi);
-    std::size_t iterations = 0;
+    _sincos = fast_float_sincos(bs.phi - inner.phi[0]);
+}
 
-    auto range_begin = layer2.begin();
-    auto range_end = range_begin;
+std::size_t float_doublet_finder::get_doublets(
+    std::pmr::vector<float_doublet_finder::doublet_type> &output)
+{
+    _doublets.resize(_chunk_capacity);
+    std::size_t count = 0;
 
-    for (auto it1 = layer1.begin(); it1 != layer1.end(); ++it1) {
-        const auto &inner = *it1;
+    // The phi scan only ever touches this column
+    const float *phi2 = _outer.phi.data();
+    const std::size_t size1 = _inner_hits.size();
+    const std::size_t size2 = _outer.size();
 
-        sincos.step(bs.phi - inner.phi);
-        if (iterations % 64 == 0) {
-            sincos.sync(bs.phi - inner.phi);
-        }
-        iterations++;
+    // The windows can be set in the middle of the window of an inner hit
+    if (_windows != nullptr && _in_window) {
+        _impact_rb_proj = _bs.r * std::cos(_bs.phi - _inner.phi);
+    }
 
-        float rb_proj = sincos.cos_times(bs.r);
-        float b_dz = inner.z - bs.z;
+    while (_i1 < size1 && count < _chunk_capacity) {
+        if (!_in_window) {
+            _inner = _inner_hits[_i1];
 
-        float phi_low = inner.phi - window_width;
-        while (range_begin->phi < phi_low && range_begin != layer2.end()) {
-            ++range_begin;
-        }
+            _sincos.step(_bs.phi - _inner.phi);
+            if (_i1 % 64 == 0) {
+                _sincos.sync(_bs.phi - _inner.phi);
+            }
 
-        // We can't use an int16 here, else it wraps around and the break
-        // below happens too early.
-        float phi_high = inner.phi + window_width;
-        while (range_end->phi <= phi_high && range_end != layer2.end()) {
-            ++range_end;
-        }
+            _rb_proj = _sincos.cos_times(_bs.r);
+            _b_dz = _inner.z - _bs.z;
+            if (_windows != nullptr) {
+                // Like z0, without the approximate sine and cosine
+                _impact_rb_proj = _bs.r * std::cos(_bs.phi - _inner.phi);
+            }
 
-        for (auto it2 = range_begin; it2 != range_end; ++it2) {
-            if (float_check_dz(inner, *it2, rb_proj, b_dz)) {
-                _doublets[index].first = std::distance(layer1.begin(), it1);
-                _doublets[index].second = std::distance(layer2.begin(), it2);
-                ++index;
+            float phi_low = _inner.phi - float_window_width;
+            while (_range_begin != size2 && phi2[_range_begin] < phi_low) {
+                ++_range_begin;
             }
-        }
-    }
 
-    /* Edge cases
-     * ----------
-     *
-     * When the first hit is close to -pi or pi, the search window in the
-     * second layer extends to both the beginning and the end of the list.
-     * The loop above only takes care of the case where both signs are
-     * equal, so we compensate below.
-     */
+            float phi_high = _inner.phi + float_window_width;
+            while (_range_end != size2 && phi2[_range_end] <= phi_high) {
+                ++_range_end;
+            }
 
-    // Recover efficiency near -pi
-    for (auto it1 = layer1.begin(); it1 != layer1.end(); ++it1) {
-        const auto &inner = *it1;
+            _candidates += _range_end - _range_begin;
 
-        const float phi_low = inner.phi - window_width;
-        if (phi_low < 0) {
-            // Wrapped around
-            break;
+            _i2 = _range_begin;
+            _in_window = true;
         }
 
-        // Need a float to compute the cos
-        float rb_proj = bs.r * std::cos(bs.phi - inner.phi);
-        float b_dz = inner.z - bs.z;
-
-        for (auto it2 = layer2.rbegin(); it2 != layer2.rend(); ++it2) {
-            if (it2->phi < phi_low) {
-                break;
-            }
-            if (float_check_dz(inner, *it2, rb_proj, b_dz)) {
-                _doublets[index].first = std::distance(layer1.begin(), it1);
-                _doublets[index].second = std::distance(it2, layer2.rend()) - 1;
-                ++index;
+        for (; _i2 != _range_end && count < _chunk_capacity; ++_i2) {
+            if (float_check_dz(_inner, _outer.r[_i2], _outer.z[_i2], _rb_proj, _b_dz)
+                && (_windows == nullptr
+                    || _windows->contains(float_impact_z(_inner, _outer.r[_i2], _outer.z[_i2],
+                                                         _impact_rb_proj, _b_dz)))) {
+                _doublets[count].first = _i1;
+                _doublets[count].second = _outer.index[_i2];
+                ++count;
             }
         }
-    }
 
-    // Recover efficiency near +pi
-    for (auto it1 = layer1.rbegin(); it1 != layer1.rend(); ++it1) {
-        const auto &inner = *it1;
-
-        const float phi_high = inner.phi + window_width;
-        if (phi_high > 0) {
-            // Wrapped around
-            break;
-        }
-
-        // Need a float to compute the cos
-        float rb_proj = bs.r * std::cos(bs.phi - inner.phi);
-        float b_dz = inner.z - bs.z;
-
-        for (auto it2 = layer2.begin(); it2 != layer2.end(); ++it2) {
-            if (it2->phi > phi_high) {
-                break;
-            }
-            if (float_check_dz(inner, *it2, rb_proj, b_dz)) {
-                _doublets[index].first = std::distance(it1, layer1.rend()) - 1;
-                _doublets[index].second = std::distance(layer2.begin(), it2);
-                ++index;
-            }
+        if (_i2 == _range_end) {
+            _in_window = false;
+            ++_i1;
         }
     }
 
-    _doublets.resize(index);
+    output.insert(output.end(), _doublets.begin(), _doublets.begin() + count);
+    return count;
+}
+
+float float_doublet_finder::z0(const float_doublet_finder::doublet_type &doublet) const
+{
+    // Same as the check against the vertex windows in get_doublets
+    const hit inner = _inner_hits[doublet.first];
+    const hit outer = _outer_hits[doublet.second];
+    const float rb_proj = _bs.r * std::cos(_bs.phi - inner.phi);
+    return float_impact_z(inner, outer.r, outer.z, rb_proj, inner.z - _bs.z);
 }
@@ -1,12 +1,29 @@
 #ifndef DOUBLET_FINDER_H
 #define DOUBLET_FINDER_H
 
+#include <array>
 #include <chrono>
 #include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <new>
 #include <vector>
 #include <utility>
 
 #include "compact.h"
+#include "dz_kernels.h"
+#include "fast_sincos.h"
+#include "fork_join_pool.h"
+#include "geometry.h"
+#include "ghost_hits.h"
+#include "perf_counters.h"
+#include "vertex_finder.h"
+
+/**
+ * \brief Default number of doublets the finders produce per call to
+ *        \c get_doublets (16 kB)
+ */
+const constexpr std::size_t default_chunk_capacity = 4096;
 
 template<class FinderImpl>
 class doublet_finder_wrapper
@@ -15,56 +32,515 @@ public:
     using finder_type = FinderImpl;
     using doublet_type = typename finder_type::doublet_type;
     using hit_type = typename finder_type::hit_type;
+    using hit_container_type = typename finder_type::hit_container_type;
+    using hit_span_type = typename finder_type::hit_span_type;
 
     using clock_type = std::chrono::high_resolution_clock;
     using duration_type = std::chrono::duration<double>;
 
+    /// \brief Number of pixel barrel layers
+    static const constexpr std::size_t layer_count = geom::pixel_barrel_radius.size();
+
     struct finding_results {
+        finding_results() = default;
+
+        /// \brief Constructor, the vectors are allocated from \c resource
+        explicit finding_results(std::pmr::memory_resource *resource) :
+            doublets(resource), pair_offsets(resource), vertices(resource)
+        {}
+
         duration_type formatting, sorting, finding, total;
-        std::vector<doublet_type> doublets;
+
+        /// \brief Hardware counters of every stage, zero unless \ref counters is enabled
+        counter_values formatting_counters, sorting_counters, finding_counters;
+
+        /// \brief Doublets of all pairs, indices refer to the layers of the pair
+        std::pmr::vector<doublet_type> doublets;
+
+        /**
+         * \brief The doublets of pair \c i are <tt>doublets[pair_offsets[i]]</tt>
+         *        to <tt>doublets[pair_offsets[i + 1]]</tt> (excluded)
+         */
+        std::pmr::vector<std::size_t> pair_offsets;
+
+        /// \brief Number of hit pairs on which the \c dz check was run
+        std::size_t candidates;
+
+        /**
+         * \brief Primary vertices the doublets were restricted to, relative
+         *        to the beam spot (cm). Empty if none was used.
+         */
+        std::pmr::vector<float> vertices;
     };
 
-    std::vector<hit_type> layer1;
-    std::vector<hit_type> layer2;
+    /// \brief Hits of one event, for \ref find_batch
+    struct batch_event
+    {
+        beam_spot bs;
+        std::array<hit_span, layer_count> hits_per_layer;
+    };
+
+    /**
+     * \brief Results of \ref find_batch, for all events of the batch.
+     *
+     * Doublets are stored one event after the other, and within an event one
+     * pair after the other.
+     */
+    struct batch_results {
+        batch_results() = default;
+
+        /// \brief Constructor, the vectors are allocated from \c resource
+        explicit batch_results(std::pmr::memory_resource *resource) :
+            doublets(resource), pair_offsets(resource),
+            layer_offsets(offsets_per_layer(resource, std::make_index_sequence<layer_count>())),
+            vertices(resource), vertex_offsets(resource)
+        {}
+
+        duration_type formatting, sorting, finding, total;
 
+        /// \brief Doublets of all events, indices refer to the hits of the event
+        std::pmr::vector<doublet_type> doublets;
+
+        /**
+         * \brief The doublets of event \c e in pair \c p are
+         *        <tt>doublets[pair_offsets[e * pairs.size() + p]]</tt> to
+         *        <tt>doublets[pair_offsets[e * pairs.size() + p + 1]]</tt>
+         *        (excluded)
+         */
+        std::pmr::vector<std::size_t> pair_offsets;
+
+        /**
+         * \brief The hits of event \c e in layer \c l are
+         *        <tt>layers[l][layer_offsets[l][e]]</tt> to
+         *        <tt>layers[l][layer_offsets[l][e + 1]]</tt> (excluded)
+         */
+        std::array<std::pmr::vector<std::size_t>, layer_count> layer_offsets;
+
+        /// \brief Number of hit pairs on which the \c dz check was run
+        std::size_t candidates;
+
+        /**
+         * \brief The primary vertices of event \c e are
+         *        <tt>vertices[vertex_offsets[e]]</tt> to
+         *        <tt>vertices[vertex_offsets[e + 1]]</tt> (excluded)
+         */
+        std::pmr::vector<float> vertices;
+        std::pmr::vector<std::size_t> vertex_offsets;
+
+    private:
+        /// \brief Returns one empty vector per layer, allocated from \c resource
+        template<std::size_t... I>
+        static std::array<std::pmr::vector<std::size_t>, layer_count> offsets_per_layer(
+            std::pmr::memory_resource *resource, std::index_sequence<I...>)
+        {
+            return {{ ((void) I, std::pmr::vector<std::size_t>(resource))... }};
+        }
+    };
+
+    /// \brief Layer pairs to look for doublets in
+    std::vector<geom::layer_pair> pairs{ geom::consecutive_layer_pairs.begin(),
+                                         geom::consecutive_layer_pairs.end() };
+
+    /**
+     * \brief Formatted and sorted hits of every layer used by \ref pairs,
+     *        filled by \ref find
+     */
+    std::array<hit_container_type, layer_count> layers;
+
+    /// \brief The finder, reused from one event to the next
+    finder_type finder;
+
+    /**
+     * \brief Whether to look for primary vertices and only keep the doublets
+     *        pointing to one of them.
+     *
+     * The vertices are found in a sample of the doublets of the first pair in
+     * \ref pairs, which should be the innermost one, spread over the whole
+     * pair. The doublets of that pair not pointing to a vertex are then
+     * removed, and the other pairs are checked against narrow windows around
+     * the vertices instead of the whole beam spot.
+     *
+     * Disabled by default: a few percent of the true doublets point outside
+     * of the windows and are lost.
+     */
+    bool use_vertices = false;
+
+    /// \brief Finds the primary vertices, reused from one event to the next
+    vertex_finder vertices;
+
+    /**
+     * \brief Hardware counters read around every stage, disabled by default.
+     *
+     * They count the thread calling the find functions, which must always be
+     * the same.
+     */
+    perf_counters counters;
+
+    /**
+     * \brief Finds doublets in all \ref pairs.
+     *
+     * Every layer is formatted and sorted once, even if it is used by several
+     * pairs. The results and \ref layers are allocated from the memory
+     * resource of \c hits_per_layer, eg the arena of the event.
+     */
     finding_results find(const beam_spot &bs,
-                         std::array<std::vector<hit>, 4> &hits_per_layer);
+                         std::array<hit_columns, layer_count> &hits_per_layer);
+
+    /**
+     * \brief Finds doublets in hits that are already formatted and sorted.
+     *
+     * \ref layers is not used.
+     */
+    finding_results find_sorted(const beam_spot &bs,
+                                const std::array<hit_span_type, layer_count> &hits_per_layer);
+
+    /**
+     * \brief Like \ref find_sorted, but hands the doublets to \c consume one
+     *        chunk at a time instead of storing them in the results.
+     *
+     * \c consume is called with the index of the pair in \ref pairs and the
+     * \c std::vector holding the chunk. Memory use doesn't depend on the
+     * number of doublets, except with \ref use_vertices: the doublets of the
+     * first pair are then kept until the vertices are found, and handed to
+     * \c consume in a single chunk.
+     */
+    template<class Consumer>
+    finding_results find_sorted(const beam_spot &bs,
+                                const std::array<hit_span_type, layer_count> &hits_per_layer,
+                                Consumer &&consume);
+
+    /**
+     * \brief Finds doublets in all \ref pairs of \c count events at once.
+     *
+     * The hits of every layer are packed in a single buffer for all events,
+     * then formatted and sorted in one go, so the fixed costs are paid once
+     * per batch instead of once per event. The packed hits are left in
+     * \ref layers. The results are allocated from \c resource, eg the arena
+     * of the batch.
+     */
+    batch_results find_batch(const batch_event *events, std::size_t count,
+                             std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+private:
+    /**
+     * \brief Finds vertices in <tt>doublets[first]</tt> onwards, removes
+     *        those doublets not pointing to one, restricts \ref finder
+     *        to the vertices and appends them to \c found.
+     *
+     * About \c vertex_finder::max_samples doublets, evenly spread over the
+     * range, are histogrammed. Does nothing if no vertex is found.
+     */
+    void find_vertices(std::pmr::vector<doublet_type> &doublets, std::size_t first,
+                       std::pmr::vector<float> &found);
+
+    /**
+     * \brief Moves \c converted to \c layer, which also takes its memory
+     *        resource
+     */
+    static void replace_layer(hit_container_type &layer, hit_container_type &&converted)
+    {
+        if (layer.resource() == converted.resource()) {
+            layer = std::move(converted);
+        } else {
+            // Assigning would copy to the old resource
+            layer.~hit_container_type();
+            new (&layer) hit_container_type(std::move(converted));
+        }
+    }
+
+    /// \brief Returns which layers are used by \ref pairs
+    std::array<bool, layer_count> used_layers() const
+    {
+        std::array<bool, layer_count> used{};
+        for (const geom::layer_pair &pair : pairs) {
+            used[pair.inner] = true;
+            used[pair.outer] = true;
+        }
+        return used;
+    }
+
+    /// \brief Buffer for \ref find_sorted with a consumer
+    std::pmr::vector<doublet_type> _chunk;
+
+    /// \brief Buffer for \ref find_vertices
+    std::vector<float> _z0;
+
+    /// \brief Hits of all events of a batch, before formatting
+    std::array<hit_columns, layer_count> _packed;
 };
 
 template<class FinderImpl>
 typename doublet_finder_wrapper<FinderImpl>::finding_results
     doublet_finder_wrapper<FinderImpl>::find(
         const beam_spot &bs,
-        std::array<std::vector<hit>, 4> &hits_per_layer)
+        std::array<hit_columns, layer_count> &hits_per_layer)
 {
-    finder_type finder;
-    finding_results r;
+    finding_results r(hits_per_layer.front().resource());
 
+    const counter_values start_counters = counters.read();
     auto start = clock_type::now();
 
+    const auto used = used_layers();
+
     auto converted_bs = finder.convert(bs);
-    layer1 = finder.convert(hits_per_layer[0], 0);
-    layer2 = finder.convert(hits_per_layer[1], 1);
+    for (std::size_t l = 0; l < layer_count; ++l) {
+        if (used[l]) {
+            replace_layer(layers[l], finder.convert(hits_per_layer[l], l));
+        }
+    }
 
     r.formatting = clock_type::now() - start;
+    const counter_values sorting_counters = counters.read();
+    r.formatting_counters = sorting_counters - start_counters;
     auto sorting_start = clock_type::now();
 
-    finder.sort_hits(layer1, layer2);
+    for (std::size_t l = 0; l < layer_count; ++l) {
+        if (used[l]) {
+            finder.sort_hits(layers[l]);
+        }
+    }
 
     r.sorting = clock_type::now() - sorting_start;
+    const counter_values finding_counters = counters.read();
+    r.sorting_counters = finding_counters - sorting_counters;
     auto finding_start = clock_type::now();
 
-    finder.find(converted_bs, layer1, layer2);
+    r.candidates = 0;
+    r.pair_offsets.assign(1, 0);
+    r.vertices.clear();
+    finder.set_z_windows(nullptr);
+    for (std::size_t p = 0; p < pairs.size(); ++p) {
+        const geom::layer_pair &pair = pairs[p];
+        finder.find(converted_bs, pair, layers[pair.inner], layers[pair.outer]);
+
+        const std::size_t first = r.doublets.size();
+        while (finder.get_doublets(r.doublets) != 0) {
+        }
+        if (p == 0 && use_vertices) {
+            find_vertices(r.doublets, first, r.vertices);
+        }
+        r.candidates += finder.candidates();
+        r.pair_offsets.push_back(r.doublets.size());
+    }
+
+    auto end = clock_type::now();
+    r.finding = end - finding_start;
+    r.total = end - start;
+    r.finding_counters = counters.read() - finding_counters;
+
+    return r;
+}
 
-    finder.get_doublets(r.doublets);
+template<class FinderImpl>
+typename doublet_finder_wrapper<FinderImpl>::finding_results
+    doublet_finder_wrapper<FinderImpl>::find_sorted(
+        const beam_spot &bs,
+        const std::array<hit_span_type, layer_count> &hits_per_layer)
+{
+    finding_results r;
+
+    const counter_values start_counters = counters.read();
+    auto start = clock_type::now();
+
+    auto converted_bs = finder.convert(bs);
+
+    auto finding_start = clock_type::now();
+    r.formatting = finding_start - start;
+    r.sorting = duration_type::zero();
+    const counter_values finding_counters = counters.read();
+    r.formatting_counters = finding_counters - start_counters;
+
+    r.candidates = 0;
+    r.pair_offsets.assign(1, 0);
+    r.vertices.clear();
+    finder.set_z_windows(nullptr);
+    for (std::size_t p = 0; p < pairs.size(); ++p) {
+        const geom::layer_pair &pair = pairs[p];
+        finder.find(converted_bs, pair,
+                    hits_per_layer[pair.inner], hits_per_layer[pair.outer]);
+
+        const std::size_t first = r.doublets.size();
+        while (finder.get_doublets(r.doublets) != 0) {
+        }
+        if (p == 0 && use_vertices) {
+            find_vertices(r.doublets, first, r.vertices);
+        }
+        r.candidates += finder.candidates();
+        r.pair_offsets.push_back(r.doublets.size());
+    }
 
     auto end = clock_type::now();
     r.finding = end - finding_start;
     r.total = end - start;
+    r.finding_counters = counters.read() - finding_counters;
 
     return r;
 }
 
+template<class FinderImpl>
+template<class Consumer>
+typename doublet_finder_wrapper<FinderImpl>::finding_results
+    doublet_finder_wrapper<FinderImpl>::find_sorted(
+        const beam_spot &bs,
+        const std::array<hit_span_type, layer_count> &hits_per_layer,
+        Consumer &&consume)
+{
+    finding_results r;
+
+    const counter_values start_counters = counters.read();
+    auto start = clock_type::now();
+
+    auto converted_bs = finder.convert(bs);
+
+    auto finding_start = clock_type::now();
+    r.formatting = finding_start - start;
+    r.sorting = duration_type::zero();
+    const counter_values finding_counters = counters.read();
+    r.formatting_counters = finding_counters - start_counters;
+
+    r.candidates = 0;
+    r.vertices.clear();
+    finder.set_z_windows(nullptr);
+    for (std::size_t p = 0; p < pairs.size(); ++p) {
+        const geom::layer_pair &pair = pairs[p];
+        finder.find(converted_bs, pair,
+                    hits_per_layer[pair.inner], hits_per_layer[pair.outer]);
+
+        _chunk.clear();
+        if (p == 0 && use_vertices) {
+            // The vertices are found in the whole pair
+            while (finder.get_doublets(_chunk) != 0) {
+            }
+            find_vertices(_chunk, 0, r.vertices);
+            if (!_chunk.empty()) {
+                consume(p, _chunk);
+            }
+            _chunk.clear();
+        }
+        while (finder.get_doublets(_chunk) != 0) {
+            consume(p, _chunk);
+            _chunk.clear();
+        }
+        r.candidates += finder.candidates();
+    }
+
+    auto end = clock_type::now();
+    r.finding = end - finding_start;
+    r.total = end - start;
+    r.finding_counters = counters.read() - finding_counters;
+
+    return r;
+}
+
+template<class FinderImpl>
+typename doublet_finder_wrapper<FinderImpl>::batch_results
+    doublet_finder_wrapper<FinderImpl>::find_batch(const batch_event *events,
+                                                   std::size_t count,
+                                                   std::pmr::memory_resource *resource)
+{
+    batch_results r(resource);
+
+    auto start = clock_type::now();
+
+    const auto used = used_layers();
+
+    for (std::size_t l = 0; l < layer_count; ++l) {
+        r.layer_offsets[l].assign(1, 0);
+        if (!used[l]) {
+            continue;
+        }
+
+        hit_columns &packed = _packed[l];
+        packed.clear();
+        for (std::size_t e = 0; e < count; ++e) {
+            const hit_span &hits = events[e].hits_per_layer[l];
+            packed.r.insert(packed.r.end(), hits.r, hits.r + hits.size());
+            packed.phi.insert(packed.phi.end(), hits.phi, hits.phi + hits.size());
+            packed.z.insert(packed.z.end(), hits.z, hits.z + hits.size());
+            r.layer_offsets[l].push_back(packed.size());
+        }
+        replace_layer(layers[l], finder.convert(packed, l));
+    }
+
+    r.formatting = clock_type::now() - start;
+    auto sorting_start = clock_type::now();
+
+    for (std::size_t l = 0; l < layer_count; ++l) {
+        if (used[l]) {
+            finder.sort_hits(layers[l], r.layer_offsets[l]);
+        }
+    }
+
+    r.sorting = clock_type::now() - sorting_start;
+    auto finding_start = clock_type::now();
+
+    r.candidates = 0;
+    r.pair_offsets.assign(1, 0);
+    r.vertex_offsets.assign(1, 0);
+    for (std::size_t e = 0; e < count; ++e) {
+        const auto converted_bs = finder.convert(events[e].bs);
+        finder.set_z_windows(nullptr);
+        for (std::size_t p = 0; p < pairs.size(); ++p) {
+            const geom::layer_pair &pair = pairs[p];
+            const std::pmr::vector<std::size_t> &inner = r.layer_offsets[pair.inner];
+            const std::pmr::vector<std::size_t> &outer = r.layer_offsets[pair.outer];
+            finder.find(converted_bs, pair,
+                        hit_span_type(layers[pair.inner]).subspan(inner[e], inner[e + 1] - inner[e]),
+                        hit_span_type(layers[pair.outer]).subspan(outer[e], outer[e + 1] - outer[e]));
+
+            const std::size_t first = r.doublets.size();
+            while (finder.get_doublets(r.doublets) != 0) {
+            }
+            if (p == 0 && use_vertices) {
+                find_vertices(r.doublets, first, r.vertices);
+            }
+            r.candidates += finder.candidates();
+            r.pair_offsets.push_back(r.doublets.size());
+        }
+        r.vertex_offsets.push_back(r.vertices.size());
+    }
+
+    auto end = clock_type::now();
+    r.finding = end - finding_start;
+    r.total = end - start;
+
+    return r;
+}
+
+template<class FinderImpl>
+void doublet_finder_wrapper<FinderImpl>::find_vertices(
+        std::pmr::vector<doublet_type> &doublets,
+        std::size_t first,
+        std::pmr::vector<float> &found)
+{
+    _z0.resize(doublets.size() - first);
+    for (std::size_t i = first; i < doublets.size(); ++i) {
+        _z0[i - first] = finder.z0(doublets[i]);
+    }
+
+    // Doublets are ordered by inner phi, so a sample taken from the start
+    // would only see part of the detector
+    vertices.clear();
+    const std::size_t stride = (_z0.size() + vertex_finder::max_samples - 1) / vertex_finder::max_samples;
+    for (std::size_t i = 0; i < _z0.size(); i += stride) {
+        vertices.fill(_z0[i]);
+    }
+    if (vertices.find_peaks() == 0) {
+        return;
+    }
+
+    const z_windows &windows = vertices.windows();
+    std::size_t kept = first;
+    for (std::size_t i = first; i < doublets.size(); ++i) {
+        if (windows.contains(_z0[i - first])) {
+            doublets[kept++] = doublets[i];
+        }
+    }
+    doublets.resize(kept);
+    finder.set_z_windows(&windows);
+    found.insert(found.end(), vertices.vertices().begin(), vertices.vertices().end());
+}
+
 class cpu_doublet_finder
 {
 public:
@@ -74,11 +550,17 @@ public:
     /// \brief The type to use for hits
     using hit_type = compact_hit;
 
+    /// \brief The type to use for collections of hits
+    using hit_container_type = compact_hit_columns;
+
+    /// \brief The type to use for views of hits
+    using hit_span_type = compact_hit_span;
+
     /// \brief The type to use for the beam spot
     using beam_spot_type = compact_beam_spot;
 
     /// \brief Convert hits to the correct representation
-    std::vector<hit_type> convert(const std::vector<hit> &hits, int layer) const;
+    hit_container_type convert(const hit_columns &hits, int layer) const;
 
     /// \brief Convert beam spot info to the correct representation
     beam_spot_type convert(const beam_spot &bs) const
@@ -91,31 +573,330 @@ public:
     }
 
     /**
-     * \brief Gets back the produced doublets.
+     * \brief Produces the next chunk of doublets.
+     *
+     * The search started by \ref find runs until at most
+     * \ref chunk_capacity doublets have been found, then stops until the
+     * next call. Call repeatedly to get all doublets.
+     *
+     * \return The number of doublets added to \c output, zero once all
+     *         doublets have been produced.
+     */
+    std::size_t get_doublets(std::pmr::vector<doublet_type> &output);
+
+    /// \brief Returns the maximum number of doublets per \ref get_doublets
+    std::size_t chunk_capacity() const { return _chunk_capacity; }
+
+    /// \brief Sets the maximum number of doublets per \ref get_doublets
+    void set_chunk_capacity(std::size_t capacity)
+    {
+        _chunk_capacity = capacity > 0 ? capacity : 1;
+    }
+
+    /// \brief Minimum number of inner hits in each phi sector
+    static const constexpr std::size_t min_hits_per_sector = 1024;
+
+    /// \brief Maximum number of threads used by \ref set_threads
+    static const constexpr std::size_t max_threads = 64;
+
+    /**
+     * \brief Splits the search of large events in phi sectors processed on
+     *        \c threads threads (including the calling one).
+     *
+     * Every call to \ref get_doublets then runs all sectors in parallel,
+     * and concatenates their doublets, each sector getting an equal share of
+     * the chunk. Events with fewer than <tt>2 * min_hits_per_sector</tt> inner
+     * hits are processed on the calling thread only.
+     */
+    void set_threads(std::size_t threads);
+
+    /**
+     * \brief Sorts the hits of a layer as needed by \ref find
+     */
+    void sort_hits(hit_container_type &layer);
+
+    /**
+     * \brief Sorts the hits of several events packed in one layer, event
+     *        \c e being <tt>layer[offsets[e]]</tt> to
+     *        <tt>layer[offsets[e + 1]]</tt> (excluded)
+     */
+    void sort_hits(hit_container_type &layer, const std::pmr::vector<std::size_t> &offsets);
+
+    /**
+     * \brief Starts looking for doublets between two layers.
+     *
+     * The doublets are produced by \ref get_doublets. The hits must stay
+     * valid until all of them have been retrieved.
+     */
+    void find(const beam_spot_type &bs,
+              const geom::layer_pair &layers,
+              const hit_span_type &inner,
+              const hit_span_type &outer);
+
+    /// \brief Returns the number of hit pairs tested since \ref find
+    std::size_t candidates() const;
+
+    /**
+     * \brief Only produces doublets crossing the beam line within \c windows,
+     *        or anywhere in the beam spot if \c windows is \c nullptr.
+     *
+     * Applies from the next call to \ref get_doublets. \c windows must stay
+     * valid while in use.
+     */
+    void set_z_windows(const z_windows *windows) { _windows = windows; }
+
+    /**
+     * \brief Returns where a doublet of the current layer pair crosses the
+     *        beam line, relative to the beam spot (cm)
+     *
+     * This is the value checked against the windows of \ref set_z_windows.
+     */
+    float z0(const doublet_type &doublet) const;
+
+private:
+    /**
+     * \brief Where the search stopped in a range of inner hits.
+     *
+     * The inner layer is sorted by \c phi, so a range of inner hits is a phi
+     * sector. The whole outer layer is shared by all sectors: the windows of
+     * the hits at the edges extend into the neighbouring sectors, which
+     * provides the halo without copying hits.
+     */
+    struct sector
+    {
+        std::size_t end = 0;                ///< \brief End of the range of inner hits
+        std::size_t i1 = 0;                 ///< \brief Next inner hit
+        std::size_t i2 = 0;                 ///< \brief Next outer hit in the window
+        std::size_t range_begin = 0;        ///< \brief Window of the inner hit
+        std::size_t range_end = 0;          ///< \brief Window of the inner hit
+        bool in_window = false;             ///< \brief Inner hit partially done
+        dz_inner_hit inner{};               ///< \brief Current inner hit
+        dz_inner_hit impact{};              ///< \brief Current inner hit, as seen by \ref z0
+        fast_sincos sincos{0};
+        std::size_t candidates = 0;         ///< \brief Hit pairs tested
+
+        /// \brief Output buffer, with room for the vector stores of the kernels
+        std::vector<doublet_type> doublets;
+    };
+
+    using produce_function = std::size_t (cpu_doublet_finder::*)(sector &, std::size_t) const;
+
+    /**
+     * \brief Implementation of \ref get_doublets for one sector, with the
+     *        radii of the layers folded in for \ref static_layer_pair
+     *
+     * Produces at most \c capacity doublets in <tt>s.doublets</tt>.
+     */
+    template<class Pair>
+    std::size_t produce(sector &s, std::size_t capacity) const;
+
+    /// \brief Specializations of \ref produce for \c geom::consecutive_layer_pairs
+    template<std::size_t... I>
+    static std::array<produce_function, sizeof...(I)> make_produce_table(
+        std::index_sequence<I...>);
+
+    std::size_t _chunk_capacity = default_chunk_capacity;
+
+    /// \brief Second layer, with ghost hits around +-pi
+    ghost_padded_layer<std::int32_t, std::int16_t, std::int32_t> _outer;
+
+    beam_spot_type _bs{};
+    hit_span_type _inner_hits;
+    hit_span_type _outer_hits;
+    int _inner_layer_r = 0, _outer_layer_r = 0; ///< \brief Layer radii
+
+    /// \brief Where the search stopped, one entry per phi sector in use
+    std::vector<sector> _sectors = std::vector<sector>(1);
+    std::size_t _sector_count = 1;
+
+    /// \brief Runs the sectors, if more than one thread is used
+    std::unique_ptr<fork_join_pool> _pool;
+
+    // Chosen by find for the layer pair
+    produce_function _produce = nullptr;
+    dz_kernel _kernel = nullptr;
+
+    /// \brief Where doublets must cross the beam line, if not \c nullptr
+    const z_windows *_windows = nullptr;
+};
+
+/**
+ * \brief Doublet finder that looks up outer hits in a grid of (phi, z) cells.
+ *
+ * Instead of sorting both layers, \ref find groups the hits of the second
+ * layer in fixed-size cells with a counting sort, which runs in linear time.
+ * Cells are ordered by phi bin, then by z bin. Every hit of the first layer visits the 2
+ * or 3 phi bins that overlap with its search window. In each of them, it only
+ * looks at the z bins compatible with a straight line coming from within
+ * 11 cm of the beam spot (or from the vertex windows, if set), which form a
+ * contiguous range of cells. The first
+ * layer is not sorted, and phi bins wrap around at +-pi, so there is no
+ * special case close to +-pi.
+ *
+ * Uses the same hit format and \c dz check as \ref cpu_doublet_finder.
+ */
+class grid_doublet_finder
+{
+public:
+    /// \brief A doublet, represented as indices within the two layers
+    using doublet_type = std::pair<std::uint16_t, std::uint16_t>;
+
+    /// \brief The type to use for hits
+    using hit_type = compact_hit;
+
+    /// \brief The type to use for collections of hits
+    using hit_container_type = compact_hit_columns;
+
+    /// \brief The type to use for views of hits
+    using hit_span_type = compact_hit_span;
+
+    /// \brief The type to use for the beam spot
+    using beam_spot_type = compact_beam_spot;
+
+    /// \brief Width of the phi bins is 2^bin_shift (compact units)
+    static const constexpr int bin_shift = 9;
+
+    /// \brief Number of phi bins
+    static const constexpr int bin_count = 1 << (16 - bin_shift);
+
+    /// \brief Width of the z bins is 2^z_bin_shift (compact units, 2 cm)
+    static const constexpr int z_bin_shift = 15;
+
+    /// \brief Number of z bins, covering -32 to 32 cm
+    static const constexpr int z_bin_count = 32;
+
+    /// \brief Number of cells
+    static const constexpr int cell_count = bin_count * z_bin_count;
+
+    /// \brief Returns the phi bin of a compact angle
+    static int bin(std::int16_t phi)
+    {
+        return std::uint16_t(phi + (1 << 15)) >> bin_shift;
+    }
+
+    /// \brief Returns the z bin of a compact position (clamped)
+    static int z_bin(std::int32_t z)
+    {
+        int bin = (z >> z_bin_shift) + z_bin_count / 2;
+        return bin < 0 ? 0 : (bin >= z_bin_count ? z_bin_count - 1 : bin);
+    }
+
+    /// \brief Returns the cell of a hit
+    static int cell(std::int16_t phi, std::int32_t z)
+    {
+        return bin(phi) * z_bin_count + z_bin(z);
+    }
+
+    /// \brief Convert hits to the correct representation
+    hit_container_type convert(const hit_columns &hits, int layer) const
+    {
+        return cpu_doublet_finder().convert(hits, layer);
+    }
+
+    /// \brief Convert beam spot info to the correct representation
+    beam_spot_type convert(const beam_spot &bs) const
+    {
+        return cpu_doublet_finder().convert(bs);
+    }
+
+    /**
+     * \brief Produces the next chunk of doublets.
      *
-     * Production will be resumed if the producer was out of memory.
+     * The search started by \ref find runs until at most
+     * \ref chunk_capacity doublets have been found, then stops until the
+     * next call. Call repeatedly to get all doublets.
      *
-     * \return The number of doublets added to \c output.
+     * \return The number of doublets added to \c output, zero once all
+     *         doublets have been produced.
      */
-    std::size_t get_doublets(std::vector<doublet_type> &output);
+    std::size_t get_doublets(std::pmr::vector<doublet_type> &output);
+
+    /// \brief Returns the maximum number of doublets per \ref get_doublets
+    std::size_t chunk_capacity() const { return _chunk_capacity; }
+
+    /// \brief Sets the maximum number of doublets per \ref get_doublets
+    void set_chunk_capacity(std::size_t capacity)
+    {
+        _chunk_capacity = capacity > 0 ? capacity : 1;
+    }
 
     /**
-     * \brief Pushes hits to the machine.
+     * \brief Does nothing.
      *
-     * You are responsible for passing back the vectors to \ref set_hits.
+     * The grid is built by \ref find, so hits can be in any order.
      */
-    void sort_hits(std::vector<hit_type> &layer1,
-                   std::vector<hit_type> &layer2);
+    void sort_hits(hit_container_type &layer);
+
+    /// \brief Does nothing, like \ref sort_hits
+    void sort_hits(hit_container_type &layer, const std::pmr::vector<std::size_t> &offsets);
 
     /**
-     * \brief Finds doublets.
+     * \brief Starts looking for doublets between two layers.
+     *
+     * The doublets are produced by \ref get_doublets. The hits must stay
+     * valid until all of them have been retrieved.
      */
     void find(const beam_spot_type &bs,
-              const std::vector<hit_type> &layer1,
-              const std::vector<hit_type> &layer2);
+              const geom::layer_pair &layers,
+              const hit_span_type &inner,
+              const hit_span_type &outer);
+
+    /// \brief Returns the number of hit pairs tested since \ref find
+    std::size_t candidates() const { return _candidates; }
+
+    /**
+     * \brief Only produces doublets crossing the beam line within \c windows,
+     *        or anywhere in the beam spot if \c windows is \c nullptr.
+     *
+     * Applies from the next call to \ref get_doublets. \c windows must stay
+     * valid while in use.
+     */
+    void set_z_windows(const z_windows *windows) { _windows = windows; }
+
+    /**
+     * \brief Returns where a doublet of the current layer pair crosses the
+     *        beam line, relative to the beam spot (cm)
+     *
+     * This is the value checked against the windows of \ref set_z_windows.
+     */
+    float z0(const doublet_type &doublet) const;
 
 private:
     std::vector<doublet_type> _doublets;
+    std::size_t _chunk_capacity = default_chunk_capacity;
+    std::size_t _candidates = 0;
+
+    /// \brief Hits of the second layer, grouped by cell
+    compact_hit_columns _cells;
+
+    /// \brief Index in the second layer of every hit in \ref _cells
+    std::vector<std::uint32_t> _cell_hit_index;
+
+    /// \brief Index in \ref _cells of the first hit of every cell, and total
+    std::vector<std::uint32_t> _cell_offsets;
+
+    /// \brief Next free slot of every cell while \ref _cells is filled
+    std::vector<std::uint32_t> _cell_next;
+
+    // Where the search stopped
+    beam_spot_type _bs{};
+    hit_span_type _inner_hits;
+    hit_span_type _outer_hits;
+    int _inner_layer_r = 0, _outer_layer_r = 0; ///< \brief Layer radii
+    float _outer_r_min = 0, _outer_r_max = 0; ///< \brief Extent of the second layer
+    std::size_t _i1 = 0;                ///< \brief Next inner hit
+    std::size_t _i2 = 0;                ///< \brief Next hit in \ref _cells
+    bool _in_window = false;            ///< \brief Inner hit partially done
+    compact_hit _inner{0, 0, 0};        ///< \brief Current inner hit
+    int _rb_proj = 0, _b_dz = 0;        ///< \brief Used by \c check_dz
+
+    /// \brief Ranges of \ref _cells to visit for the current inner hit
+    std::array<std::pair<std::uint32_t, std::uint32_t>, 3> _ranges;
+    std::size_t _range_count = 0;       ///< \brief Number of valid \ref _ranges
+    std::size_t _range = 0;             ///< \brief Range being visited
+
+    /// \brief Where doublets must cross the beam line, if not \c nullptr
+    const z_windows *_windows = nullptr;
 };
 
 class float_doublet_finder
@@ -127,13 +908,19 @@ public:
     /// \brief The type to use for hits
     using hit_type = hit;
 
+    /// \brief The type to use for collections of hits
+    using hit_container_type = hit_columns;
+
+    /// \brief The type to use for views of hits
+    using hit_span_type = hit_span;
+
     /// \brief The type to use for the beam spot
     using beam_spot_type = beam_spot;
 
     /// \brief Convert hits to the correct representation
-    std::vector<hit_type> convert(const std::vector<hit> &hits, int layer) const
+    hit_container_type convert(const hit_columns &hits, int layer) const
     {
-        return hits;
+        return hit_container_type(hits, hits.resource());
     }
 
     /// \brief Convert beam spot info to the correct representation
@@ -143,31 +930,93 @@ public:
     }
 
     /**
-     * \brief Gets back the produced doublets.
+     * \brief Produces the next chunk of doublets.
+     *
+     * The search started by \ref find runs until at most
+     * \ref chunk_capacity doublets have been found, then stops until the
+     * next call. Call repeatedly to get all doublets.
      *
-     * Production will be resumed if the producer was out of memory.
+     * \return The number of doublets added to \c output, zero once all
+     *         doublets have been produced.
+     */
+    std::size_t get_doublets(std::pmr::vector<doublet_type> &output);
+
+    /// \brief Returns the maximum number of doublets per \ref get_doublets
+    std::size_t chunk_capacity() const { return _chunk_capacity; }
+
+    /// \brief Sets the maximum number of doublets per \ref get_doublets
+    void set_chunk_capacity(std::size_t capacity)
+    {
+        _chunk_capacity = capacity > 0 ? capacity : 1;
+    }
+
+    /**
+     * \brief Sorts the hits of a layer as needed by \ref find
+     */
+    void sort_hits(hit_container_type &layer);
+
+    /**
+     * \brief Sorts the hits of several events packed in one layer, event
+     *        \c e being <tt>layer[offsets[e]]</tt> to
+     *        <tt>layer[offsets[e + 1]]</tt> (excluded)
+     */
+    void sort_hits(hit_container_type &layer, const std::pmr::vector<std::size_t> &offsets);
+
+    /**
+     * \brief Starts looking for doublets between two layers.
      *
-     * \return The number of doublets added to \c output.
+     * The doublets are produced by \ref get_doublets. The hits must stay
+     * valid until all of them have been retrieved.
      */
-    std::size_t get_doublets(std::vector<doublet_type> &output);
+    void find(const beam_spot_type &bs,
+              const geom::layer_pair &layers,
+              const hit_span_type &inner,
+              const hit_span_type &outer);
+
+    /// \brief Returns the number of hit pairs tested since \ref find
+    std::size_t candidates() const { return _candidates; }
 
     /**
-     * \brief Pushes hits to the machine.
+     * \brief Only produces doublets crossing the beam line within \c windows,
+     *        or anywhere in the beam spot if \c windows is \c nullptr.
      *
-     * You are responsible for passing back the vectors to \ref set_hits.
+     * Applies from the next call to \ref get_doublets. \c windows must stay
+     * valid while in use.
      */
-    void sort_hits(std::vector<hit_type> &layer1,
-                   std::vector<hit_type> &layer2);
+    void set_z_windows(const z_windows *windows) { _windows = windows; }
 
     /**
-     * \brief Finds doublets.
+     * \brief Returns where a doublet of the current layer pair crosses the
+     *        beam line, relative to the beam spot (cm)
+     *
+     * This is the value checked against the windows of \ref set_z_windows.
      */
-    void find(const beam_spot_type &bs,
-              const std::vector<hit_type> &layer1,
-              const std::vector<hit_type> &layer2);
+    float z0(const doublet_type &doublet) const;
 
 private:
     std::vector<doublet_type> _doublets;
+    std::size_t _chunk_capacity = default_chunk_capacity;
+    std::size_t _candidates = 0;
+
+    /// \brief Second layer, with ghost hits around +-pi
+    ghost_padded_layer<float, float, float> _outer;
+
+    // Where the search stopped
+    beam_spot_type _bs{};
+    hit_span_type _inner_hits;
+    hit_span_type _outer_hits;
+    std::size_t _i1 = 0;                ///< \brief Next inner hit
+    std::size_t _i2 = 0;                ///< \brief Next outer hit in the window
+    std::size_t _range_begin = 0;       ///< \brief Window of the inner hit
+    std::size_t _range_end = 0;         ///< \brief Window of the inner hit
+    bool _in_window = false;            ///< \brief Inner hit partially done
+    hit _inner{};                       ///< \brief Current inner hit
+    float _rb_proj = 0, _b_dz = 0;      ///< \brief Used by \c float_check_dz
+    float _impact_rb_proj = 0;          ///< \brief Used by \ref z0
+    fast_float_sincos _sincos{0};
+
+    /// \brief Where doublets must cross the beam line, if not \c nullptr
+    const z_windows *_windows = nullptr;
 };
 
 #endif // DOUBLET_FINDER_H
@@ -0,0 +1,296 @@
+#include "dz_kernels.h"
+
+#include <array>
+#include <cstdlib>
+#include <type_traits>
+#include <utility>
+
+#include "compact.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#   define DZ_KERNELS_HAVE_X86
+#   include <immintrin.h>
+#endif
+
+namespace /* anonymous */
+{
+    /// \brief The beam spot half length (11 cm)
+    const constexpr int bound_length = length_to_compact<int>(11);
+
+    /// \brief Returns the radius of the outer layer for a kernel
+    template<class Pair>
+    inline int outer_radius(const dz_inner_hit &inner)
+    {
+        if constexpr (std::is_same<Pair, dynamic_layer_pair>::value) {
+            return inner.outer_r;
+        } else {
+            return Pair::outer_r;
+        }
+    }
+
+    /**
+     * \brief Checks one hit pair, see \c check_dz in doublet_finder.cpp
+     */
+    template<class Pair>
+    inline bool check_one(const dz_inner_hit &inner,
+                          std::int16_t outer_dr,
+                          std::int32_t outer_z)
+    {
+        int dz = (outer_z - inner.z) >> 8;
+        int dr = (outer_radius<Pair>(inner) + outer_dr - inner.r) >> 8;
+
+        int dz_times_dr = dr * inner.b_dz - dz * inner.num_xi;
+        int bound = bound_length * std::abs(dr) >> 8;
+
+        return std::abs(dz_times_dr) < bound;
+    }
+
+#ifdef DZ_KERNELS_HAVE_X86
+    /**
+     * \brief Lane permutations that move the selected lanes of an 8-lane
+     *        vector to the front, for every 8-bit mask
+     */
+    struct compress_table
+    {
+        alignas(32) std::array<std::array<std::int32_t, 8>, 256> permutations;
+
+        compress_table()
+        {
+            for (int mask = 0; mask < 256; ++mask) {
+                int k = 0;
+                for (int lane = 0; lane < 8; ++lane) {
+                    if (mask & (1 << lane)) {
+                        permutations[mask][k++] = lane;
+                    }
+                }
+                while (k < 8) {
+                    permutations[mask][k++] = 0;
+                }
+            }
+        }
+    };
+
+    const compress_table &compress_permutations()
+    {
+        static const compress_table table;
+        return table;
+    }
+
+    template<class Pair>
+    __attribute__((target("avx2")))
+    std::size_t check_dz_avx2(const dz_inner_hit &inner,
+                              const std::int16_t *outer_dr,
+                              const std::int32_t *outer_z,
+                              std::size_t begin,
+                              std::size_t end,
+                              std::uint32_t *output)
+    {
+        const auto &table = compress_permutations().permutations;
+
+        const __m256i inner_z = _mm256_set1_epi32(inner.z);
+        const __m256i delta_r = _mm256_set1_epi32(outer_radius<Pair>(inner) - inner.r);
+        const __m256i num_xi = _mm256_set1_epi32(inner.num_xi);
+        const __m256i b_dz = _mm256_set1_epi32(inner.b_dz);
+        const __m256i bound_length_v = _mm256_set1_epi32(bound_length);
+        const __m256i lane_offsets = _mm256_setr_epi32(0, 1 << 16, 2 << 16, 3 << 16,
+                                                       4 << 16, 5 << 16, 6 << 16, 7 << 16);
+
+        std::size_t count = 0;
+        std::size_t i = begin;
+        for (; i + 8 <= end; i += 8) {
+            __m256i dr16 = _mm256_cvtepi16_epi32(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(outer_dr + i)));
+            __m256i z = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(outer_z + i));
+
+            __m256i dz = _mm256_srai_epi32(_mm256_sub_epi32(z, inner_z), 8);
+            __m256i dr = _mm256_srai_epi32(_mm256_add_epi32(dr16, delta_r), 8);
+
+            __m256i dz_times_dr = _mm256_sub_epi32(_mm256_mullo_epi32(dr, b_dz),
+                                                   _mm256_mullo_epi32(dz, num_xi));
+            __m256i bound = _mm256_srai_epi32(
+                _mm256_mullo_epi32(bound_length_v, _mm256_abs_epi32(dr)), 8);
+            __m256i pass = _mm256_cmpgt_epi32(bound, _mm256_abs_epi32(dz_times_dr));
+
+            int mask = _mm256_movemask_ps(_mm256_castsi256_ps(pass));
+            if (mask == 0) {
+                continue;
+            }
+
+            // Packed (inner, outer) pairs, then move the accepted ones first
+            __m256i pairs = _mm256_add_epi32(
+                _mm256_set1_epi32(inner.index | std::uint32_t(i) << 16), lane_offsets);
+            __m256i permutation = _mm256_load_si256(
+                reinterpret_cast<const __m256i *>(table[mask].data()));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + count),
+                                _mm256_permutevar8x32_epi32(pairs, permutation));
+            count += _mm_popcnt_u32(mask);
+        }
+
+        for (; i < end; ++i) {
+            if (check_one<Pair>(inner, outer_dr[i], outer_z[i])) {
+                output[count++] = inner.index | std::uint32_t(i) << 16;
+            }
+        }
+        return count;
+    }
+
+    template<class Pair>
+    __attribute__((target("avx512f")))
+    std::size_t check_dz_avx512(const dz_inner_hit &inner,
+                                const std::int16_t *outer_dr,
+                                const std::int32_t *outer_z,
+                                std::size_t begin,
+                                std::size_t end,
+                                std::uint32_t *output)
+    {
+        const __m512i inner_z = _mm512_set1_epi32(inner.z);
+        const __m512i delta_r = _mm512_set1_epi32(outer_radius<Pair>(inner) - inner.r);
+        const __m512i num_xi = _mm512_set1_epi32(inner.num_xi);
+        const __m512i b_dz = _mm512_set1_epi32(inner.b_dz);
+        const __m512i bound_length_v = _mm512_set1_epi32(bound_length);
+        const __m512i lane_offsets = _mm512_slli_epi32(
+            _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), 16);
+
+        // The unmasked conversion, shift and abs intrinsics pass an undefined
+        // vector to the masked builtins, which GCC 12 reports with
+        // -Wmaybe-uninitialized. With every lane selected, the zeroing forms
+        // compile to the same instructions.
+        const __mmask16 all = 0xffff;
+
+        std::size_t count = 0;
+        std::size_t i = begin;
+        for (; i + 16 <= end; i += 16) {
+            __m512i dr16 = _mm512_maskz_cvtepi16_epi32(
+                all, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(outer_dr + i)));
+            __m512i z = _mm512_loadu_si512(outer_z + i);
+
+            __m512i dz = _mm512_maskz_srai_epi32(all, _mm512_sub_epi32(z, inner_z), 8);
+            __m512i dr = _mm512_maskz_srai_epi32(all, _mm512_add_epi32(dr16, delta_r), 8);
+
+            __m512i dz_times_dr = _mm512_sub_epi32(_mm512_mullo_epi32(dr, b_dz),
+                                                   _mm512_mullo_epi32(dz, num_xi));
+            __m512i bound = _mm512_maskz_srai_epi32(
+                all, _mm512_mullo_epi32(bound_length_v, _mm512_maskz_abs_epi32(all, dr)), 8);
+            __mmask16 pass = _mm512_cmplt_epi32_mask(_mm512_maskz_abs_epi32(all, dz_times_dr),
+                                                     bound);
+
+            __m512i pairs = _mm512_add_epi32(
+                _mm512_set1_epi32(inner.index | std::uint32_t(i) << 16), lane_offsets);
+            _mm512_mask_compressstoreu_epi32(output + count, pass, pairs);
+            count += __builtin_popcount(pass);
+        }
+
+        for (; i < end; ++i) {
+            if (check_one<Pair>(inner, outer_dr[i], outer_z[i])) {
+                output[count++] = inner.index | std::uint32_t(i) << 16;
+            }
+        }
+        return count;
+    }
+#endif // DZ_KERNELS_HAVE_X86
+
+    template<class Pair>
+    std::size_t check_dz_portable(const dz_inner_hit &inner,
+                                  const std::int16_t *outer_dr,
+                                  const std::int32_t *outer_z,
+                                  std::size_t begin,
+                                  std::size_t end,
+                                  std::uint32_t *output)
+    {
+        std::size_t count = 0;
+        for (std::size_t i = begin; i < end; ++i) {
+            if (check_one<Pair>(inner, outer_dr[i], outer_z[i])) {
+                output[count++] = inner.index | std::uint32_t(i) << 16;
+            }
+        }
+        return count;
+    }
+
+    /// \brief Instruction sets with a kernel
+    enum class instruction_set { scalar, avx2, avx512 };
+
+    struct kernel_choice
+    {
+        instruction_set isa;
+        const char *name;
+    };
+
+    const kernel_choice &choose_kernel()
+    {
+        static const kernel_choice choice = []() -> kernel_choice {
+#ifdef DZ_KERNELS_HAVE_X86
+            if (__builtin_cpu_supports("avx512f")) {
+                return { instruction_set::avx512, "avx512" };
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                return { instruction_set::avx2, "avx2" };
+            }
+#endif
+            return { instruction_set::scalar, "scalar" };
+        }();
+        return choice;
+    }
+
+    /// \brief Returns the kernel for \c Pair and the given instruction set
+    template<class Pair>
+    dz_kernel kernel_for(instruction_set isa)
+    {
+        switch (isa) {
+#ifdef DZ_KERNELS_HAVE_X86
+        case instruction_set::avx512:
+            return check_dz_avx512<Pair>;
+        case instruction_set::avx2:
+            return check_dz_avx2<Pair>;
+#endif
+        default:
+            return check_dz_portable<Pair>;
+        }
+    }
+
+    /// \brief Kernels for the pairs in \c geom::consecutive_layer_pairs
+    template<std::size_t... I>
+    std::array<dz_kernel, sizeof...(I)> make_kernel_table(instruction_set isa,
+                                                          std::index_sequence<I...>)
+    {
+        return {{
+            kernel_for<static_layer_pair<geom::consecutive_layer_pairs[I].inner,
+                                         geom::consecutive_layer_pairs[I].outer>>(isa)...
+        }};
+    }
+} // namespace anonymous
+
+std::size_t check_dz_scalar(const dz_inner_hit &inner,
+                            const std::int16_t *outer_dr,
+                            const std::int32_t *outer_z,
+                            std::size_t begin,
+                            std::size_t end,
+                            std::uint32_t *output)
+{
+    return check_dz_portable<dynamic_layer_pair>(inner, outer_dr, outer_z,
+                                                 begin, end, output);
+}
+
+dz_kernel select_dz_kernel()
+{
+    return kernel_for<dynamic_layer_pair>(choose_kernel().isa);
+}
+
+dz_kernel select_dz_kernel(const geom::layer_pair &layers)
+{
+    const constexpr std::size_t pair_count = geom::consecutive_layer_pairs.size();
+    static const std::array<dz_kernel, pair_count> table = make_kernel_table(
+        choose_kernel().isa, std::make_index_sequence<pair_count>());
+
+    for (std::size_t i = 0; i < pair_count; ++i) {
+        if (geom::consecutive_layer_pairs[i].inner == layers.inner
+            && geom::consecutive_layer_pairs[i].outer == layers.outer) {
+            return table[i];
+        }
+    }
+    return select_dz_kernel();
+}
+
+const char *selected_dz_kernel_name()
+{
+    return choose_kernel().name;
+}
@@ -0,0 +1,105 @@
+#ifndef DZ_KERNELS_H
+#define DZ_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "compact.h"
+#include "geometry.h"
+
+/**
+ * \brief Compile-time description of a pair of pixel barrel layers.
+ *
+ * Kernels instantiated with it have the layer radii folded in.
+ */
+template<int Inner, int Outer>
+struct static_layer_pair
+{
+    static const constexpr int inner = Inner; ///< \brief Layer of the first hit
+    static const constexpr int outer = Outer; ///< \brief Layer of the second hit
+
+    /// \brief Average radius of the inner layer (compact)
+    static const constexpr int inner_r =
+        length_to_compact<int>(geom::pixel_barrel_radius[Inner]);
+
+    /// \brief Average radius of the outer layer (compact)
+    static const constexpr int outer_r =
+        length_to_compact<int>(geom::pixel_barrel_radius[Outer]);
+};
+
+/**
+ * \brief Layer pair only known at run time.
+ *
+ * Kernels instantiated with it read the radii from their arguments.
+ */
+struct dynamic_layer_pair {};
+
+/**
+ * \brief Everything the \c dz check needs to know about the inner hit.
+ *
+ * All lengths are in the compact representation.
+ */
+struct dz_inner_hit
+{
+    std::int32_t r;       ///< \brief Radius of the inner hit
+    std::int32_t z;       ///< \brief Position along \c z of the inner hit
+    std::int32_t num_xi;  ///< \brief <tt>(r - rb_proj) >> 8</tt>
+    std::int32_t b_dz;    ///< \brief <tt>(z - bs.z) >> 8</tt>
+    std::int32_t outer_r; ///< \brief Average radius of the outer layer (unused
+                          ///<        by the kernels specialized for a pair)
+    std::uint32_t index;  ///< \brief Index of the inner hit in its layer
+};
+
+/**
+ * \brief Runs the \c dz check for one inner hit and a block of outer hits.
+ *
+ * Outer hits \c begin to \c end (excluded) are tested. For every accepted hit
+ * \c i, <tt>index | i << 16</tt> is appended to \c output, which is the memory
+ * layout of a <tt>std::pair<std::uint16_t, std::uint16_t></tt> on little
+ * endian machines. Vector kernels store full vectors, so \c output must have
+ * room for <tt>end - begin + dz_kernel_padding</tt> elements.
+ *
+ * \return The number of accepted hits.
+ */
+using dz_kernel = std::size_t (*)(const dz_inner_hit &inner,
+                                  const std::int16_t *outer_dr,
+                                  const std::int32_t *outer_z,
+                                  std::size_t begin,
+                                  std::size_t end,
+                                  std::uint32_t *output);
+
+/// \brief Extra room needed in the output of a \ref dz_kernel
+const constexpr std::size_t dz_kernel_padding = 16;
+
+/**
+ * \brief Portable implementation of \ref dz_kernel
+ */
+std::size_t check_dz_scalar(const dz_inner_hit &inner,
+                            const std::int16_t *outer_dr,
+                            const std::int32_t *outer_z,
+                            std::size_t begin,
+                            std::size_t end,
+                            std::uint32_t *output);
+
+/**
+ * \brief Returns the fastest \ref dz_kernel supported by the CPU.
+ *
+ * The choice is made once, at the first call. AVX-512 and AVX2 kernels are
+ * available on x86; \ref check_dz_scalar is used everywhere else.
+ */
+dz_kernel select_dz_kernel();
+
+/**
+ * \brief Returns the fastest \ref dz_kernel for a given pair of layers.
+ *
+ * Pairs in \c geom::consecutive_layer_pairs get a kernel specialized with
+ * \ref static_layer_pair, other pairs the one from \ref select_dz_kernel().
+ */
+dz_kernel select_dz_kernel(const geom::layer_pair &layers);
+
+/**
+ * \brief Returns the name of the kernel returned by \ref select_dz_kernel
+ */
+const char *selected_dz_kernel_name();
+
+#endif // DZ_KERNELS_H
@@ -1,7 +1,11 @@
 #ifndef EVENT_H
 #define EVENT_H
 
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <memory_resource>
+#include <utility>
 #include <vector>
 
 struct hit
@@ -9,23 +13,209 @@ struct hit
     float r, phi, z;
 };
 
+/**
+ * \brief Holds a collection of hits as separate \c r, \c phi and \c z columns.
+ *
+ * Algorithms that only need one coordinate (eg \c phi when sorting) stream a
+ * single dense array instead of loading whole hits.
+ */
+struct hit_columns
+{
+    std::pmr::vector<float> r;   ///< \brief Radius (cm)
+    std::pmr::vector<float> phi; ///< \brief Azimutal angle (rad)
+    std::pmr::vector<float> z;   ///< \brief Position along the \c z axis (cm)
+
+    hit_columns() = default;
+
+    /// \brief Constructor, the columns are allocated from \c resource
+    explicit hit_columns(std::pmr::memory_resource *resource) :
+        r(resource), phi(resource), z(resource)
+    {}
+
+    /// \brief Copies \c other into memory allocated from \c resource
+    hit_columns(const hit_columns &other, std::pmr::memory_resource *resource) :
+        r(other.r, resource), phi(other.phi, resource), z(other.z, resource)
+    {}
+
+    /// \brief Returns the memory resource the columns are allocated from
+    std::pmr::memory_resource *resource() const { return r.get_allocator().resource(); }
+
+    /// \brief Returns the number of hits
+    std::size_t size() const { return r.size(); }
+
+    /// \brief Returns \c true if there are no hits
+    bool empty() const { return r.empty(); }
+
+    /// \brief Removes all hits, keeping the allocated memory
+    void clear()
+    {
+        r.clear();
+        phi.clear();
+        z.clear();
+    }
+
+    /// \brief Reserves memory for \c n hits
+    void reserve(std::size_t n)
+    {
+        r.reserve(n);
+        phi.reserve(n);
+        z.reserve(n);
+    }
+
+    /// \brief Appends a hit
+    void push_back(const hit &h)
+    {
+        r.push_back(h.r);
+        phi.push_back(h.phi);
+        z.push_back(h.z);
+    }
+
+    /// \brief Gathers hit \c i
+    hit operator[](std::size_t i) const
+    {
+        return { r[i], phi[i], z[i] };
+    }
+
+    /// \brief Gathers hit \c i, with bounds checking
+    hit at(std::size_t i) const
+    {
+        return { r.at(i), phi.at(i), z.at(i) };
+    }
+
+    /**
+     * \brief Reorders the hits such that the new hit \c i is the old hit
+     *        <tt>order[i]</tt>.
+     */
+    template<class Order>
+    void permute(const Order &order)
+    {
+        permute_column(r, order);
+        permute_column(phi, order);
+        permute_column(z, order);
+    }
+
+    /**
+     * \brief Reorders a single column, see \ref permute.
+     *
+     * The column keeps its allocated memory. The temporary copy comes from
+     * the memory resource of the column.
+     */
+    template<class T, class Order>
+    static void permute_column(std::pmr::vector<T> &column, const Order &order)
+    {
+        std::pmr::vector<T> tmp(order.size(), column.get_allocator());
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            tmp[i] = column[order[i]];
+        }
+        column.assign(tmp.begin(), tmp.end());
+    }
+};
+
+/**
+ * \brief Non-owning view of hits stored as columns.
+ *
+ * Can point to a \ref hit_columns or to any other memory (eg a mapped file).
+ */
+struct hit_span
+{
+    const float *r = nullptr;   ///< \brief Radius (cm)
+    const float *phi = nullptr; ///< \brief Azimutal angle (rad)
+    const float *z = nullptr;   ///< \brief Position along the \c z axis (cm)
+    std::size_t count = 0;      ///< \brief Number of hits
+
+    hit_span() = default;
+
+    /// \brief Constructor
+    hit_span(const float *r, const float *phi, const float *z,
+             std::size_t count) :
+        r(r), phi(phi), z(z), count(count)
+    {}
+
+    /// \brief Views all hits in \c hits
+    hit_span(const hit_columns &hits) :
+        r(hits.r.data()), phi(hits.phi.data()), z(hits.z.data()),
+        count(hits.size())
+    {}
+
+    /// \brief Returns the number of hits
+    std::size_t size() const { return count; }
+
+    /// \brief Returns \c true if there are no hits
+    bool empty() const { return count == 0; }
+
+    /// \brief Gathers hit \c i
+    hit operator[](std::size_t i) const
+    {
+        return { r[i], phi[i], z[i] };
+    }
+
+    /// \brief Views \c n hits starting at \c first
+    hit_span subspan(std::size_t first, std::size_t n) const
+    {
+        return hit_span(r + first, phi + first, z + first, n);
+    }
+};
+
 struct beam_spot
 {
     float r, phi, z;
 };
 
+/**
+ * \brief A reconstructed track.
+ *
+ * Allocator-aware: in a \c std::pmr::vector, the hits are allocated from the
+ * memory resource of the vector.
+ */
 struct track
 {
+    /// \brief Used by containers to pass their memory resource
+    using allocator_type = std::pmr::polymorphic_allocator<std::byte>;
+
     float pt, eta, phi, b0, z0;
-    std::vector<hit> hits, seed;
+    std::pmr::vector<hit> hits, seed;
+
+    /// \brief Index of every hit of \ref hits in \ref event::hits
+    std::pmr::vector<std::uint32_t> hit_indices;
+
+    track() = default;
+
+    /// \brief Constructor, the hits are allocated with \c alloc
+    explicit track(const allocator_type &alloc) :
+        hits(alloc), seed(alloc), hit_indices(alloc)
+    {}
+
+    /// \brief Copies \c other, allocating with \c alloc
+    track(const track &other, const allocator_type &alloc) :
+        pt(other.pt), eta(other.eta), phi(other.phi), b0(other.b0), z0(other.z0),
+        hits(other.hits, alloc), seed(other.seed, alloc),
+        hit_indices(other.hit_indices, alloc)
+    {}
+
+    /// \brief Moves \c other, allocating with \c alloc if needed
+    track(track &&other, const allocator_type &alloc) :
+        pt(other.pt), eta(other.eta), phi(other.phi), b0(other.b0), z0(other.z0),
+        hits(std::move(other.hits), alloc), seed(std::move(other.seed), alloc),
+        hit_indices(std::move(other.hit_indices), alloc)
+    {}
+
 };
 
 struct event
 {
     beam_spot bs;
-    std::vector<hit> hits;
-    std::vector<track> tracks;
+
+    /// \brief Hits of all tracks, every position stored once
+    hit_columns hits;
+    std::pmr::vector<track> tracks;
     int nvtx;
+
+    event() = default;
+
+    /// \brief Constructor, the hits and tracks are allocated from \c resource
+    explicit event(std::pmr::memory_resource *resource) :
+        hits(resource), tracks(resource)
+    {}
 };
 
 
@@ -0,0 +1,29 @@
+#include "event_arena.h"
+
+#include <algorithm>
+#include <cstdint>
+
+void *event_arena::do_allocate(std::size_t bytes, std::size_t alignment)
+{
+    // Try the current block, then the ones left from previous events
+    for (; _current < _blocks.size(); ++_current) {
+        block &b = _blocks[_current];
+        const std::uintptr_t base = reinterpret_cast<std::uintptr_t>(b.data.get());
+        const std::uintptr_t aligned = (base + _offset + alignment - 1) & ~std::uintptr_t(alignment - 1);
+        const std::size_t begin = aligned - base;
+        if (begin <= b.size && bytes <= b.size - begin) {
+            _offset = begin + bytes;
+            return b.data.get() + begin;
+        }
+        _used_before += _offset;
+        _offset = 0;
+    }
+
+    // Grow geometrically, so that the number of blocks stays small
+    std::size_t size = _blocks.empty() ? _block_size : 2 * _blocks.back().size;
+    size = std::max(size, bytes + alignment);
+    _blocks.push_back({ std::make_unique<std::byte[]>(size), size });
+    _reserved += size;
+    _current = _blocks.size() - 1;
+    return do_allocate(bytes, alignment);
+}
@@ -0,0 +1,79 @@
+#ifndef EVENT_ARENA_H
+#define EVENT_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+/**
+ * \brief Memory resource for the containers of one event, freed all at once.
+ *
+ * Allocating moves a pointer forward in a block of memory, and deallocating
+ * does nothing. \ref reset makes the whole memory available again for the
+ * next event. Blocks are kept from one event to the next, so once the arena
+ * has grown to the size of the largest event it never calls the global
+ * allocator again.
+ *
+ * Any container using the arena must be destroyed, or replaced by one that
+ * doesn't own memory yet, before \ref reset. An arena is not thread-safe:
+ * it must only be used by one thread at a time.
+ */
+class event_arena : public std::pmr::memory_resource
+{
+public:
+    /// \brief Size of the first block (bytes)
+    static const constexpr std::size_t default_block_size = std::size_t(1) << 20;
+
+    /// \brief Constructor, allocates nothing until the first allocation
+    explicit event_arena(std::size_t block_size = default_block_size) :
+        _block_size(block_size > 0 ? block_size : default_block_size)
+    {}
+
+    event_arena(const event_arena &) = delete;
+    event_arena &operator=(const event_arena &) = delete;
+
+    /// \brief Makes all the memory available again, keeping the blocks
+    void reset()
+    {
+        _current = 0;
+        _offset = 0;
+        _used_before = 0;
+    }
+
+    /// \brief Returns the number of bytes handed out since \ref reset
+    std::size_t bytes_used() const { return _used_before + _offset; }
+
+    /// \brief Returns the total size of the blocks (bytes)
+    std::size_t bytes_reserved() const { return _reserved; }
+
+    /// \brief Returns how many blocks were taken from the global allocator
+    std::size_t block_count() const { return _blocks.size(); }
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override;
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    /// \brief A chunk of memory from the global allocator
+    struct block
+    {
+        std::unique_ptr<std::byte[]> data;
+        std::size_t size;
+    };
+
+    std::size_t _block_size;
+    std::vector<block> _blocks;
+    std::size_t _reserved = 0;
+
+    std::size_t _current = 0;     ///< \brief Block allocations come from
+    std::size_t _offset = 0;      ///< \brief First free byte in the current block
+    std::size_t _used_before = 0; ///< \brief Bytes used in the previous blocks
+};
+
+#endif // EVENT_ARENA_H
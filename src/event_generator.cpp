@@ -0,0 +1,185 @@
+#include "event_generator.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "compact.h"
+#include "geometry.h"
+
+namespace /* anonymous */
+{
+    /// \brief Curvature radius (cm) of a unit charge per GeV and Tesla
+    const constexpr float curvature_radius_per_gev_tesla = 100 / 0.3f;
+
+    /// \brief Returns \c angle in [-pi, pi]
+    float wrap(float angle)
+    {
+        if (angle > pi) {
+            angle -= 2 * pi;
+        } else if (angle <= -pi) {
+            angle += 2 * pi;
+        }
+        return angle;
+    }
+} // namespace anonymous
+
+event_generator::event_generator(const event_generator::settings &config,
+                                 std::uint32_t seed) :
+    _config(config),
+    _rng(seed)
+{}
+
+void event_generator::generate(event &e)
+{
+    e.bs = _config.bs;
+    e.nvtx = _config.vertices;
+    e.hits.clear();
+    for (track &t : e.tracks) {
+        t.hits.clear();
+        t.seed.clear();
+        t.hit_indices.clear();
+    }
+
+    e.tracks.resize(std::size_t(_config.vertices) * _config.tracks_per_vertex);
+
+    // The beam line goes through the beam spot, parallel to z
+    const float bs_x = e.bs.r * std::cos(e.bs.phi);
+    const float bs_y = e.bs.r * std::sin(e.bs.phi);
+
+    std::normal_distribution<float> vertex_z(e.bs.z, _config.vertex_sigma_z);
+    std::size_t next_track = 0;
+    for (int v = 0; v < _config.vertices; ++v) {
+        const float z = vertex_z(_rng);
+        for (int i = 0; i < _config.tracks_per_vertex; ++i) {
+            generate_track(e, e.tracks[next_track++], bs_x, bs_y, z);
+        }
+    }
+
+    std::uniform_real_distribution<float> noise_phi(-pi, pi);
+    std::uniform_real_distribution<float> noise_z(-_config.half_length, _config.half_length);
+    std::uniform_real_distribution<float> thickness(-_config.layer_thickness / 2,
+                                                    _config.layer_thickness / 2);
+    for (float radius : geom::pixel_barrel_radius) {
+        for (int i = 0; i < _config.noise_hits_per_layer; ++i) {
+            e.hits.push_back({ radius + thickness(_rng), noise_phi(_rng), noise_z(_rng) });
+        }
+    }
+
+    // Real events come in no particular order
+    _order.resize(e.hits.size());
+    for (std::uint32_t i = 0; i < _order.size(); ++i) {
+        _order[i] = i;
+    }
+    std::shuffle(_order.begin(), _order.end(), _rng);
+
+    // Like e.hits.permute, without a temporary copy per column
+    _shuffled.clear();
+    for (std::uint32_t i : _order) {
+        _shuffled.push_back(e.hits[i]);
+    }
+    e.hits.r.assign(_shuffled.r.begin(), _shuffled.r.end());
+    e.hits.phi.assign(_shuffled.phi.begin(), _shuffled.phi.end());
+    e.hits.z.assign(_shuffled.z.begin(), _shuffled.z.end());
+
+    // Follow the hits of the tracks to their new position
+    _position.resize(_order.size());
+    for (std::uint32_t i = 0; i < _order.size(); ++i) {
+        _position[_order[i]] = i;
+    }
+    for (track &t : e.tracks) {
+        for (std::uint32_t &index : t.hit_indices) {
+            index = _position[index];
+        }
+    }
+}
+
+void event_generator::generate_track(event &e, track &t,
+                                     float vertex_x, float vertex_y, float vertex_z)
+{
+    std::uniform_real_distribution<float> uniform_phi(-pi, pi);
+    std::uniform_real_distribution<float> uniform_eta(-_config.max_eta, _config.max_eta);
+    std::exponential_distribution<float> pt_tail(1 / std::max(_config.mean_pt - _config.min_pt, 1e-3f));
+    std::uniform_real_distribution<float> thickness(-_config.layer_thickness / 2,
+                                                    _config.layer_thickness / 2);
+    std::normal_distribution<float> rphi_smearing(0, _config.rphi_resolution);
+    std::normal_distribution<float> z_smearing(0, _config.z_resolution);
+
+    t.pt = _config.min_pt + pt_tail(_rng);
+    t.eta = uniform_eta(_rng);
+    t.phi = uniform_phi(_rng);
+    t.b0 = std::hypot(vertex_x, vertex_y);
+    t.z0 = vertex_z;
+    const float cot_theta = std::sinh(t.eta);
+    const float charge = _rng() & 1 ? 1 : -1;
+
+    // Direction at the vertex
+    const float ux = std::cos(t.phi);
+    const float uy = std::sin(t.phi);
+
+    const bool straight = _config.magnetic_field == 0;
+    const float radius = straight
+        ? 0 : t.pt * curvature_radius_per_gev_tesla / std::abs(_config.magnetic_field);
+
+    // Positive particles turn clockwise in a field along +z
+    const float turn = _config.magnetic_field > 0 ? -charge : charge;
+    const float center_x = vertex_x - turn * radius * uy;
+    const float center_y = vertex_y + turn * radius * ux;
+
+    for (float layer_r : geom::pixel_barrel_radius) {
+        const float r = layer_r + thickness(_rng);
+
+        // Transverse position and path length at radius r
+        float x, y, s;
+        if (straight) {
+            // |v + s u| = r, with the vertex inside the cylinder
+            const float b = vertex_x * ux + vertex_y * uy;
+            const float c = vertex_x * vertex_x + vertex_y * vertex_y - r * r;
+            s = -b + std::sqrt(b * b - c);
+            x = vertex_x + s * ux;
+            y = vertex_y + s * uy;
+        } else {
+            // Intersection of the circles |p| = r and |p - center| = radius
+            const float d = std::hypot(center_x, center_y);
+            const float a = (r * r - radius * radius + d * d) / (2 * d);
+            const float h2 = r * r - a * a;
+            if (h2 < 0) {
+                // The particle curls up before this layer
+                break;
+            }
+            const float h = std::sqrt(h2);
+            const float ex = center_x / d, ey = center_y / d;
+
+            // Keep the intersection reached first
+            const float start = std::atan2(vertex_y - center_y, vertex_x - center_x);
+            s = 2 * pi * radius;
+            x = y = 0;
+            for (float sign : { -1.f, 1.f }) {
+                const float px = a * ex - sign * h * ey;
+                const float py = a * ey + sign * h * ex;
+                float angle = turn * (std::atan2(py - center_y, px - center_x) - start);
+                if (angle < 0) {
+                    angle += 2 * pi;
+                }
+                if (radius * angle < s) {
+                    s = radius * angle;
+                    x = px;
+                    y = py;
+                }
+            }
+            if (s > pi * radius) {
+                // Only the first half turn goes outward
+                break;
+            }
+        }
+
+        const float z = vertex_z + s * cot_theta + z_smearing(_rng);
+        if (std::abs(z) > _config.half_length) {
+            break;
+        }
+
+        const hit h{ r, wrap(std::atan2(y, x) + rphi_smearing(_rng) / r), z };
+        t.hit_indices.push_back(std::uint32_t(e.hits.size()));
+        e.hits.push_back(h);
+        t.hits.push_back(h);
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef EVENT_GENERATOR_H
+#define EVENT_GENERATOR_H
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "event.h"
+
+/**
+ * \brief Generates pixel barrel hits, so that the finders can be run without
+ *        an input file.
+ *
+ * Every event has \ref settings::vertices primary vertices spread along the
+ * beam line around the beam spot. Each of them emits
+ * \ref settings::tracks_per_vertex charged particles, which leave one hit in
+ * every layer of \c geom::pixel_barrel_radius they cross, following a helix in
+ * the magnetic field (or a straight line without field). Hits are smeared by
+ * the detector resolution and the thickness of the layers, and uniformly
+ * distributed noise hits are added on top.
+ *
+ * The hits of all vertices are shuffled, so they come in no particular order
+ * like in real events. The tracks keep their own hits.
+ */
+class event_generator
+{
+public:
+    /// \brief What to generate
+    struct settings
+    {
+        beam_spot bs{ 0.1f, 0.5f, 0.3f }; ///< \brief Beam spot position
+        float vertex_sigma_z = 4;         ///< \brief Spread of the vertices along \c z (cm)
+        int vertices = 50;                ///< \brief Number of primary vertices
+        int tracks_per_vertex = 25;       ///< \brief Charged particles per vertex
+        float min_pt = 0.3f;              ///< \brief Minimum transverse momentum (GeV)
+        float mean_pt = 0.7f;             ///< \brief Mean transverse momentum (GeV)
+        float max_eta = 2.5f;             ///< \brief Maximum pseudorapidity
+        float magnetic_field = 3.8f;      ///< \brief Field along \c z (T), 0 for straight tracks
+        float layer_thickness = 0.4f;     ///< \brief Spread of hit radii around each layer (cm)
+        float rphi_resolution = 0.001f;   ///< \brief Hit resolution in the transverse plane (cm)
+        float z_resolution = 0.002f;      ///< \brief Hit resolution along \c z (cm)
+        float half_length = 26.5f;        ///< \brief Half length of the barrel (cm)
+        int noise_hits_per_layer = 50;    ///< \brief Random hits added to every layer
+    };
+
+    /// \brief Creates a generator with a fixed seed, for reproducible events
+    explicit event_generator(const settings &config, std::uint32_t seed = 42);
+
+    /// \brief Returns the settings
+    const settings &config() const { return _config; }
+
+    /**
+     * \brief Generates the next event.
+     *
+     * The buffers of \c e are reused.
+     */
+    void generate(event &e);
+
+private:
+    /**
+     * \brief Generates one particle from a vertex, stores it in \c t and
+     *        appends its hits to \c e
+     */
+    void generate_track(event &e, track &t, float vertex_x, float vertex_y, float vertex_z);
+
+    settings _config;
+    std::mt19937 _rng;
+
+    /// \brief Shuffled order of the hits, reused from one event to the next
+    std::vector<std::uint32_t> _order;
+
+    /// \brief New position of every hit, reused from one event to the next
+    std::vector<std::uint32_t> _position;
+
+    /// \brief Shuffled hits, reused from one event to the next
+    hit_columns _shuffled;
+};
+
+#endif // EVENT_GENERATOR_H
@@ -1,12 +1,212 @@
 #include "eventreader.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <TFile.h>
+#include <TSystem.h>
+#include <TTree.h>
 #include <TTreeReader.h>
 #include <TTreeReaderArray.h>
 
+#include "cylindrical.h"
+
+namespace /* anonymous */
+{
+/**
+ * \brief Finds the distinct positions in a list, in linear time.
+ *
+ * Positions are compared on the exact bits of their coordinates, using an
+ * open addressing hash table. The table keeps its memory from one event to
+ * the next.
+ */
+class position_set
+{
+public:
+    /**
+     * \brief Copies the distinct positions of \c x, \c y and \c z to
+     *        \c unique_x, \c unique_y and \c unique_z in order of first
+     *        appearance, and sets <tt>index[i]</tt> to the position of hit
+     *        \c i in the output
+     */
+    void deduplicate(const float *x, const float *y, const float *z, std::size_t count,
+                     std::vector<float> &unique_x,
+                     std::vector<float> &unique_y,
+                     std::vector<float> &unique_z,
+                     std::vector<std::uint32_t> &index)
+    {
+        unique_x.clear();
+        unique_y.clear();
+        unique_z.clear();
+        index.resize(count);
+
+        // At most half full
+        std::size_t capacity = 16;
+        while (capacity < 2 * count) {
+            capacity *= 2;
+        }
+        _slots.assign(capacity, 0);
+        const std::size_t mask = capacity - 1;
+
+        for (std::size_t i = 0; i < count; ++i) {
+            const std::uint32_t bx = bits(x[i]), by = bits(y[i]), bz = bits(z[i]);
+            std::size_t slot = hash(bx, by, bz) & mask;
+            while (true) {
+                const std::uint32_t stored = _slots[slot];
+                if (stored == 0) {
+                    // New position
+                    unique_x.push_back(x[i]);
+                    unique_y.push_back(y[i]);
+                    unique_z.push_back(z[i]);
+                    _slots[slot] = std::uint32_t(unique_x.size());
+                    index[i] = std::uint32_t(unique_x.size() - 1);
+                    break;
+                }
+                const std::uint32_t u = stored - 1;
+                if (bits(unique_x[u]) == bx && bits(unique_y[u]) == by && bits(unique_z[u]) == bz) {
+                    index[i] = u;
+                    break;
+                }
+                slot = (slot + 1) & mask;
+            }
+        }
+    }
+
+private:
+    static std::uint32_t bits(float value)
+    {
+        std::uint32_t result;
+        std::memcpy(&result, &value, sizeof(result));
+        return result;
+    }
+
+    static std::size_t hash(std::uint32_t x, std::uint32_t y, std::uint32_t z)
+    {
+        std::uint64_t h = ((std::uint64_t(x) << 32) | y) * 0x9e3779b97f4a7c15ull;
+        h ^= (h >> 29) ^ (std::uint64_t(z) * 0xc2b2ae3d27d4eb4full);
+        return std::size_t(h ^ (h >> 32));
+    }
+
+    /// \brief Index of the position in the output plus one, 0 if empty
+    std::vector<std::uint32_t> _slots;
+};
+
+/**
+ * \brief Loads byte ranges of a file into the page cache on a background
+ *        thread.
+ *
+ * Ranges are hinted to the kernel with \c posix_fadvise, then read with
+ * \c pread, so that the reading thread finds the data in memory. Errors are
+ * ignored: at worst, the data is read on demand.
+ */
+class read_ahead_thread
+{
+public:
+    explicit read_ahead_thread(const std::string &path) :
+        _fd(open(path.c_str(), O_RDONLY)),
+        _buffer(1 << 20)
+    {
+        if (_fd >= 0) {
+            _thread = std::thread(&read_ahead_thread::run, this);
+        }
+    }
+
+    ~read_ahead_thread()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_one();
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    /// \brief Queues the range of \c bytes starting at \c offset
+    void request(long long offset, long long bytes)
+    {
+        if (_fd < 0) {
+            return;
+        }
+        posix_fadvise(_fd, offset, bytes, POSIX_FADV_WILLNEED);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _ranges.emplace_back(offset, bytes);
+        }
+        _wake.notify_one();
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _wake.wait(lock, [this] { return _stop || !_ranges.empty(); });
+            if (_stop) {
+                return;
+            }
+            auto [offset, bytes] = _ranges.front();
+            _ranges.pop_front();
+
+            lock.unlock();
+            while (bytes > 0) {
+                const auto size = std::min<long long>(bytes, _buffer.size());
+                if (pread(_fd, _buffer.data(), size, offset) <= 0) {
+                    break;
+                }
+                offset += size;
+                bytes -= size;
+            }
+            lock.lock();
+        }
+    }
+
+    int _fd;
+    std::vector<char> _buffer;
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::deque<std::pair<long long, long long>> _ranges;
+    bool _stop = false;
+};
+
+/**
+ * \brief Converts a whole array of positions to cylindrical coordinates
+ */
+void convert_positions(TTreeReaderArray<float> &x,
+                       TTreeReaderArray<float> &y,
+                       TTreeReaderArray<float> &z,
+                       hit_columns &output)
+{
+    const std::size_t count = x.GetSize();
+    output.r.resize(count);
+    output.phi.resize(count);
+    output.z.resize(count);
+    if (count == 0) {
+        return;
+    }
+
+    // The branches hold std::vector<float>, so the data is contiguous
+    to_cylindrical(&x[0], &y[0], count, output.r.data(), output.phi.data());
+    std::copy_n(&z[0], count, output.z.data());
+}
+} // namespace anonymous
+
 struct event_reader::data
 {
     TFile input;
@@ -15,141 +215,282 @@ struct event_reader::data
     TTreeReaderValue<float> bs_x0;
     TTreeReaderValue<float> bs_y0;
     TTreeReaderValue<float> bs_z0;
-    TTreeReaderArray<float> trk_pt;
-    TTreeReaderArray<float> trk_eta;
-    TTreeReaderArray<float> trk_phi;
-    TTreeReaderArray<float> trk_dxy_bs;
-    TTreeReaderArray<float> trk_dz_bs;
-    TTreeReaderArray<int>   trk_hit_n;
     TTreeReaderArray<float> trk_hit_globalPos_x;
     TTreeReaderArray<float> trk_hit_globalPos_y;
     TTreeReaderArray<float> trk_hit_globalPos_z;
-    TTreeReaderArray<int>   trk_seed_n;
-    TTreeReaderArray<float> trk_seed_globalPos_x;
-    TTreeReaderArray<float> trk_seed_globalPos_y;
-    TTreeReaderArray<float> trk_seed_globalPos_z;
-    TTreeReaderArray<int>   vtx_n;
 
-    data(const std::string &filename);
+    // Only bound if the corresponding columns are read
+    std::optional<TTreeReaderArray<float>> trk_pt;
+    std::optional<TTreeReaderArray<float>> trk_eta;
+    std::optional<TTreeReaderArray<float>> trk_phi;
+    std::optional<TTreeReaderArray<float>> trk_dxy_bs;
+    std::optional<TTreeReaderArray<float>> trk_dz_bs;
+    std::optional<TTreeReaderArray<int>>   trk_hit_n;
+    std::optional<TTreeReaderArray<int>>   trk_seed_n;
+    std::optional<TTreeReaderArray<float>> trk_seed_globalPos_x;
+    std::optional<TTreeReaderArray<float>> trk_seed_globalPos_y;
+    std::optional<TTreeReaderArray<float>> trk_seed_globalPos_z;
+    std::optional<TTreeReaderArray<int>>   vtx_n;
+
+    /// \brief Tracks removed from events passed to \ref get, kept around
+    ///        with their buffers for later reuse
+    std::pmr::vector<track> spare_tracks;
+
+    /// \brief Seed positions of the current event, in cylindrical coordinates
+    hit_columns seeds;
+
+    /// \brief Removes the hits shared by several tracks
+    position_set unique_hits;
+
+    /// \brief Distinct hit positions of the current event, in cartesian coordinates
+    std::vector<float> unique_x, unique_y, unique_z;
+
+    /// \brief Index in the unique hits of every hit of every track
+    std::vector<std::uint32_t> hit_index;
+
+    /// \brief Names of the branches that are read
+    std::vector<std::string> branches;
+
+    /// \brief Branch and first basket not yet read ahead
+    struct read_ahead_state
+    {
+        TBranch *branch;
+        int next_basket;
+    };
+
+    /// \brief Number of entries to read ahead
+    std::size_t read_ahead;
+
+    /// \brief Branches to read ahead
+    std::vector<read_ahead_state> read_ahead_branches;
+
+    /// \brief Reads ahead, if enabled
+    std::unique_ptr<read_ahead_thread> prefetch;
+
+    data(const std::string &filename, const columns &read, const io_settings &io);
+
+    /// \brief Binds an optional branch
+    template<class T>
+    void bind(std::optional<TTreeReaderArray<T>> &array, const char *name)
+    {
+        array.emplace(reader, name);
+        branches.push_back(name);
+    }
+
+    /// \brief Queues the baskets up to \c read_ahead entries after \c entry
+    void request_baskets(long long entry);
 };
 
-event_reader::data::data(const std::string &filename) :
+event_reader::data::data(const std::string &filename,
+                         const columns &read,
+                         const io_settings &io) :
     input(filename.c_str(), "OPEN"),
     reader("TrackTree/tree", &input),
     bs_x0(reader, "bs_x0"),
     bs_y0(reader, "bs_y0"),
     bs_z0(reader, "bs_z0"),
-    trk_pt(reader, "trk_pt"),
-    trk_eta(reader, "trk_eta"),
-    trk_phi(reader, "trk_phi"),
-    trk_dxy_bs(reader, "trk_dxy_bs"),
-    trk_dz_bs(reader, "trk_dz_bs"),
-    trk_hit_n(reader, "trk_hit_n"),
     trk_hit_globalPos_x(reader, "trk_hit_globalPos_x"),
     trk_hit_globalPos_y(reader, "trk_hit_globalPos_y"),
     trk_hit_globalPos_z(reader, "trk_hit_globalPos_z"),
-    trk_seed_n(reader, "trk_seed_n"),
-    trk_seed_globalPos_x(reader, "trk_seed_globalPos_x"),
-    trk_seed_globalPos_y(reader, "trk_seed_globalPos_y"),
-    trk_seed_globalPos_z(reader, "trk_seed_globalPos_z"),
-    vtx_n(reader, "vtx_n")
+    branches{ "bs_x0", "bs_y0", "bs_z0",
+              "trk_hit_globalPos_x", "trk_hit_globalPos_y", "trk_hit_globalPos_z" },
+    read_ahead(io.read_ahead)
+{
+    if (read.tracks) {
+        bind(trk_pt, "trk_pt");
+        bind(trk_eta, "trk_eta");
+        bind(trk_phi, "trk_phi");
+        bind(trk_dxy_bs, "trk_dxy_bs");
+        bind(trk_dz_bs, "trk_dz_bs");
+        bind(trk_hit_n, "trk_hit_n");
+    }
+    if (read.tracks && read.seeds) {
+        bind(trk_seed_n, "trk_seed_n");
+        bind(trk_seed_globalPos_x, "trk_seed_globalPos_x");
+        bind(trk_seed_globalPos_y, "trk_seed_globalPos_y");
+        bind(trk_seed_globalPos_z, "trk_seed_globalPos_z");
+    }
+    if (read.vertices) {
+        bind(vtx_n, "vtx_n");
+    }
+
+    TTree *tree = reader.GetTree();
+    if (tree == nullptr) {
+        return;
+    }
+
+    // The unzipping cache must be chosen before the cache is created
+    tree->SetImplicitMT(io.parallel_unzip);
+    tree->SetParallelUnzip(io.parallel_unzip);
+    tree->SetCacheSize(io.cache_bytes);
+    if (io.cache_bytes > 0) {
+        for (const std::string &name : branches) {
+            tree->AddBranchToCache(name.c_str(), true);
+        }
+        tree->StopCacheLearningPhase();
+    }
+
+    if (read_ahead > 0) {
+        char *path = gSystem->ExpandPathName(filename.c_str());
+        prefetch = std::make_unique<read_ahead_thread>(path);
+        delete[] path;
+        for (const std::string &name : branches) {
+            if (TBranch *branch = tree->GetBranch(name.c_str())) {
+                read_ahead_branches.push_back({ branch, 0 });
+            }
+        }
+    }
+}
+
+void event_reader::data::request_baskets(long long entry)
 {
+    const long long last = entry + read_ahead;
+    for (read_ahead_state &state : read_ahead_branches) {
+        TBranch *branch = state.branch;
+        const long long *first_entries = branch->GetBasketEntry();
+        const int *sizes = branch->GetBasketBytes();
+        const int baskets = branch->GetWriteBasket();
+        while (state.next_basket < baskets && first_entries[state.next_basket] <= last) {
+            const long long seek = branch->GetBasketSeek(state.next_basket);
+            if (seek > 0) {
+                prefetch->request(seek, sizes[state.next_basket]);
+            }
+            ++state.next_basket;
+        }
+    }
 }
 
 event_reader::event_reader(const std::string &filename) :
-    _d(std::make_unique<data>(filename))
+    event_reader(filename, columns())
 {
 }
 
-event_reader::~event_reader()
+event_reader::event_reader(const std::string &filename, const columns &read) :
+    event_reader(filename, read, io_settings())
 {
 }
 
-namespace /* anonymous */
-{
-bool hit_ordering(const hit &lhs, const hit &rhs)
+event_reader::event_reader(const std::string &filename,
+                           const columns &read,
+                           const io_settings &io) :
+    _d(std::make_unique<data>(filename, read, io))
 {
-    return lhs.phi < rhs.phi && lhs.z < rhs.z && lhs.phi < rhs.phi;
 }
 
-bool hit_compare(const hit &lhs, const hit &rhs)
+event_reader::~event_reader()
 {
-    return lhs.phi < rhs.phi && lhs.z < rhs.z && lhs.phi < rhs.phi;
 }
-} // namespace anonymous
+
 
 std::unique_ptr<event> event_reader::get()
+{
+    std::unique_ptr<event> e = std::make_unique<event>();
+    get(*e);
+    return e;
+}
+
+void event_reader::get(event &e)
 {
     // Beam spot
-    beam_spot bs;
     {
         float x = *_d->bs_x0;
         float y = *_d->bs_y0;
-        bs.r = std::sqrt(x * x + y * y);
-        bs.phi = std::atan2(y, x);
+        e.bs.r = std::sqrt(x * x + y * y);
+        e.bs.phi = std::atan2(y, x);
     }
-    bs.z = *_d->bs_z0;
+    e.bs.z = *_d->bs_z0;
 
-    std::vector<hit> hits;
-    hits.reserve(10 * _d->trk_pt.GetSize());
+    const std::size_t track_count = _d->trk_pt ? _d->trk_pt->GetSize() : 0;
 
-    std::vector<track> tracks;
-    tracks.reserve(_d->trk_pt.GetSize());
+    // Tracks sharing a hit all store it, keep only one copy
+    const std::size_t stored_hits = _d->trk_hit_globalPos_x.GetSize();
+    if (stored_hits == 0) {
+        e.hits.clear();
+        _d->hit_index.clear();
+    } else {
+        _d->unique_hits.deduplicate(&_d->trk_hit_globalPos_x[0],
+                                    &_d->trk_hit_globalPos_y[0],
+                                    &_d->trk_hit_globalPos_z[0],
+                                    stored_hits,
+                                    _d->unique_x, _d->unique_y, _d->unique_z,
+                                    _d->hit_index);
 
-    std::size_t ihit = 0, iseed = 0;
-    for (std::size_t itrk = 0; itrk < _d->trk_pt.GetSize(); ++itrk) {
-        // Hits
-        int hit_count = _d->trk_hit_n[itrk];
-        std::vector<hit> track_hits;
-        track_hits.reserve(hit_count);
-        for (std::size_t i = 0; i < hit_count; ++i) {
-            float x = _d->trk_hit_globalPos_x[ihit + i];
-            float y = _d->trk_hit_globalPos_y[ihit + i];
-            float z = _d->trk_hit_globalPos_z[ihit + i];
+        // Convert all positions at once
+        const std::size_t count = _d->unique_x.size();
+        e.hits.r.resize(count);
+        e.hits.phi.resize(count);
+        e.hits.z.assign(_d->unique_z.begin(), _d->unique_z.end());
+        to_cylindrical(_d->unique_x.data(), _d->unique_y.data(), count,
+                       e.hits.r.data(), e.hits.phi.data());
+    }
+    if (_d->trk_seed_n) {
+        convert_positions(*_d->trk_seed_globalPos_x,
+                          *_d->trk_seed_globalPos_y,
+                          *_d->trk_seed_globalPos_z,
+                          _d->seeds);
+    }
+
+    // Resize the track list without destroying the per-track buffers. Moving
+    // tracks to another memory resource would copy them: events using their
+    // own resource (eg an arena) are refilled in place instead.
+    if (e.tracks.get_allocator() == _d->spare_tracks.get_allocator()) {
+        while (e.tracks.size() > track_count) {
+            _d->spare_tracks.push_back(std::move(e.tracks.back()));
+            e.tracks.pop_back();
+        }
+        while (e.tracks.size() < track_count && !_d->spare_tracks.empty()) {
+            e.tracks.push_back(std::move(_d->spare_tracks.back()));
+            _d->spare_tracks.pop_back();
+        }
+    }
+    e.tracks.resize(track_count);
 
-            float r = std::sqrt(x * x + y * y);
-            float phi = std::atan2(y, x);
+    std::size_t ihit = 0, iseed = 0;
+    for (std::size_t itrk = 0; itrk < track_count; ++itrk) {
+        track &trk = e.tracks[itrk];
 
-            hits.push_back({ r, phi, z });
-            track_hits.push_back({ r, phi, z });
+        // Hits
+        std::size_t hit_count = (*_d->trk_hit_n)[itrk];
+        trk.hits.clear();
+        trk.hits.reserve(hit_count);
+        trk.hit_indices.assign(_d->hit_index.begin() + ihit,
+                               _d->hit_index.begin() + ihit + hit_count);
+        for (std::uint32_t index : trk.hit_indices) {
+            trk.hits.push_back(e.hits[index]);
         }
         ihit += hit_count;
 
         // Seeds
-        int seed_count = _d->trk_seed_n[itrk];
-        std::vector<hit> track_seed;
-        track_seed.reserve(seed_count);
+        std::size_t seed_count = _d->trk_seed_n ? (*_d->trk_seed_n)[itrk] : 0;
+        trk.seed.clear();
+        trk.seed.reserve(seed_count);
         for (std::size_t i = 0; i < seed_count; ++i) {
-            float x = _d->trk_seed_globalPos_x[iseed + i];
-            float y = _d->trk_seed_globalPos_y[iseed + i];
-            float z = _d->trk_seed_globalPos_z[iseed + i];
-
-            float r = std::sqrt(x * x + y * y);
-            float phi = std::atan2(y, x);
-
-            track_seed.push_back(hit{ r, phi, z });
+            trk.seed.push_back(_d->seeds[iseed + i]);
         }
         iseed += seed_count;
 
-        float pt = _d->trk_pt[itrk];
-        float eta = _d->trk_eta[itrk];
-        float phi = _d->trk_phi[itrk];
-        float b0 = _d->trk_dxy_bs[itrk];
-        float z0 = _d->trk_dz_bs[itrk];
-
-        tracks.push_back({ pt, eta, phi, b0, z0, track_hits, track_seed });
+        trk.pt = (*_d->trk_pt)[itrk];
+        trk.eta = (*_d->trk_eta)[itrk];
+        trk.phi = (*_d->trk_phi)[itrk];
+        trk.b0 = (*_d->trk_dxy_bs)[itrk];
+        trk.z0 = (*_d->trk_dz_bs)[itrk];
     }
 
-
-    std::unique_ptr<event> e = std::make_unique<event>();
-    e->bs = std::move(bs);
-    e->hits = std::move(hits);
-    e->tracks = std::move(tracks);
-    e->nvtx = _d->vtx_n[0];
-    return e;
+    e.nvtx = _d->vtx_n ? (*_d->vtx_n)[0] : 0;
 }
 
 bool event_reader::next()
 {
-    return _d->reader.Next();
+    if (!_d->reader.Next()) {
+        return false;
+    }
+    if (_d->prefetch) {
+        _d->request_baskets(_d->reader.GetCurrentEntry());
+    }
+    return true;
+}
+
+long long event_reader::bytes_read() const
+{
+    return _d->input.GetBytesRead();
 }
@@ -1,6 +1,7 @@
 #ifndef EVENT_READER_H
 #define EVENT_READER_H
 
+#include <cstddef>
 #include <memory>
 #include <string>
 
@@ -14,11 +15,76 @@ class event_reader final
     std::unique_ptr<data> _d;
 
 public:
+    /**
+     * \brief Optional groups of branches.
+     *
+     * The beam spot and the hit positions are always read. Branches of the
+     * groups that are off are not bound, so their baskets are never read nor
+     * decompressed.
+     */
+    struct columns
+    {
+        /// \brief Track parameters and hits, fills \ref event::tracks
+        bool tracks = true;
+
+        /// \brief Seed positions of every track, needs \ref tracks
+        bool seeds = true;
+
+        /// \brief Number of vertices, \ref event::nvtx is 0 without
+        bool vertices = true;
+    };
+
+    /**
+     * \brief How the branches are read from disk.
+     *
+     * Only the branches selected by \ref columns are cached, decompressed
+     * and read ahead.
+     */
+    struct io_settings
+    {
+        /// \brief Size of the \c TTreeCache (bytes), 0 to disable it
+        long long cache_bytes = 64ll << 20;
+
+        /**
+         * \brief Decompress the baskets on the ROOT thread pool.
+         *
+         * Only has an effect once \c ROOT::EnableImplicitMT has been called.
+         */
+        bool parallel_unzip = true;
+
+        /**
+         * \brief Number of entries to load into the page cache ahead of the
+         *        current one, on a background thread. 0 to disable.
+         */
+        std::size_t read_ahead = 0;
+    };
+
+    /// \brief Opens \c filename, reading all branches
     explicit event_reader(const std::string &filename);
+
+    /// \brief Opens \c filename, reading only the branches in \c read
+    event_reader(const std::string &filename, const columns &read);
+
+    /// \brief Opens \c filename, reading the branches in \c read as set in \c io
+    event_reader(const std::string &filename, const columns &read, const io_settings &io);
     ~event_reader();
 
     bool next();
+
+    /// \brief Returns the number of bytes read from the file so far
+    long long bytes_read() const;
     std::unique_ptr<event> get();
+
+    /**
+     * \brief Reads the current event into \c reuse.
+     *
+     * The containers of \c reuse are cleared and refilled, keeping their
+     * capacity, so repeatedly passing the same event doesn't allocate memory
+     * once the buffers have grown to the size of the largest event. New
+     * memory comes from the memory resource \c reuse was constructed with,
+     * so an event built on an \ref event_arena can be reset with it instead.
+     */
+    void get(event &reuse);
 };
 
 #endif // EVENT_READER_H
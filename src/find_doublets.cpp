@@ -1,17 +1,32 @@
+#include <algorithm>
 #include <array>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
 #include <iostream>
+#include <memory_resource>
+#include <string>
+#include <thread>
 
 #include <TFile.h>
 #include <TH1D.h>
 #include <TH2D.h>
 #include <TPie.h>
+#include <TROOT.h>
 #include <TTree.h>
 
+#include "allocation_counter.h"
+#include "cellular_automaton.h"
 #include "doublet_finder.h"
+#include "event_arena.h"
 #include "eventreader.h"
 #include "geometry.h"
 #include "hitutils.h"
+#include "latency_histogram.h"
+#include "ordered_pipeline.h"
+#include "perf_counters.h"
+#include "vertex_finder.h"
 
 float deltaphi(float phi1, float phi2)
 {
@@ -24,27 +39,6 @@ float deltaphi(float phi1, float phi2)
     return delta;
 }
 
-double extrapolated_xi(const compact_beam_spot &bs,
-                       const compact_hit &inner,
-                       const compact_hit &outer)
-{
-    const constexpr int layer_1_r = length_to_compact<int>(3);
-    const constexpr int layer_2_r = length_to_compact<int>(6.8);
-
-    int inner_r = layer_1_r + inner.dr;
-    int outer_r = layer_2_r + outer.dr;
-
-    int dr = outer_r - inner_r;
-
-    // Need a float to compute the cos
-    float inner_phi = compact_to_radians(inner.phi);
-
-    int rb_proj = length_to_compact<int>(bs.r * std::cos(bs.phi - inner_phi));
-
-    int num = inner_r - rb_proj;
-    return -double(num) / dr;
-}
-
 /**
  * \brief Finds transverse component of the impact parameter (wrt the beam spot)
  */
@@ -68,21 +62,282 @@ int extrapolated_dr(const compact_beam_spot &bs,
     return std::abs(((inner_r - rb_proj_x) * dphi) / radians_to_compact(1) + rb_proj_y);
 }
 
-/**
- * \brief Finds z component of the impact parameter (wrt the beam spot)
- *
- * The error on the computed value is about 1.4mm.
- */
-int extrapolated_dz(const compact_beam_spot &bs,
-                    const compact_hit &inner,
-                    const compact_hit &outer)
+namespace /* anonymous */
 {
-    double xi = extrapolated_xi(bs, inner, outer);
-    return inner.z + (outer.z - inner.z) * xi - bs.z;
-}
+    using wrapper_type = doublet_finder_wrapper<float_doublet_finder>;
+
+    /// \brief Returns one empty \c Columns per layer, allocated from \c resource
+    template<class Columns>
+    std::array<Columns, 4> columns_per_layer(std::pmr::memory_resource *resource)
+    {
+        return { Columns(resource), Columns(resource), Columns(resource), Columns(resource) };
+    }
+
+    /**
+     * \brief Holds everything that goes through the pipeline for one event.
+     *
+     * Jobs are reused from one event to the next. The containers of an event
+     * are allocated from the arena of the job, which is reset when the job
+     * is reused: once the arena has grown to the largest event, neither the
+     * reader nor the workers call the global allocator, and the workers
+     * don't compete for its locks.
+     */
+    struct event_job
+    {
+        /// \brief Only used by the thread holding the job
+        event_arena arena;
+
+        /// \brief Number of events read into this job
+        std::size_t uses = 0;
+
+        event e{ &arena };
+        std::pmr::vector<track> interesting_tracks{ &arena };
+        std::array<hit_columns, 4> pb_hits_per_layer = columns_per_layer<hit_columns>(&arena);
+
+        /// \brief Formatted and sorted hits the doublet indices refer to
+        std::array<wrapper_type::hit_container_type, 4> layers =
+            columns_per_layer<wrapper_type::hit_container_type>(&arena);
+
+        /// \brief Timing and doublets
+        wrapper_type::finding_results r{ &arena };
+
+        /// \brief Track candidates built from the doublets
+        std::vector<cellular_automaton::track_candidate> track_candidates;
+
+        /// \brief Time spent building the track candidates
+        std::chrono::duration<double> building;
+
+        /// \brief Drops the previous event and hands its memory out again
+        void reset()
+        {
+            // The containers must let go of the memory before the arena is
+            // reset. Their allocators compare equal, so this frees nothing.
+            e = event(&arena);
+            interesting_tracks = std::pmr::vector<track>(&arena);
+            pb_hits_per_layer = columns_per_layer<hit_columns>(&arena);
+            layers = columns_per_layer<wrapper_type::hit_container_type>(&arena);
+            r = wrapper_type::finding_results(&arena);
+            arena.reset();
+            uses++;
+        }
+    };
+
+    /**
+     * \brief Returns \c true for tracks used to validate the doublets
+     */
+    bool is_interesting(const track &trk)
+    {
+        if (trk.pt < 0.7) return false;
+
+        bool has_hit_in_layer_1 = false;
+        bool has_hit_in_layer_2 = false;
+
+        for (const hit &hh : trk.hits) {
+            if (hit_is_pixel_barrel(hh)) {
+                has_hit_in_layer_1 |= (hit_pixel_barrel_layer(hh) == 0);
+                has_hit_in_layer_2 |= (hit_pixel_barrel_layer(hh) == 1);
+
+                if (has_hit_in_layer_1 && has_hit_in_layer_2) {
+                    break;
+                }
+            }
+        }
+        return has_hit_in_layer_1 && has_hit_in_layer_2;
+    }
+
+    /**
+     * \brief Distribution of the duration of every stage, and of the whole
+     *        event in slices of pileup and hit count
+     */
+    struct latency_recorder
+    {
+        static const constexpr int nvtx_slice_width = 10;
+        static const constexpr int hits_slice_width = 1000;
+
+        latency_histogram formatting, sorting, finding, building, total;
+
+        /// \brief Total duration in slices of \ref nvtx_slice_width, the last one open
+        std::array<latency_histogram, 10> total_by_nvtx;
+
+        /// \brief Total duration in slices of \ref hits_slice_width, the last one open
+        std::array<latency_histogram, 8> total_by_hits;
+
+        /// \brief Records the durations of an event with \c hits pixel barrel hits
+        void record(const event_job &job, std::size_t hits)
+        {
+            formatting.record(job.r.formatting);
+            sorting.record(job.r.sorting);
+            finding.record(job.r.finding);
+            building.record(job.building);
+            total.record(job.r.total);
+
+            const std::size_t nvtx_slice = std::max(job.e.nvtx, 0) / nvtx_slice_width;
+            total_by_nvtx[std::min(nvtx_slice, total_by_nvtx.size() - 1)].record(job.r.total);
+            const std::size_t hits_slice = hits / hits_slice_width;
+            total_by_hits[std::min(hits_slice, total_by_hits.size() - 1)].record(job.r.total);
+        }
+
+        /// \brief Adds the durations recorded by another worker
+        void merge(const latency_recorder &other)
+        {
+            formatting.merge(other.formatting);
+            sorting.merge(other.sorting);
+            finding.merge(other.finding);
+            building.merge(other.building);
+            total.merge(other.total);
+            for (std::size_t i = 0; i < total_by_nvtx.size(); ++i) {
+                total_by_nvtx[i].merge(other.total_by_nvtx[i]);
+            }
+            for (std::size_t i = 0; i < total_by_hits.size(); ++i) {
+                total_by_hits[i].merge(other.total_by_hits[i]);
+            }
+        }
+    };
+
+    /**
+     * \brief Everything a worker reuses from one event to the next
+     */
+    struct worker_state
+    {
+        wrapper_type wrap;
+        cellular_automaton automaton;
+
+        /// \brief Filled by this worker only, merged at the end of the run
+        latency_recorder latencies;
+
+        /// \brief Heap allocations made for jobs that were used before
+        std::size_t allocations = 0;
+    };
+
+    /**
+     * \brief Runs the doublet finding and track building for one event
+     *        (worker stage).
+     */
+    void find_doublets(event_job &job, worker_state &worker, bool do_validation)
+    {
+        event &e = job.e;
+
+        job.interesting_tracks.clear();
+        if (do_validation) {
+            std::copy_if(e.tracks.begin(),
+                         e.tracks.end(),
+                         std::back_inserter(job.interesting_tracks),
+                         is_interesting);
+        }
 
-int main(int, char **)
+        for (hit_columns &layer : job.pb_hits_per_layer) {
+            layer.clear();
+        }
+        for (std::size_t ih = 0; ih < e.hits.size(); ++ih) {
+            const hit h = e.hits[ih];
+            if (hit_is_pixel_barrel(h)) {
+                job.pb_hits_per_layer[hit_pixel_barrel_layer(h)].push_back(h);
+            }
+        }
+
+        std::size_t hits = 0;
+        for (const hit_columns &layer : job.pb_hits_per_layer) {
+            hits += layer.size();
+        }
+
+        wrapper_type &wrap = worker.wrap;
+        job.r = wrap.find(e.bs, job.pb_hits_per_layer);
+
+        auto start = std::chrono::steady_clock::now();
+        std::array<hit_span, 4> spans;
+        for (std::size_t l = 0; l < spans.size(); ++l) {
+            spans[l] = wrap.layers[l];
+        }
+        worker.automaton.run(spans, wrap.pairs, job.r.doublets, job.r.pair_offsets);
+        job.track_candidates.assign(worker.automaton.tracks().begin(),
+                                    worker.automaton.tracks().end());
+        job.building = std::chrono::steady_clock::now() - start;
+
+        worker.latencies.record(job, hits);
+
+        // Allocated from the arena of the job, like the results
+        job.layers = std::move(wrap.layers);
+    }
+
+    /// \brief One line of the latency table
+    struct latency_row
+    {
+        std::string name;
+        unsigned long long count;
+        double mean, p50, p90, p99, p999, max; // Seconds
+    };
+
+    /// \brief Prints the percentiles of \c latencies and adds them to \c tree
+    void store_latencies(TTree &tree, latency_row &row,
+                         const std::string &name,
+                         const latency_histogram &latencies)
+    {
+        if (latencies.count() == 0) {
+            return;
+        }
+        row.name = name;
+        row.count = latencies.count();
+        row.mean = 1e-9 * latencies.mean();
+        row.p50 = 1e-9 * latencies.value_at_percentile(50);
+        row.p90 = 1e-9 * latencies.value_at_percentile(90);
+        row.p99 = 1e-9 * latencies.value_at_percentile(99);
+        row.p999 = 1e-9 * latencies.value_at_percentile(99.9);
+        row.max = 1e-9 * latencies.max();
+        tree.Fill();
+
+        std::cout << std::left << std::setw(24) << name << std::right
+                  << std::setw(8) << row.count;
+        for (double value : { row.mean, row.p50, row.p90, row.p99, row.p999, row.max }) {
+            std::cout << std::setw(10) << std::fixed << std::setprecision(1) << 1e6 * value;
+        }
+        std::cout << std::defaultfloat << std::setprecision(6) << std::endl;
+    }
+
+    /// \brief Returns the name of a slice of width \c width, the last one open
+    std::string slice_name(const char *quantity, std::size_t slice, std::size_t count, int width)
+    {
+        const std::string low = std::to_string(slice * width);
+        if (slice + 1 == count) {
+            return std::string("total, ") + quantity + " >= " + low;
+        }
+        return std::string("total, ") + quantity + " [" + low + ", "
+               + std::to_string((slice + 1) * width) + ")";
+    }
+
+    /// \brief Creates one branch per hardware counter, named after \c stage
+    void branch_counters(TTree &tree, const std::string &stage, counter_values &values)
+    {
+        const std::pair<const char *, std::uint64_t *> counters[] = {
+            { "_cycles", &values.cycles },
+            { "_instructions", &values.instructions },
+            { "_l1d_misses", &values.l1d_misses },
+            { "_llc_misses", &values.llc_misses },
+            { "_branch_misses", &values.branch_misses },
+        };
+        for (const auto &counter : counters) {
+            const std::string name = stage + counter.first;
+            tree.Branch(name.c_str(), counter.second, (name + "/l").c_str());
+        }
+    }
+
+    /// \brief Prints the hardware counters of one stage
+    void print_counters(const char *stage, const counter_values &values, long long hits)
+    {
+        std::cout << stage << values.instructions << " instructions in "
+                  << values.cycles << " cycles (IPC "
+                  << values.ipc() << "), "
+                  << (double(values.l1d_misses) / std::max(hits, 1LL))
+                  << " L1d / " << (double(values.llc_misses) / std::max(hits, 1LL))
+                  << " LLC / " << (double(values.branch_misses) / std::max(hits, 1LL))
+                  << " branch misses per hit" << std::endl;
+    }
+} // namespace anonymous
+
+int main(int argc, char **argv)
 {
+    // The reader, the workers and the writer use ROOT from different threads
+    ROOT::EnableThreadSafety();
+
     std::chrono::duration<double> formatting, formatting_acc;
     long long formatted_hits = 0;
 
@@ -91,6 +346,13 @@ int main(int, char **)
 
     std::chrono::duration<double> finding, finding_acc;
     long long doublets_found = 0;
+    long long candidates = 0;
+
+    // Hardware counters, summed over the run
+    counter_values formatting_counters_acc, sorting_counters_acc, finding_counters_acc;
+
+    std::chrono::duration<double> building_acc{};
+    long long track_candidates = 0;
    
     bool do_validation = 0;
 
@@ -103,11 +365,34 @@ int main(int, char **)
     std::vector<int> doublets_outer;
     tree.Branch("outer", &doublets_outer);
 
+    // Doublets of the layer pair p are pair_offsets[p] to pair_offsets[p + 1]
+    std::vector<int> doublets_pair_offsets;
+    tree.Branch("pair_offsets", &doublets_pair_offsets);
+
+    // Primary vertices the doublets point to, relative to the beam spot
+    std::vector<float> vertices;
+    tree.Branch("vertices", &vertices);
+
+    // Hits of track candidate t are candidate_hits[candidate_offsets[t]] to
+    // candidate_hits[candidate_offsets[t + 1]], in layers candidate_layers[...]
+    std::vector<int> candidate_layers, candidate_hits, candidate_offsets;
+    tree.Branch("candidate_layers", &candidate_layers);
+    tree.Branch("candidate_hits", &candidate_hits);
+    tree.Branch("candidate_offsets", &candidate_offsets);
+
     double formatting_seconds, sorting_seconds, finding_seconds, total_seconds;
+    double building_seconds;
     tree.Branch("formatting_seconds", &formatting_seconds);
     tree.Branch("sorting_seconds", &sorting_seconds);
     tree.Branch("finding_seconds", &finding_seconds);
     tree.Branch("total_seconds", &total_seconds);
+    tree.Branch("building_seconds", &building_seconds);
+
+    // Hardware counters of every stage, zero if the kernel denies access
+    counter_values formatting_counters, sorting_counters, finding_counters;
+    branch_counters(tree, "formatting", formatting_counters);
+    branch_counters(tree, "sorting", sorting_counters);
+    branch_counters(tree, "finding", finding_counters);
 
     TH1D doublet_phi1("doublet_phi1", ";phi1;count", 50, -pi, pi);
     TH1D doublet_phi2("doublet_phi2", ";phi2;count", 50, -pi, pi);
@@ -117,10 +402,15 @@ int main(int, char **)
     TH1D doublet_z0("doublet_z0", ";z0;count", 50, -15, 15);
     TH1D doublet_b0("doublet_b0", ";b0;count", 50, 0, 0.25);
 
+    TH1D vertex_count("vertex_count", ";Number of vertices;Events", 50, 0, 100);
+    TH1D vertex_z("vertex_z", ";z (wrt beam spot);Vertices", 110, -11, 11);
+
     TH1D hit_count_1("hit_count_1", ";Hits in layer 1;Events", 50, 0, 1500);
     TH1D hit_count_2("hit_count_2", ";Hits in layer 2;Events", 50, 0, 1500);
     TH1D hit_count_12("hit_count_12", ";Number of naive doublets;Events", 50, 0, 2e6);
     TH1D doublet_count("doublet_count", ";Number of doublets;Events", 50, 0, 7000);
+    TH1D candidate_count("candidate_count", ";Number of track candidates;Events", 50, 0, 2000);
+    TH1D candidate_size("candidate_size", ";Hits per track candidate;Candidates", 3, 2.5, 5.5);
 
     TH1D duration("duration", ";Duration (us);Events", 50, 0, 2500);
     TH2D duration_vs_nvtx("duration_vs_nvtx", ";#vtx;Duration (us)", 50, 0, 75, 50, 0, 2500);
@@ -152,186 +442,275 @@ int main(int, char **)
    
 //     event_reader in("output.root");
 
-    event_reader in("~lmoureau/data/v3.root");
+    // Tracks are only needed to validate the doublets, seeds never
+    event_reader::columns read_columns;
+    read_columns.tracks = do_validation;
+    read_columns.seeds = false;
+    // Baskets are decompressed on the ROOT thread pool and loaded ahead of
+    // the reader, so that it keeps up with the workers
+    ROOT::EnableImplicitMT();
+    event_reader::io_settings io;
+    io.read_ahead = 64;
+    event_reader in("~lmoureau/data/v3.root", read_columns, io);
+
+    // The --vertices switch can be anywhere, the other arguments are
+    // positional
+    bool use_vertices = false;
+    std::vector<const char *> args;
+    for (int a = 1; a < argc; ++a) {
+        if (std::string(argv[a]) == "--vertices") {
+            use_vertices = true;
+        } else {
+            args.push_back(argv[a]);
+        }
+    }
+
+    // Leave one core for the reader and one for the writer
+    unsigned cores = std::thread::hardware_concurrency();
+    std::size_t threads = cores > 2 ? cores - 2 : 1;
+    if (args.size() > 0) {
+        threads = std::max(1, std::atoi(args[0]));
+    }
+    // Events already run in parallel on the workers, so by default the
+    // track building of one event stays on its worker thread
+    std::size_t event_threads = 1;
+    if (args.size() > 1) {
+        event_threads = std::max(1, std::atoi(args[1]));
+    }
+    std::cout << "Using " << threads << " worker threads, "
+              << event_threads << " thread(s) per event" << std::endl;
+    if (use_vertices) {
+        std::cout << "Keeping only the doublets pointing to a primary vertex" << std::endl;
+    }
+
+    ordered_pipeline<event_job> pipeline(threads);
+    std::vector<worker_state> workers(pipeline.workers());
+    for (worker_state &worker : workers) {
+        // Opened by the first event, in the thread of the worker
+        worker.wrap.counters.enable();
+        worker.wrap.use_vertices = use_vertices;
+        worker.automaton.set_threads(event_threads);
+    }
 
     long long i = 0;
+    std::size_t arena_peak = 0; // Bytes, written by the writer only
     float n_doub_to_track = 0;
     float n_track = 0;
-    while (in.next()) {
-        i++;
-        std::cout << "==== Next event ====" << std::endl;
 
-        std::unique_ptr<event> e = in.get();
+    // Only touched by the reader thread
+    long long events_read = 0;
+    long long warm_events = 0;
+    std::size_t reader_allocations = 0;
+    std::chrono::duration<double> reading_acc{};
 
-        std::vector<track> interesting_tracks;
-        std::copy_if(e->tracks.begin(),
-                     e->tracks.end(),
-                     std::back_inserter(interesting_tracks),
-                     [](const track &trk) {
-                        if (trk.pt < 0.7) return false;
+    auto read = [&](event_job &job) {
+        auto start = std::chrono::steady_clock::now();
+        if (!in.next()) {
+            return false;
+        }
+        events_read++;
+
+        std::size_t allocations_before = allocation_count();
+        job.reset();
+        in.get(job.e);
+        if (job.uses > 1) {
+            // The first event of a job sizes its arena
+            reader_allocations += allocation_count() - allocations_before;
+            warm_events++;
+        }
+        reading_acc += std::chrono::steady_clock::now() - start;
+        return true;
+    };
+
+    auto process = [&](event_job &job, std::size_t worker) {
+        worker_state &state = workers[worker];
+        std::size_t allocations_before = allocation_count();
+        find_doublets(job, state, do_validation);
+        if (job.uses > 1) {
+            state.allocations += allocation_count() - allocations_before;
+        }
+    };
 
-                        bool has_hit_in_layer_1 = false;
-                        bool has_hit_in_layer_2 = false;
+    auto write = [&](event_job &job) {
+        i++;
+        arena_peak = std::max(arena_peak, job.arena.bytes_used());
+        std::cout << "==== Next event ====" << std::endl;
 
-                        for (const hit &hh : trk.hits) {
-                            if (hit_is_pixel_barrel(hh)) {
-                                has_hit_in_layer_1 |= (hit_pixel_barrel_layer(hh) == 0);
-                                has_hit_in_layer_2 |= (hit_pixel_barrel_layer(hh) == 1);
+        const event &e = job.e;
+        const auto &r = job.r;
+        const auto &doublets = r.doublets;
+        const auto &pairs = workers.front().wrap.pairs;
+        const auto &layers = job.layers;
 
-                                if (has_hit_in_layer_1 && has_hit_in_layer_2) {
-                                    break;
-                                }
-                            }
-                        }
-                        return has_hit_in_layer_1 && has_hit_in_layer_2;
-                     }
-                    );
+        std::cout << "Hits in 1st layer: " << job.pb_hits_per_layer[0].size() << std::endl;
+        std::cout << "Hits in 2nd layer: " << job.pb_hits_per_layer[1].size() << std::endl;
 
-        std::sort(e->hits.begin(), e->hits.end(), hit_less_than);
-        e->hits.erase(std::unique(e->hits.begin(), e->hits.end(), hit_equal),
-                      e->hits.end());
+        std::cout << "Making doublets..." << std::endl;
 
-        std::array<std::vector<hit>, 4> pb_hits_per_layer;
-        for (const hit &h : e->hits) {
-            if (hit_is_pixel_barrel(h)) {
-                pb_hits_per_layer[hit_pixel_barrel_layer(h)].push_back(h);
+        // Every layer is formatted and sorted once
+        std::size_t layer_hits = 0;
+        std::size_t naive_doublets = 0;
+        std::array<bool, 4> used_layers{};
+        for (const geom::layer_pair &pair : pairs) {
+            used_layers[pair.inner] = used_layers[pair.outer] = true;
+            naive_doublets += layers[pair.inner].size() * layers[pair.outer].size();
+        }
+        for (std::size_t l = 0; l < layers.size(); ++l) {
+            if (used_layers[l]) {
+                layer_hits += layers[l].size();
             }
         }
-        std::cout << "Hits in 1st layer: " << pb_hits_per_layer[0].size() << std::endl;
-        std::cout << "Hits in 2nd layer: " << pb_hits_per_layer[1].size() << std::endl;
-
-        std::cout << "Making doublets..." << std::endl;
-
-        doublet_finder_wrapper<float_doublet_finder> wrap;
-        auto r = wrap.find(e->bs, pb_hits_per_layer);
 
         formatting_acc += r.formatting;
-        formatted_hits += wrap.layer1.size();
-        formatted_hits += wrap.layer2.size();
+        formatted_hits += layer_hits;
 
         sorting_acc += r.sorting;
-        sorted_hits += wrap.layer1.size();
-        sorted_hits += wrap.layer2.size();
-
-        auto doublets = r.doublets;
+        sorted_hits += layer_hits;
 
         finding_acc += r.finding;
 
-        duration_vs_nvtx.Fill(e->nvtx, 1e6 * r.total.count());
+        formatting_counters_acc += r.formatting_counters;
+        sorting_counters_acc += r.sorting_counters;
+        finding_counters_acc += r.finding_counters;
+
+        duration_vs_nvtx.Fill(e.nvtx, 1e6 * r.total.count());
         duration.Fill(1e6 * r.total.count());
 
         doublets_found += doublets.size();
+        candidates += r.candidates;
 
         if (doublets.empty()) {
             std::cout << "No doublets found!" << std::endl;
-            continue;
+            return;
         }
         std::cout << "Doublets: "
                   << doublets.size()
                   << "; factor: "
-                  << wrap.layer1.size() * wrap.layer2.size() / doublets.size() << std::endl;
-
-        auto previous_size = doublets.size();
-        std::sort(doublets.begin(), doublets.end());
-        doublets.erase(std::unique(doublets.begin(), doublets.end()), doublets.end());
-
-        if (doublets.size() != previous_size) {
-            std::cout << "Erased " << (previous_size - doublets.size())
-                      << " duplicates!" << std::endl;
-        }       
+                  << naive_doublets / doublets.size() << std::endl;
 
         doublets_inner.clear();
         doublets_outer.clear();
+        doublets_pair_offsets.assign(r.pair_offsets.begin(), r.pair_offsets.end());
+
+        vertices.assign(r.vertices.begin(), r.vertices.end());
+        vertex_count.Fill(r.vertices.size());
+        for (float z : r.vertices) {
+            vertex_z.Fill(z);
+        }
+        std::cout << "Vertices: " << r.vertices.size() << " (nvtx: " << e.nvtx << ")" << std::endl;
 
         formatting_seconds = r.formatting.count();
         sorting_seconds = r.sorting.count();
         finding_seconds = r.finding.count();
         total_seconds = r.total.count();
+        building_seconds = job.building.count();
+
+        formatting_counters = r.formatting_counters;
+        sorting_counters = r.sorting_counters;
+        finding_counters = r.finding_counters;
+
+        building_acc += job.building;
+        track_candidates += job.track_candidates.size();
+        std::cout << "Track candidates: " << job.track_candidates.size() << std::endl;
+
+        candidate_layers.clear();
+        candidate_hits.clear();
+        candidate_offsets.assign(1, 0);
+        for (const auto &t : job.track_candidates) {
+            candidate_layers.insert(candidate_layers.end(), t.layers.begin(), t.layers.begin() + t.size);
+            candidate_hits.insert(candidate_hits.end(), t.hits.begin(), t.hits.begin() + t.size);
+            candidate_offsets.push_back(candidate_hits.size());
+            candidate_size.Fill(t.size);
+        }
 
-       int ndoub = 0;
-        for (const auto &doublet : doublets) {
-            doublets_inner.push_back(doublet.first);
-            doublets_outer.push_back(doublet.second);
-
-            const auto &h1 = wrap.layer1.at(doublet.first);
-            const auto &h2 = wrap.layer2.at(doublet.second);
-
-            doublet_phi1.Fill(compact_to_radians(h1.phi));
-            doublet_phi2.Fill(compact_to_radians(h2.phi));
-            doublet_phi2_phi1.Fill(compact_to_radians(h2.phi - h1.phi));
-            doublet_z1.Fill(compact_to_length(h1.z));
-            doublet_z2.Fill(compact_to_length(h2.z));
-
-//             doublet_z0.Fill(compact_to_length(extrapolated_dz(bs, h1, h2)));
-//             doublet_b0.Fill(compact_to_length(extrapolated_dr(bs, h1, h2)));
-	    
-	    if( do_validation ) {
-		
-                for (const track &t : interesting_tracks) {
-		  bool foundh1 = 0;
-		  bool foundh2 = 0;
-		  
-		  for (const hit &hh : t.hits) {
-		     
-		     if( ! hit_is_pixel_barrel(hh) ) continue;
-
-                     int layer = hit_pixel_barrel_layer(hh);
-                     if (layer == 0) {
-                        bool pass_phi = (radians_to_compact(hh.phi) == h1.phi);
-                        bool pass_z = (length_to_compact<std::int32_t>(hh.z) == h1.z);
-                        bool pass_dr = true; // (length_to_compact<std::int16_t>(hh.r - 3) == h1.dr);
-
-                        foundh1 |= (pass_phi && pass_z && pass_dr);
-                     } else if (layer == 1) {
-                        bool pass_phi = (radians_to_compact(hh.phi) == h2.phi);
-                        bool pass_z = (length_to_compact<std::int32_t>(hh.z) == h2.z);
-                        bool pass_dr = true; //(length_to_compact<std::int16_t>(hh.r - 6.8) == h2.dr);
-
-                        foundh2 |= (pass_phi && pass_z && pass_dr);
-                     }
-
-                     if (foundh1 && foundh2) {
-                         break;
-                     }
-		  }
-		  
-		  if( foundh1 && foundh2 ) {
-		     
-		     doublet_pass_pt.Fill(t.pt);
-		     doublet_pass_eta.Fill(t.eta);
-		     doublet_pass_phi.Fill(t.phi);
-		     
-		     n_doub_to_track++;
-		     break;
-		     
-		  }
-		  
-	       }	   
-	    }	   
-	}
+        for (std::size_t p = 0; p < pairs.size(); ++p) {
+            const auto &layer1 = layers[pairs[p].inner];
+            const auto &layer2 = layers[pairs[p].outer];
+
+            for (std::size_t d = r.pair_offsets[p]; d < r.pair_offsets[p + 1]; ++d) {
+                const auto &doublet = doublets[d];
+                doublets_inner.push_back(doublet.first);
+                doublets_outer.push_back(doublet.second);
+
+                const auto &h1 = layer1.at(doublet.first);
+                const auto &h2 = layer2.at(doublet.second);
+
+                doublet_phi1.Fill(h1.phi);
+                doublet_phi2.Fill(h2.phi);
+                doublet_phi2_phi1.Fill(deltaphi(h2.phi, h1.phi));
+                doublet_z1.Fill(h1.z);
+                doublet_z2.Fill(h2.z);
+
+                doublet_z0.Fill(beam_line_dz(h1.r, h1.z, h2.r, h2.z,
+                                             e.bs.r * std::cos(e.bs.phi - h1.phi),
+                                             e.bs.z));
+//                 doublet_b0.Fill(compact_to_length(extrapolated_dr(bs, h1, h2)));
+
+                if (do_validation) {
+                    for (const track &t : job.interesting_tracks) {
+                        bool foundh1 = 0;
+                        bool foundh2 = 0;
+
+                        for (const hit &hh : t.hits) {
+                            if (!hit_is_pixel_barrel(hh)) continue;
+
+                            int layer = hit_pixel_barrel_layer(hh);
+                            if (layer == pairs[p].inner) {
+                                bool pass_phi = (hh.phi == h1.phi);
+                                bool pass_z = (hh.z == h1.z);
+                                bool pass_dr = true; // (length_to_compact<std::int16_t>(hh.r - 3) == h1.dr);
+
+                                foundh1 |= (pass_phi && pass_z && pass_dr);
+                            } else if (layer == pairs[p].outer) {
+                                bool pass_phi = (hh.phi == h2.phi);
+                                bool pass_z = (hh.z == h2.z);
+                                bool pass_dr = true; //(length_to_compact<std::int16_t>(hh.r - 6.8) == h2.dr);
+
+                                foundh2 |= (pass_phi && pass_z && pass_dr);
+                            }
+
+                            if (foundh1 && foundh2) {
+                                break;
+                            }
+                        }
+
+                        if (foundh1 && foundh2) {
+                            doublet_pass_pt.Fill(t.pt);
+                            doublet_pass_eta.Fill(t.eta);
+                            doublet_pass_phi.Fill(t.phi);
+
+                            n_doub_to_track++;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
 
         tree.Fill();
-       
-       if( do_validation ) {
-	  
-            for (const track &t : interesting_tracks) {
-	     doublet_all_pt.Fill(t.pt);
-	     doublet_all_eta.Fill(t.eta);
-	     doublet_all_phi.Fill(t.phi);
-	     
-	     trk_pt.Fill(t.pt);
-	     trk_eta.Fill(t.eta);
-	     trk_phi.Fill(t.phi);
-	     
-	     n_track++;
-	  }
+
+        if (do_validation) {
+            for (const track &t : job.interesting_tracks) {
+                doublet_all_pt.Fill(t.pt);
+                doublet_all_eta.Fill(t.eta);
+                doublet_all_phi.Fill(t.phi);
+
+                trk_pt.Fill(t.pt);
+                trk_eta.Fill(t.eta);
+                trk_phi.Fill(t.phi);
+
+                n_track++;
+            }
         }
 
-        hit_count_1.Fill(wrap.layer1.size());
-        hit_count_2.Fill(wrap.layer2.size());
-        hit_count_12.Fill(wrap.layer1.size() * wrap.layer2.size());
+        hit_count_1.Fill(layers[0].size());
+        hit_count_2.Fill(layers[1].size());
+        hit_count_12.Fill(naive_doublets);
         doublet_count.Fill(doublets.size());
-    }
+        candidate_count.Fill(job.track_candidates.size());
+    };
+
+    pipeline.run(read, process, write);
 
     if( do_validation ) {
        
@@ -366,7 +745,84 @@ int main(int, char **)
               << " doublets in " << finding_acc.count()
               << " s (" << (1e6 * finding_acc.count() / i)
               << " us/event)" << std::endl;
+    std::cout << "Tested " << candidates << " candidates ("
+              << (100. * doublets_found / std::max(candidates, 1LL))
+              << "% accepted)" << std::endl;
+    std::cout << "Built " << track_candidates
+              << " track candidates in " << building_acc.count()
+              << " s (" << (1e6 * building_acc.count() / i)
+              << " us/event)" << std::endl;
+    if (std::any_of(workers.begin(), workers.end(),
+                    [](const worker_state &w) { return w.wrap.counters.available(); })) {
+        print_counters("Formatting: ", formatting_counters_acc, formatted_hits);
+        print_counters("Sorting:    ", sorting_counters_acc, sorted_hits);
+        print_counters("Finding:    ", finding_counters_acc, formatted_hits);
+    } else {
+        std::cout << "Hardware counters unavailable (see perf_event_paranoid)" << std::endl;
+    }
+    std::cout << "Read " << events_read
+              << " events in " << reading_acc.count()
+              << " s (" << (1e6 * reading_acc.count() / std::max(events_read, 1LL))
+              << " us/event, " << (1e-6 * in.bytes_read() / std::max(reading_acc.count(), 1e-9))
+              << " MB/s)" << std::endl;
+    std::size_t worker_allocations = 0;
+    for (const worker_state &worker : workers) {
+        worker_allocations += worker.allocations;
+    }
+    std::cout << "Reader made " << reader_allocations
+              << " allocations after the first event of every job ("
+              << (double(reader_allocations) / std::max(warm_events, 1LL))
+              << " /event)" << std::endl;
+    std::cout << "Workers made " << worker_allocations
+              << " allocations after the first event of every job ("
+              << (double(worker_allocations) / std::max(warm_events, 1LL))
+              << " /event)" << std::endl;
+    std::cout << "Largest event used " << (1e-6 * arena_peak)
+              << " MB of its arena" << std::endl;
    
+    // The workers are done, their histograms can be merged
+    latency_recorder latencies;
+    for (const worker_state &worker : workers) {
+        latencies.merge(worker.latencies);
+    }
+
+    out.cd();
+    TTree latency_tree("latency", "Duration percentiles");
+    latency_row row;
+    latency_tree.Branch("name", &row.name);
+    latency_tree.Branch("count", &row.count, "count/l");
+    latency_tree.Branch("mean_seconds", &row.mean);
+    latency_tree.Branch("p50_seconds", &row.p50);
+    latency_tree.Branch("p90_seconds", &row.p90);
+    latency_tree.Branch("p99_seconds", &row.p99);
+    latency_tree.Branch("p999_seconds", &row.p999);
+    latency_tree.Branch("max_seconds", &row.max);
+
+    std::cout << "==== Latency (us) ====" << std::endl;
+    std::cout << std::left << std::setw(24) << "stage" << std::right
+              << std::setw(8) << "events";
+    for (const char *column : { "mean", "p50", "p90", "p99", "p99.9", "max" }) {
+        std::cout << std::setw(10) << column;
+    }
+    std::cout << std::endl;
+    store_latencies(latency_tree, row, "formatting", latencies.formatting);
+    store_latencies(latency_tree, row, "sorting", latencies.sorting);
+    store_latencies(latency_tree, row, "finding", latencies.finding);
+    store_latencies(latency_tree, row, "building", latencies.building);
+    store_latencies(latency_tree, row, "total", latencies.total);
+    for (std::size_t s = 0; s < latencies.total_by_nvtx.size(); ++s) {
+        store_latencies(latency_tree, row,
+                        slice_name("nvtx", s, latencies.total_by_nvtx.size(),
+                                   latency_recorder::nvtx_slice_width),
+                        latencies.total_by_nvtx[s]);
+    }
+    for (std::size_t s = 0; s < latencies.total_by_hits.size(); ++s) {
+        store_latencies(latency_tree, row,
+                        slice_name("hits", s, latencies.total_by_hits.size(),
+                                   latency_recorder::hits_slice_width),
+                        latencies.total_by_hits[s]);
+    }
+
     if( do_validation )
      std::cout << n_doub_to_track << " of doublets are found in " << n_track << " tracks " << std::endl;
 
@@ -0,0 +1,98 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <type_traits>
+
+#include "doublet_finder.h"
+#include "dz_kernels.h"
+#include "native_reader.h"
+
+namespace /* anonymous */
+{
+    /**
+     * \brief Runs \c Finder on all events \c repetitions times and prints
+     *        timing information. The CPU finder splits large events over
+     *        \c threads threads.
+     */
+    template<class Finder>
+    void run(const native_event_reader &in, int repetitions, std::size_t threads)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        std::chrono::duration<double> formatting_acc{}, finding_acc{};
+        long long hits = 0;
+        long long doublets_found = 0;
+        long long candidates = 0;
+
+        doublet_finder_wrapper<Finder> wrap;
+        if constexpr (std::is_same_v<Finder, cpu_doublet_finder>) {
+            wrap.finder.set_threads(threads);
+        }
+        for (int rep = 0; rep < repetitions; ++rep) {
+            for (std::size_t i = 0; i < in.size(); ++i) {
+                native_event e = in.get(i);
+
+                // Hits are stored sorted, so this only runs the finding. The
+                // doublets are only counted, one chunk at a time.
+                auto r = wrap.find_sorted(
+                    e.bs, e.hits_per_layer,
+                    [&doublets_found](std::size_t,
+                                      const std::pmr::vector<typename Finder::doublet_type> &chunk) {
+                        doublets_found += chunk.size();
+                    });
+
+                formatting_acc += r.formatting;
+                finding_acc += r.finding;
+                for (const compact_hit_span &layer : e.hits_per_layer) {
+                    hits += layer.size();
+                }
+                candidates += r.candidates;
+            }
+        }
+
+        std::chrono::duration<double> total = std::chrono::steady_clock::now() - start;
+
+        long long events = std::max((long long) in.size() * repetitions, 1LL);
+        std::cout << "==== Performance info ====" << std::endl;
+        std::cout << "Processed " << events << " events with "
+                  << hits << " hits in " << total.count() << " s ("
+                  << (1e6 * total.count() / events)
+                  << " us/event)" << std::endl;
+        std::cout << "Formatted beam spots in " << formatting_acc.count()
+                  << " s (" << (1e6 * formatting_acc.count() / events)
+                  << " us/event)" << std::endl;
+        std::cout << "Found " << doublets_found
+                  << " doublets in " << finding_acc.count()
+                  << " s (" << (1e6 * finding_acc.count() / events)
+                  << " us/event)" << std::endl;
+        std::cout << "Tested " << candidates << " candidates ("
+                  << (100. * doublets_found / std::max(candidates, 1LL))
+                  << "% accepted)" << std::endl;
+        std::cout << "Using the " << selected_dz_kernel_name()
+                  << " dz kernel" << std::endl;
+    }
+} // namespace anonymous
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0]
+                  << " input.trkl [repetitions] [cpu|grid] [threads]" << std::endl;
+        return 1;
+    }
+    int repetitions = argc > 2 ? std::max(1, std::atoi(argv[2])) : 1;
+    std::string finder = argc > 3 ? argv[3] : "cpu";
+    std::size_t threads = argc > 4 ? std::max(1, std::atoi(argv[4])) : 1;
+
+    native_event_reader in(argv[1]);
+
+    if (finder == "cpu") {
+        run<cpu_doublet_finder>(in, repetitions, threads);
+    } else if (finder == "grid") {
+        run<grid_doublet_finder>(in, repetitions, threads);
+    } else {
+        std::cerr << "Unknown finder: " << finder << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,127 @@
+#ifndef FORK_JOIN_POOL_H
+#define FORK_JOIN_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * \brief Runs a few tasks in parallel and waits for all of them.
+ *
+ * The threads are started once and sleep between calls to \ref run, so that
+ * the cost of a call is a wake-up, not a thread creation. The calling thread
+ * takes part in the work.
+ */
+class fork_join_pool
+{
+public:
+    /// \brief Starts <tt>threads - 1</tt> helper threads
+    explicit fork_join_pool(std::size_t threads)
+    {
+        for (std::size_t i = 1; i < threads; ++i) {
+            _threads.emplace_back(&fork_join_pool::work, this);
+        }
+    }
+
+    ~fork_join_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _start.notify_all();
+        for (std::thread &t : _threads) {
+            t.join();
+        }
+    }
+
+    fork_join_pool(const fork_join_pool &) = delete;
+    fork_join_pool &operator=(const fork_join_pool &) = delete;
+
+    /// \brief Returns the number of threads, including the calling one
+    std::size_t threads() const { return _threads.size() + 1; }
+
+    /**
+     * \brief Calls <tt>task(i)</tt> for every \c i below \c count, in
+     *        parallel, and returns once all calls are done
+     */
+    void run(std::size_t count, const std::function<void(std::size_t)> &task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _task = &task;
+            _count = count;
+            _next = 0;
+            _done = 0;
+            ++_generation;
+        }
+        _start.notify_all();
+
+        const std::size_t mine = take();
+
+        // Helpers still in take() could claim an index of the next call once
+        // _next is reset, wait until they are out
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done += mine;
+        _finished.wait(lock, [this] { return _done == _count && _active == 0; });
+        _task = nullptr;
+    }
+
+private:
+    /// \brief Runs tasks until there are none left, returns how many
+    std::size_t take()
+    {
+        std::size_t ran = 0;
+        for (std::size_t i = _next++; i < _count; i = _next++) {
+            (*_task)(i);
+            ++ran;
+        }
+        return ran;
+    }
+
+    /// \brief Body of the helper threads
+    void work()
+    {
+        std::size_t seen = 0;
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _start.wait(lock, [&] { return _stop || _generation != seen; });
+            if (_stop) {
+                return;
+            }
+            seen = _generation;
+            if (_task == nullptr) {
+                // Woken too late, the call is already over
+                continue;
+            }
+
+            ++_active;
+            lock.unlock();
+            const std::size_t ran = take();
+            lock.lock();
+            --_active;
+
+            _done += ran;
+            if (_done == _count && _active == 0) {
+                _finished.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _start, _finished;
+    const std::function<void(std::size_t)> *_task = nullptr;
+    std::size_t _done = 0, _generation = 0;
+    std::size_t _active = 0; ///< \brief Helpers running \ref take
+
+    // Read by late helpers without the lock
+    std::atomic<std::size_t> _count{ 0 }, _next{ 0 };
+    bool _stop = false;
+};
+
+#endif // FORK_JOIN_POOL_H
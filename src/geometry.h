@@ -11,6 +11,24 @@ namespace geom
         11.0f,
         16.0f
     };
+
+    /**
+     * \brief A pair of pixel barrel layers in which to look for doublets.
+     *
+     * Layers are indices in \ref pixel_barrel_radius.
+     */
+    struct layer_pair
+    {
+        int inner; ///< \brief Layer of the first hit
+        int outer; ///< \brief Layer of the second hit
+    };
+
+    /// \brief Pairs of consecutive pixel barrel layers
+    const constexpr std::array<layer_pair, 3> consecutive_layer_pairs = {{
+        { 0, 1 },
+        { 1, 2 },
+        { 2, 3 }
+    }};
 } // namespace geom
 
 #endif // GEOMETRY_H
@@ -0,0 +1,80 @@
+#ifndef GHOST_HITS_H
+#define GHOST_HITS_H
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * \brief Copy of a layer sorted by \c phi, padded with ghost hits so that a
+ *        window of given width never needs to wrap around at +-pi.
+ *
+ * Hits within \c window of +pi are copied in front of the layer with \c phi
+ * decreased by \c period, and hits within \c window of -pi are copied at the
+ * end with \c phi increased by \c period. Every element remembers the index of
+ * the hit it was copied from. As long as the window is smaller than half a
+ * period, a window centered on a \c phi in the original range contains at
+ * most one copy of each hit.
+ *
+ * \tparam Phi A type able to hold angles up to <tt>period / 2 + window</tt>
+ * \tparam R   The type of the radial column
+ * \tparam Z   The type of the \c z column
+ */
+template<class Phi, class R, class Z>
+struct ghost_padded_layer
+{
+    std::vector<Phi> phi;              ///< \brief Angle, unwrapped
+    std::vector<R> r;                  ///< \brief Radial column
+    std::vector<Z> z;                  ///< \brief Position along \c z
+    std::vector<std::uint32_t> index;  ///< \brief Index in the original layer
+
+    /// \brief Returns the number of hits, ghosts included
+    std::size_t size() const { return phi.size(); }
+
+    /**
+     * \brief Fills the padded layer from columns sorted by \c phi.
+     *
+     * Memory is kept from one call to the next.
+     */
+    template<class InPhi>
+    void fill(const InPhi *in_phi, const R *in_r, const Z *in_z, std::size_t count,
+              Phi period, Phi window)
+    {
+        phi.clear();
+        r.clear();
+        z.clear();
+        index.clear();
+
+        const Phi half_period = period / 2;
+
+        // Ghosts of the hits close to +pi
+        std::size_t first_high = count;
+        while (first_high > 0 && Phi(in_phi[first_high - 1]) >= half_period - window) {
+            --first_high;
+        }
+        append(in_phi, in_r, in_z, first_high, count, -period);
+
+        append(in_phi, in_r, in_z, 0, count, 0);
+
+        // Ghosts of the hits close to -pi
+        std::size_t last_low = 0;
+        while (last_low < count && Phi(in_phi[last_low]) <= window - half_period) {
+            ++last_low;
+        }
+        append(in_phi, in_r, in_z, 0, last_low, period);
+    }
+
+private:
+    template<class InPhi>
+    void append(const InPhi *in_phi, const R *in_r, const Z *in_z,
+                std::size_t begin, std::size_t end, Phi shift)
+    {
+        for (std::size_t i = begin; i < end; ++i) {
+            phi.push_back(Phi(in_phi[i]) + shift);
+            r.push_back(in_r[i]);
+            z.push_back(in_z[i]);
+            index.push_back(i);
+        }
+    }
+};
+
+#endif // GHOST_HITS_H
@@ -1,22 +1,58 @@
 #ifndef HITUTILS_H
 #define HITUTILS_H
 
+#include <algorithm>
+#include <cstdint>
+#include <memory_resource>
+#include <numeric>
+#include <vector>
+
 #include "event.h"
 
 /**
  * \brief Hit compare function
  */
-inline bool hit_less_than(const hit &a, const hit &b)
+inline bool hit_equal(const hit &a, const hit &b)
 {
-    return a.z < b.z && a.phi < b.phi && a.r < b.r;
+    return a.z == b.z && a.phi == b.phi && a.r == b.r;
 }
 
 /**
- * \brief Hit compare function
+ * \brief Sorts a collection of hits (stored as columns) in increasing \c phi
+ *        order. The permutation is allocated like the hits.
  */
-inline bool hit_equal(const hit &a, const hit &b)
+template<class Columns>
+void sort_by_phi(Columns &hits)
 {
-    return a.z == b.z && a.phi == b.phi && a.r == b.r;
+    std::pmr::vector<std::uint32_t> order(hits.size(), hits.resource());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(),
+              order.end(),
+              [&hits](std::uint32_t a, std::uint32_t b) {
+                  return hits.phi[a] < hits.phi[b];
+              });
+    hits.permute(order);
+}
+
+/**
+ * \brief Sorts every segment of a collection of hits in increasing \c phi
+ *        order, segment \c s being <tt>hits[offsets[s]]</tt> to
+ *        <tt>hits[offsets[s + 1]]</tt> (excluded). The permutation is
+ *        allocated like the hits.
+ */
+template<class Columns>
+void segmented_sort_by_phi(Columns &hits, const std::pmr::vector<std::size_t> &offsets)
+{
+    std::pmr::vector<std::uint32_t> order(hits.size(), hits.resource());
+    std::iota(order.begin(), order.end(), 0);
+    for (std::size_t s = 0; s + 1 < offsets.size(); ++s) {
+        std::sort(order.begin() + offsets[s],
+                  order.begin() + offsets[s + 1],
+                  [&hits](std::uint32_t a, std::uint32_t b) {
+                      return hits.phi[a] < hits.phi[b];
+                  });
+    }
+    hits.permute(order);
 }
 
 /**
@@ -0,0 +1,52 @@
+#include "latency_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+void latency_histogram::merge(const latency_histogram &other)
+{
+    for (std::size_t i = 0; i < bucket_count; ++i) {
+        _counts[i] += other._counts[i];
+    }
+    _count += other._count;
+    _sum += other._sum;
+    _min = std::min(_min, other._min);
+    _max = std::max(_max, other._max);
+}
+
+void latency_histogram::clear()
+{
+    *this = latency_histogram();
+}
+
+std::uint64_t latency_histogram::bucket_high(std::size_t index)
+{
+    const std::size_t magnitude = index >> sub_bucket_bits;
+    const std::uint64_t sub_bucket = index & (sub_bucket_count - 1);
+    if (magnitude == 0) {
+        return sub_bucket;
+    }
+    const int shift = int(magnitude) - 1;
+    const std::uint64_t low = (sub_bucket_count + sub_bucket) << shift;
+    return low + ((std::uint64_t(1) << shift) - 1);
+}
+
+std::uint64_t latency_histogram::value_at_percentile(double percentile) const
+{
+    if (_count == 0) {
+        return 0;
+    }
+
+    // Rank of the value, starting from 1
+    const double fraction = std::min(std::max(percentile, 0.), 100.) / 100;
+    const std::uint64_t rank = std::max<std::uint64_t>(1, std::ceil(fraction * _count));
+
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < bucket_count; ++i) {
+        seen += _counts[i];
+        if (seen >= rank) {
+            return std::min(bucket_high(i), _max);
+        }
+    }
+    return _max;
+}
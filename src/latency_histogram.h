@@ -0,0 +1,96 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * \brief Records durations in logarithmic buckets to compute percentiles.
+ *
+ * Values are recorded in nanoseconds. Below \ref sub_bucket_count they are
+ * exact; above, every power of two is split in \ref sub_bucket_count linear
+ * buckets, so the relative error is always below <tt>1 / sub_bucket_count</tt>
+ * (about 3%) whatever the value. Nothing overflows and recording is a few
+ * instructions.
+ *
+ * Histograms filled by different threads can be added with \ref merge.
+ */
+class latency_histogram
+{
+public:
+    /// \brief Log2 of \ref sub_bucket_count
+    static const constexpr int sub_bucket_bits = 5;
+
+    /// \brief Number of linear buckets per power of two
+    static const constexpr std::uint64_t sub_bucket_count = 1 << sub_bucket_bits;
+
+    /// \brief Total number of buckets, enough for any 64-bit value
+    static const constexpr std::size_t bucket_count = (65 - sub_bucket_bits) * sub_bucket_count;
+
+    /// \brief Adds a value, in nanoseconds
+    void record(std::uint64_t nanoseconds)
+    {
+        ++_counts[bucket(nanoseconds)];
+        ++_count;
+        _sum += nanoseconds;
+        _min = nanoseconds < _min ? nanoseconds : _min;
+        _max = nanoseconds > _max ? nanoseconds : _max;
+    }
+
+    /// \brief Adds a duration
+    template<class Rep, class Period>
+    void record(std::chrono::duration<Rep, Period> d)
+    {
+        const auto ns = std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(d);
+        record(ns.count() > 0 ? std::uint64_t(ns.count()) : 0);
+    }
+
+    /// \brief Adds the values recorded in \c other
+    void merge(const latency_histogram &other);
+
+    /// \brief Removes all values
+    void clear();
+
+    /// \brief Returns the number of recorded values
+    std::uint64_t count() const { return _count; }
+
+    /// \brief Returns the smallest recorded value (ns), 0 if empty
+    std::uint64_t min() const { return _count == 0 ? 0 : _min; }
+
+    /// \brief Returns the largest recorded value (ns)
+    std::uint64_t max() const { return _max; }
+
+    /// \brief Returns the mean of the recorded values (ns)
+    double mean() const { return _count == 0 ? 0 : double(_sum) / _count; }
+
+    /**
+     * \brief Returns the value below which \c percentile % of the values are
+     *        (ns), 0 if empty.
+     *
+     * The upper edge of the bucket is returned, so the result is never below
+     * the true percentile.
+     */
+    std::uint64_t value_at_percentile(double percentile) const;
+
+private:
+    /// \brief Returns the index of the bucket holding \c value
+    static std::size_t bucket(std::uint64_t value)
+    {
+        if (value < sub_bucket_count) {
+            return std::size_t(value);
+        }
+        const int shift = 63 - __builtin_clzll(value) - sub_bucket_bits;
+        return (std::size_t(shift + 1) << sub_bucket_bits)
+               | std::size_t((value >> shift) - sub_bucket_count);
+    }
+
+    /// \brief Returns the largest value that goes to bucket \c index
+    static std::uint64_t bucket_high(std::size_t index);
+
+    std::array<std::uint64_t, bucket_count> _counts{};
+    std::uint64_t _count = 0, _sum = 0;
+    std::uint64_t _min = UINT64_MAX, _max = 0;
+};
+
+#endif // LATENCY_HISTOGRAM_H
@@ -0,0 +1,75 @@
+#ifndef NATIVE_FORMAT_H
+#define NATIVE_FORMAT_H
+
+#include <cstdint>
+
+/**
+ * \brief Layout of the native event format.
+ *
+ * The native format stores only what the doublet finders need: the beam spot
+ * and the pixel barrel hits of every event, already converted to the compact
+ * representation and sorted by \c phi within each layer. It is meant to be
+ * memory-mapped and used in place.
+ *
+ * The file starts with a \ref file_header. All other sections are referenced
+ * by their offset from the beginning of the file and aligned to
+ * \ref alignment bytes:
+ *
+ * - <tt>event_record[event_count]</tt>
+ * - for every layer:
+ *   - <tt>uint64[event_count + 1]</tt>: index of the first hit of each event
+ *     in the columns of the layer, followed by the total number of hits
+ *   - <tt>int16[hit_count]</tt>: \ref compact_hit::dr
+ *   - <tt>int16[hit_count]</tt>: \ref compact_hit::phi
+ *   - <tt>int32[hit_count]</tt>: \ref compact_hit::z
+ *
+ * Numbers are stored in the byte order of the machine that wrote the file.
+ * Hits are encoded relative to the radius of their own layer.
+ */
+namespace native
+{
+    /// \brief Identifies native files
+    const constexpr char magic[8] = { 'T', 'R', 'K', 'E', 'L', 'L', 'A', '\0' };
+
+    /// \brief Bumped every time the layout changes
+    const constexpr std::uint32_t version = 1;
+
+    /// \brief Number of pixel barrel layers stored in a file
+    const constexpr std::uint32_t layer_count = 4;
+
+    /// \brief Alignment of every section in the file (bytes)
+    const constexpr std::uint64_t alignment = 64;
+
+    /// \brief Per-event information
+    struct event_record
+    {
+        float bs_r, bs_phi, bs_z; ///< \brief Beam spot position
+        std::int32_t nvtx;        ///< \brief Number of primary vertices
+    };
+    static_assert(sizeof(event_record) == 16);
+
+    /// \brief Locates the data of one layer
+    struct layer_record
+    {
+        std::uint64_t hit_count; ///< \brief Number of hits in all events
+        std::uint64_t offsets;   ///< \brief Offset of the per-event hit index
+        std::uint64_t dr;        ///< \brief Offset of the \c dr column
+        std::uint64_t phi;       ///< \brief Offset of the \c phi column
+        std::uint64_t z;         ///< \brief Offset of the \c z column
+    };
+    static_assert(sizeof(layer_record) == 40);
+
+    /// \brief Beginning of a native file
+    struct file_header
+    {
+        char magic[8];               ///< \brief Must be \ref native::magic
+        std::uint32_t version;       ///< \brief Must be \ref native::version
+        std::uint32_t layer_count;   ///< \brief Must be \ref native::layer_count
+        std::uint64_t event_count;   ///< \brief Number of events
+        std::uint64_t events;        ///< \brief Offset of the event records
+        layer_record layers[native::layer_count];
+    };
+    static_assert(sizeof(file_header) == 32 + native::layer_count * sizeof(layer_record));
+} // namespace native
+
+#endif // NATIVE_FORMAT_H
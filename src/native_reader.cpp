@@ -0,0 +1,133 @@
+#include "native_reader.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+template<class T>
+const T *native_event_reader::section(std::uint64_t offset,
+                                      std::uint64_t count) const
+{
+    if (offset % native::alignment != 0
+        || offset > _size
+        || count > (_size - offset) / sizeof(T)) {
+        throw std::runtime_error("Corrupted native file: bad section");
+    }
+    return reinterpret_cast<const T *>(_data + offset);
+}
+
+native_event_reader::native_event_reader(const std::string &filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open " + filename);
+    }
+
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Cannot stat " + filename);
+    }
+    _size = info.st_size;
+
+    if (_size < sizeof(native::file_header)) {
+        ::close(fd);
+        throw std::runtime_error(filename + " is not a native file");
+    }
+
+    void *data = ::mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // The mapping stays valid
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Cannot map " + filename);
+    }
+    _data = static_cast<const char *>(data);
+
+    // Events are read in order
+    ::madvise(data, _size, MADV_SEQUENTIAL);
+
+    try {
+        _header = section<native::file_header>(0, 1);
+        if (std::memcmp(_header->magic, native::magic, sizeof(native::magic)) != 0) {
+            throw std::runtime_error(filename + " is not a native file");
+        }
+        if (_header->version != native::version) {
+            throw std::runtime_error(filename + ": unsupported version "
+                                     + std::to_string(_header->version));
+        }
+        if (_header->layer_count != native::layer_count) {
+            throw std::runtime_error(filename + ": unexpected number of layers");
+        }
+
+        // Every event needs an offset per layer. Checked first, so that
+        // event_count + 1 below can't wrap around to 0.
+        if (_header->event_count >= _size / sizeof(std::uint64_t)) {
+            throw std::runtime_error("Corrupted native file: bad event count");
+        }
+
+        // Check everything once, so that get() doesn't need to
+        section<native::event_record>(_header->events, _header->event_count);
+        for (const native::layer_record &layer : _header->layers) {
+            const std::uint64_t *offsets =
+                section<std::uint64_t>(layer.offsets, _header->event_count + 1);
+            section<std::int16_t>(layer.dr, layer.hit_count);
+            section<std::int16_t>(layer.phi, layer.hit_count);
+            section<std::int32_t>(layer.z, layer.hit_count);
+
+            if (offsets[0] != 0 || offsets[_header->event_count] != layer.hit_count) {
+                throw std::runtime_error("Corrupted native file: bad hit index");
+            }
+            for (std::size_t i = 0; i < _header->event_count; ++i) {
+                if (offsets[i] > offsets[i + 1]) {
+                    throw std::runtime_error("Corrupted native file: bad hit index");
+                }
+            }
+        }
+    } catch (...) {
+        ::munmap(const_cast<char *>(_data), _size);
+        throw;
+    }
+}
+
+native_event_reader::~native_event_reader()
+{
+    ::munmap(const_cast<char *>(_data), _size);
+}
+
+bool native_event_reader::is_native(const std::string &filename)
+{
+    char buffer[sizeof(native::magic)] = {};
+    std::ifstream in(filename, std::ios::binary);
+    in.read(buffer, sizeof(buffer));
+    return in && std::memcmp(buffer, native::magic, sizeof(buffer)) == 0;
+}
+
+native_event native_event_reader::get(std::size_t i) const
+{
+    const auto *record = reinterpret_cast<const native::event_record *>(
+        _data + _header->events) + i;
+
+    native_event e;
+    e.bs = { record->bs_r, record->bs_phi, record->bs_z };
+    e.nvtx = record->nvtx;
+
+    for (std::size_t l = 0; l < native::layer_count; ++l) {
+        const native::layer_record &layer = _header->layers[l];
+        const auto *offsets = reinterpret_cast<const std::uint64_t *>(
+            _data + layer.offsets);
+        const std::uint64_t begin = offsets[i];
+        const std::uint64_t end = offsets[i + 1];
+
+        e.hits_per_layer[l] = compact_hit_span(
+            reinterpret_cast<const std::int16_t *>(_data + layer.dr) + begin,
+            reinterpret_cast<const std::int16_t *>(_data + layer.phi) + begin,
+            reinterpret_cast<const std::int32_t *>(_data + layer.z) + begin,
+            end - begin);
+    }
+
+    return e;
+}
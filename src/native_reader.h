@@ -0,0 +1,72 @@
+#ifndef NATIVE_READER_H
+#define NATIVE_READER_H
+
+#include <array>
+#include <cstddef>
+#include <string>
+
+#include "compact.h"
+#include "event.h"
+#include "native_format.h"
+
+/**
+ * \brief An event read from a native file.
+ *
+ * The hits point directly into the mapped file and stay valid as long as the
+ * reader exists.
+ */
+struct native_event
+{
+    beam_spot bs;
+    int nvtx;
+
+    /// \brief Pixel barrel hits, sorted by \c phi
+    std::array<compact_hit_span, native::layer_count> hits_per_layer;
+};
+
+/**
+ * \brief Reads events from a file in the native format (see \ref native).
+ *
+ * The file is mapped in memory and nothing is copied. The interface follows
+ * \ref event_reader.
+ */
+class native_event_reader final
+{
+    const char *_data = nullptr;
+    std::size_t _size = 0;
+    const native::file_header *_header = nullptr;
+    std::size_t _next = 0;
+
+    template<class T>
+    const T *section(std::uint64_t offset, std::uint64_t count) const;
+
+public:
+    /**
+     * \brief Maps \c filename in memory.
+     *
+     * \throws std::runtime_error if the file cannot be mapped or isn't a valid
+     *         native file.
+     */
+    explicit native_event_reader(const std::string &filename);
+    ~native_event_reader();
+
+    native_event_reader(const native_event_reader &) = delete;
+    native_event_reader &operator=(const native_event_reader &) = delete;
+
+    /// \brief Returns \c true if \c filename starts like a native file
+    static bool is_native(const std::string &filename);
+
+    /// \brief Returns the number of events in the file
+    std::size_t size() const { return _header->event_count; }
+
+    /// \brief Returns event number \c i
+    native_event get(std::size_t i) const;
+
+    /// \brief Moves to the next event, returns \c false at the end of the file
+    bool next() { return ++_next <= size(); }
+
+    /// \brief Returns the current event
+    native_event get() const { return get(_next - 1); }
+};
+
+#endif // NATIVE_READER_H
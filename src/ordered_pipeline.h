@@ -0,0 +1,125 @@
+#ifndef ORDERED_PIPELINE_H
+#define ORDERED_PIPELINE_H
+
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "spsc_queue.h"
+
+/**
+ * \brief Runs a read -> process -> write chain on several threads.
+ *
+ * Jobs are read by a single thread, processed by \c workers threads in
+ * parallel, and written in the order they were read by the thread calling
+ * \ref run. Job \c i is always processed by worker <tt>i % workers</tt>, which
+ * is what keeps the output in order without any sorting.
+ *
+ * The stages are connected by bounded lock-free queues, on which idle stages
+ * sleep instead of spinning. Jobs are allocated once and recycled, so they can
+ * keep buffers from one event to the next.
+ */
+template<class Job>
+class ordered_pipeline
+{
+    struct lane
+    {
+        spsc_queue<Job *> free;   ///< \brief Writer -> reader
+        spsc_queue<Job *> input;  ///< \brief Reader -> worker
+        spsc_queue<Job *> output; ///< \brief Worker -> writer
+
+        explicit lane(std::size_t depth) :
+            free(depth), input(depth + 1), output(depth + 1)
+        {}
+    };
+
+    std::size_t _workers, _depth;
+
+public:
+    /**
+     * \brief Constructor
+     *
+     * \param workers Number of processing threads.
+     * \param depth   Number of jobs in flight for each worker.
+     */
+    explicit ordered_pipeline(std::size_t workers, std::size_t depth = 4) :
+        _workers(workers > 0 ? workers : 1),
+        _depth(depth > 0 ? depth : 1)
+    {}
+
+    /// \brief Returns the number of processing threads
+    std::size_t workers() const { return _workers; }
+
+    /**
+     * \brief Runs the pipeline until \c read returns \c false.
+     *
+     * \param read    Called as <tt>bool read(Job &)</tt> on the reader thread.
+     *                Returns \c false when there is nothing left to read.
+     * \param process Called as <tt>void process(Job &, std::size_t worker)</tt>
+     *                on the worker threads.
+     * \param write   Called as <tt>void write(Job &)</tt> on the calling
+     *                thread, in reading order.
+     */
+    template<class Reader, class Worker, class Writer>
+    void run(Reader &&read, Worker &&process, Writer &&write);
+};
+
+template<class Job>
+template<class Reader, class Worker, class Writer>
+void ordered_pipeline<Job>::run(Reader &&read, Worker &&process, Writer &&write)
+{
+    std::vector<std::unique_ptr<Job>> jobs;
+    std::vector<std::unique_ptr<lane>> lanes;
+    for (std::size_t i = 0; i < _workers; ++i) {
+        lanes.push_back(std::make_unique<lane>(_depth));
+        for (std::size_t j = 0; j < _depth; ++j) {
+            jobs.push_back(std::make_unique<Job>());
+            lanes.back()->free.push(jobs.back().get());
+        }
+    }
+
+    std::thread reader([&]() {
+        for (std::size_t i = 0; ; ++i) {
+            lane &l = *lanes[i % _workers];
+            Job *job = l.free.pop();
+            if (!read(*job)) {
+                // A null job tells the workers and the writer to stop
+                for (auto &other : lanes) {
+                    other->input.push(nullptr);
+                }
+                return;
+            }
+            l.input.push(job);
+        }
+    });
+
+    std::vector<std::thread> workers;
+    for (std::size_t w = 0; w < _workers; ++w) {
+        workers.emplace_back([&, w]() {
+            lane &l = *lanes[w];
+            while (Job *job = l.input.pop()) {
+                process(*job, w);
+                l.output.push(job);
+            }
+            l.output.push(nullptr);
+        });
+    }
+
+    for (std::size_t i = 0; ; ++i) {
+        lane &l = *lanes[i % _workers];
+        Job *job = l.output.pop();
+        if (job == nullptr) {
+            break;
+        }
+        write(*job);
+        l.free.push(job);
+    }
+
+    reader.join();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+#endif // ORDERED_PIPELINE_H
@@ -0,0 +1,119 @@
+#include "perf_counters.h"
+
+#ifdef __linux__
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+namespace /* anonymous */
+{
+    /// \brief Type and config of every counter, in the order of \ref counter_values
+    const constexpr std::uint32_t event_types[] = {
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+    };
+    const constexpr std::uint64_t event_configs[] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+
+    /// \brief Opens one counter of the calling thread, on any CPU
+    int open_event(std::uint32_t type, std::uint64_t config, int group_fd)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = group_fd < 0; // The leader starts the group
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return int(syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0));
+    }
+} // namespace anonymous
+#endif
+
+perf_counters::~perf_counters()
+{
+#ifdef __linux__
+    for (int fd : _fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+#endif
+}
+
+void perf_counters::open()
+{
+    _opened = true;
+#ifdef __linux__
+    for (std::size_t i = 0; i < counter_count; ++i) {
+        const int fd = open_event(event_types[i], event_configs[i], _group_fd);
+        if (fd < 0) {
+            // Denied or not supported by this CPU
+            continue;
+        }
+        if (_group_fd < 0) {
+            _group_fd = fd;
+        }
+        _fds[i] = fd;
+        _slots[i] = _open_count++;
+    }
+    if (_group_fd >= 0) {
+        ioctl(_group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(_group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+counter_values perf_counters::read()
+{
+    counter_values values;
+    if (!_enabled) {
+        return values;
+    }
+    if (!_opened) {
+        open();
+    }
+#ifdef __linux__
+    if (_group_fd < 0) {
+        return values;
+    }
+
+    // Layout of PERF_FORMAT_GROUP: the number of events, then their values
+    std::uint64_t buffer[1 + counter_count];
+    const auto size = (1 + _open_count) * sizeof(std::uint64_t);
+    if (::read(_group_fd, buffer, size) != ssize_t(size)) {
+        return values;
+    }
+
+    std::uint64_t *fields[] = {
+        &values.cycles,
+        &values.instructions,
+        &values.l1d_misses,
+        &values.llc_misses,
+        &values.branch_misses,
+    };
+    for (std::size_t i = 0; i < counter_count; ++i) {
+        if (_fds[i] >= 0) {
+            *fields[i] = buffer[1 + _slots[i]];
+        }
+    }
+#endif
+    return values;
+}
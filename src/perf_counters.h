@@ -0,0 +1,109 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <array>
+#include <cstdint>
+
+/**
+ * \brief Values of the hardware counters read by \ref perf_counters.
+ *
+ * Counters that could not be opened stay at zero.
+ */
+struct counter_values
+{
+    std::uint64_t cycles = 0;        ///< \brief CPU cycles
+    std::uint64_t instructions = 0;  ///< \brief Retired instructions
+    std::uint64_t l1d_misses = 0;    ///< \brief L1 data cache read misses
+    std::uint64_t llc_misses = 0;    ///< \brief Last level cache misses
+    std::uint64_t branch_misses = 0; ///< \brief Mispredicted branches
+
+    /// \brief Returns the counts between \c start and this
+    counter_values operator-(const counter_values &start) const
+    {
+        counter_values result;
+        result.cycles = cycles - start.cycles;
+        result.instructions = instructions - start.instructions;
+        result.l1d_misses = l1d_misses - start.l1d_misses;
+        result.llc_misses = llc_misses - start.llc_misses;
+        result.branch_misses = branch_misses - start.branch_misses;
+        return result;
+    }
+
+    /// \brief Accumulates counts
+    counter_values &operator+=(const counter_values &other)
+    {
+        cycles += other.cycles;
+        instructions += other.instructions;
+        l1d_misses += other.l1d_misses;
+        llc_misses += other.llc_misses;
+        branch_misses += other.branch_misses;
+        return *this;
+    }
+
+    /// \brief Returns the number of instructions per cycle
+    double ipc() const
+    {
+        return cycles == 0 ? 0 : double(instructions) / cycles;
+    }
+};
+
+/**
+ * \brief Reads hardware counters of the calling thread with \c perf_event_open.
+ *
+ * The counters are only opened once \ref enable has been called, by the first
+ * \ref read, so that they count the thread that reads them. They are opened
+ * as a single group and read with one system call.
+ *
+ * When the kernel denies access (eg \c perf_event_paranoid is too high, in a
+ * container, or on a system other than Linux), \ref available returns
+ * \c false and \ref read returns zeros. Events that the CPU doesn't support
+ * are left out of the group and read as zero.
+ */
+class perf_counters
+{
+public:
+    perf_counters() = default;
+    ~perf_counters();
+
+    perf_counters(const perf_counters &) = delete;
+    perf_counters &operator=(const perf_counters &) = delete;
+
+    /// \brief Makes the next \ref read open the counters
+    void enable() { _enabled = true; }
+
+    /// \brief Returns \c true if \ref enable was called
+    bool enabled() const { return _enabled; }
+
+    /**
+     * \brief Returns \c true if at least one counter could be opened.
+     *
+     * Only meaningful after the first \ref read.
+     */
+    bool available() const { return _group_fd >= 0; }
+
+    /**
+     * \brief Returns the current counts, or zeros if the counters are
+     *        disabled or unavailable
+     */
+    counter_values read();
+
+private:
+    /// \brief Opens the counters for the calling thread
+    void open();
+
+    /// \brief Number of counters in \ref counter_values
+    static const constexpr std::size_t counter_count = 5;
+
+    bool _enabled = false;
+    bool _opened = false;
+    int _group_fd = -1;
+
+    /// \brief File descriptor of every counter, -1 if it couldn't be opened
+    std::array<int, counter_count> _fds{ { -1, -1, -1, -1, -1 } };
+
+    /// \brief Position of every counter in the group read, if opened
+    std::array<std::size_t, counter_count> _slots{};
+    std::size_t _open_count = 0;
+};
+
+#endif // PERF_COUNTERS_H
@@ -6,8 +6,10 @@
 #include <TH2D.h>
 
 #include "compact.h"
+#include "doublet_finder.h"
 #include "eventreader.h"
 #include "hitutils.h"
+#include "triplet_finder.h"
 
 float dphi3(float phi1, float phi2, float phi3)
 {
@@ -51,7 +53,12 @@ int main(int, char **)
     TH2D seed_phi2_phi4("seed_phi2_phi4", ";phi2;phi4", 50, -0.5, 0.5, 50, -0.5, 0.5);
     TH2D seed_phi3_phi4("seed_phi3_phi4", ";phi3;phi4", 50, -0.5, 0.5, 50, -0.5, 0.5);
 
-    event_reader in("~lmoureau/data/v3.root");
+    doublet_finder_wrapper<float_doublet_finder> doublets;
+    triplet_finder seeds;
+
+    event_reader::columns read_columns;
+    read_columns.vertices = false;
+    event_reader in("~lmoureau/data/v3.root", read_columns);
     long long i = 0;
     while (in.next()) {
         std::cout << "===== Event " << i++ << " =====" << std::endl;
@@ -60,11 +67,7 @@ int main(int, char **)
                   << e->bs.r << " "
                   << e->bs.phi << " "
                   << e->bs.z << std::endl;
-        std::cout << "#hits:       " << e->hits.size() << std::endl;
-        std::sort(e->hits.begin(), e->hits.end(), hit_less_than);
-        e->hits.erase(std::unique(e->hits.begin(), e->hits.end(), hit_equal),
-                      e->hits.end());
-        std::cout << "  unique:    " << e->hits.size() << std::endl;
+        std::cout << "#hits:       " << e->hits.size() << " (unique)" << std::endl;
         std::cout << "#tracks:     " << e->tracks.size() << std::endl;
 
         std::array<std::vector<hit>, 4> pb_seeds_per_layer;
@@ -176,78 +179,43 @@ int main(int, char **)
             std::cout << "  layer " << layer << ":   " << pb_seeds_per_layer[layer].size() << std::endl;
         }
 
-        std::vector<hit> pb_hits;
-        std::copy_if(e->hits.begin(), e->hits.end(), std::back_inserter(pb_hits), hit_is_pixel_barrel);
-        std::cout << "#pb hits:    " << pb_hits.size() << std::endl;
-
-        std::array<std::vector<hit>, 4> pb_hits_per_layer;
-        for (const hit &h : pb_hits) {
-            pb_hits_per_layer[hit_pixel_barrel_layer(h)].push_back(h);
+        std::array<hit_columns, 4> pb_hits_per_layer;
+        std::size_t pb_hit_count = 0;
+        for (std::size_t ih = 0; ih < e->hits.size(); ++ih) {
+            const hit h = e->hits[ih];
+            if (hit_is_pixel_barrel(h)) {
+                pb_hits_per_layer[hit_pixel_barrel_layer(h)].push_back(h);
+                ++pb_hit_count;
+            }
         }
+        std::cout << "#pb hits:    " << pb_hit_count << std::endl;
         for (unsigned layer = 0; layer < pb_hits_per_layer.size(); ++layer) {
             std::cout << "  layer " << layer << ":   " << pb_hits_per_layer[layer].size() << std::endl;
         }
 
-        continue; // Don't run seed finding
+        std::cout << "Searching for doublets..." << std::flush;
+        auto r = doublets.find(e->bs, pb_hits_per_layer);
+        std::cout << " " << r.doublets.size() << " doublets." << std::endl;
 
-        std::cout << "Searching for hit pairs in layers 3 and 4..." << std::flush;
-        std::vector<std::vector<hit>> candidates;
-        for (const hit &h3 : pb_hits_per_layer[3]) {
-            for (const hit &h2 : pb_hits_per_layer[2]) {
-                if (std::abs(h3.phi - h2.phi) < 0.2) {
-                    candidates.push_back({ h3, h2 });
-                }
-            }
+        std::array<hit_span, 4> layers;
+        for (std::size_t l = 0; l < layers.size(); ++l) {
+            layers[l] = doublets.layers[l];
         }
-        std::cout << " " << candidates.size() << " candidates." << std::endl;
 
-        std::cout << "Matching to layer 2..." << std::flush;
-        std::vector<std::vector<hit>> new_candidates;
-        for (const auto &pair : candidates) {
-            const hit &h3 = pair[0];
-            const hit &h2 = pair[1];
-
-            for (const hit &h1 : pb_hits_per_layer[1]) {
-                float dphi3 = ::dphi3(h1.phi, h3.phi, h3.phi);
-                if (-0.01 < dphi3 && dphi3 < 0.05
-                    && std::abs(h3.z + h1.z - 2 * h2.z) < 2.5) {
-                    std::vector<hit> newc = pair;
-                    newc.push_back(h1);
-                    new_candidates.push_back(newc);
-                }
-            }
-        }
-        std::swap(candidates, new_candidates);
-        new_candidates.clear();
-
-        std::cout << " " << candidates.size() << " candidates." << std::endl;
-
-        std::cout << "Matching to layer 1..." << std::flush;
-        for (const auto &pair : candidates) {
-            const hit &h3 = pair[0];
-            const hit &h2 = pair[1];
-            const hit &h1 = pair[2];
-
-            for (const hit &h0 : pb_hits_per_layer[0]) {
-                float dphi3 = ::dphi3(h0.phi, h1.phi, h2.phi);
-                if (-0.03 < dphi3 && dphi3 < 0.05
-                    && std::abs(h3.z + h0.z - 3 * h2.z) < 1.5) {
-                    std::vector<hit> newc = pair;
-                    newc.push_back(h0);
-                    new_candidates.push_back(newc);
-                }
-            }
-        }
-        std::swap(candidates, new_candidates);
-        new_candidates.clear();
-
-        std::cout << " " << candidates.size() << " candidates." << std::endl;
+        std::cout << "Chaining doublets..." << std::flush;
+        seeds.find(layers, doublets.pairs, r.doublets, r.pair_offsets);
+        std::cout << " " << seeds.triplets().size() << " triplets, "
+                  << seeds.quadruplets().size() << " quadruplets." << std::endl;
         std::cout << "Plotting..." << std::endl;
 
-        for (const auto &seed : candidates) {
-            seed_phi2_phi3.Fill(seed[2].phi - seed[3].phi, seed[1].phi - seed[3].phi);
-            seed_phi2_phi4.Fill(seed[2].phi - seed[3].phi, seed[0].phi - seed[3].phi);
-            seed_phi3_phi4.Fill(seed[1].phi - seed[3].phi, seed[0].phi - seed[3].phi);
+        for (const auto &seed : seeds.quadruplets()) {
+            std::array<float, 4> phi;
+            for (std::size_t k = 0; k < phi.size(); ++k) {
+                phi[k] = layers[seed.layers[k]].phi[seed.hits[k]];
+            }
+            seed_phi2_phi3.Fill(phi[1] - phi[0], phi[2] - phi[0]);
+            seed_phi2_phi4.Fill(phi[1] - phi[0], phi[3] - phi[0]);
+            seed_phi3_phi4.Fill(phi[2] - phi[0], phi[3] - phi[0]);
         }
     }
 
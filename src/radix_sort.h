@@ -0,0 +1,121 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <array>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+#include "compact.h"
+
+/**
+ * \brief Computes the permutation that sorts 16-bit keys in increasing order.
+ *
+ * This is a least-significant-digit radix sort with two passes of 8 bits. It
+ * is stable and runs in linear time.
+ *
+ * \param keys    The keys to sort.
+ * \param count   The number of keys.
+ * \param order   Receives the permutation: <tt>keys[order[i]]</tt> is sorted.
+ * \param scratch Temporary buffer.
+ *
+ * \c Buffer is a vector of \c std::uint32_t, with any allocator.
+ */
+template<class Buffer>
+void radix_sort_order(const std::int16_t *keys, std::size_t count,
+                      Buffer &order, Buffer &scratch)
+{
+    order.resize(count);
+    scratch.resize(count);
+
+    // Flipping the sign bit maps the signed order to the unsigned order
+    auto key = [keys](std::uint32_t i) {
+        return std::uint16_t(keys[i] ^ 0x8000);
+    };
+
+    // Both histograms in a single pass
+    std::array<std::uint32_t, 256> low = {}, high = {};
+    for (std::size_t i = 0; i < count; ++i) {
+        std::uint16_t k = key(i);
+        ++low[k & 0xff];
+        ++high[k >> 8];
+    }
+
+    // Exclusive prefix sums
+    std::uint32_t low_sum = 0, high_sum = 0;
+    for (std::size_t b = 0; b < 256; ++b) {
+        std::uint32_t l = low[b], h = high[b];
+        low[b] = low_sum;
+        high[b] = high_sum;
+        low_sum += l;
+        high_sum += h;
+    }
+
+    for (std::uint32_t i = 0; i < count; ++i) {
+        scratch[low[key(i) & 0xff]++] = i;
+    }
+    for (std::uint32_t i : scratch) {
+        order[high[key(i) >> 8]++] = i;
+    }
+}
+
+/**
+ * \brief Computes the permutation that sorts every segment of 16-bit keys in
+ *        increasing order, keeping the segments in place.
+ *
+ * Segment \c s is <tt>keys[offsets[s]]</tt> to <tt>keys[offsets[s + 1]]</tt>.
+ * Small segments are sorted all together, followed by a stable counting pass
+ * that puts every key back in its segment, so that the histograms are only
+ * built once. Large segments are sorted one by one, so that they stay in
+ * cache. The temporaries are allocated like \c order.
+ */
+inline void segmented_radix_sort_order(const std::int16_t *keys,
+                                       const std::pmr::vector<std::size_t> &offsets,
+                                       std::pmr::vector<std::uint32_t> &order,
+                                       std::pmr::vector<std::uint32_t> &scratch)
+{
+    const std::size_t segments = offsets.empty() ? 0 : offsets.size() - 1;
+    const std::size_t count = offsets.empty() ? 0 : offsets.back();
+
+    std::pmr::vector<std::uint32_t> sorted(order.get_allocator());
+    if (count < 256 * segments) {
+        radix_sort_order(keys, count, sorted, scratch);
+
+        // Segment of every key
+        for (std::size_t s = 0; s < segments; ++s) {
+            for (std::size_t i = offsets[s]; i < offsets[s + 1]; ++i) {
+                scratch[i] = std::uint32_t(s);
+            }
+        }
+
+        std::pmr::vector<std::size_t> next(offsets.begin(), offsets.end(),
+                                           order.get_allocator());
+        order.resize(count);
+        for (std::uint32_t i : sorted) {
+            order[next[scratch[i]]++] = i;
+        }
+        return;
+    }
+
+    order.resize(count);
+    for (std::size_t s = 0; s < segments; ++s) {
+        const std::size_t first = offsets[s], size = offsets[s + 1] - first;
+        radix_sort_order(keys + first, size, sorted, scratch);
+        for (std::size_t i = 0; i < size; ++i) {
+            order[first + i] = std::uint32_t(first + sorted[i]);
+        }
+    }
+}
+
+/**
+ * \brief Sorts compact hits in increasing \c phi order using a radix sort
+ */
+inline void radix_sort_by_phi(compact_hit_columns &hits)
+{
+    // Allocated like the hits, eg in the arena of the event
+    std::pmr::vector<std::uint32_t> order(hits.resource()), scratch(hits.resource());
+    radix_sort_order(hits.phi.data(), hits.size(), order, scratch);
+    hits.permute(order);
+}
+
+#endif // RADIX_SORT_H
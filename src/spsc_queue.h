@@ -0,0 +1,170 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * \brief Bounded lock-free queue with a single producer and a single consumer.
+ *
+ * Exactly one thread may push and exactly one thread may pop at any time.
+ *
+ * \ref try_push and \ref try_pop never block. \ref push and \ref pop retry
+ * a few times, then sleep until the other thread makes room or adds an
+ * element, so that idle stages of a pipeline don't keep a core busy. The
+ * mutex is only taken when a thread sleeps or has to be woken up.
+ */
+template<class T>
+class spsc_queue
+{
+    std::vector<T> _buffer;
+
+    /// \brief Next slot to read, only written by the consumer
+    alignas(64) std::atomic<std::size_t> _head{0};
+
+    /// \brief Next slot to write, only written by the producer
+    alignas(64) std::atomic<std::size_t> _tail{0};
+
+    /// \brief Set while the consumer sleeps in \ref pop
+    alignas(64) std::atomic<bool> _consumer_waiting{false};
+
+    /// \brief Set while the producer sleeps in \ref push
+    std::atomic<bool> _producer_waiting{false};
+
+    std::mutex _mutex;
+    std::condition_variable _not_empty, _not_full;
+
+    std::size_t next(std::size_t index) const
+    {
+        return index + 1 == _buffer.size() ? 0 : index + 1;
+    }
+
+    /**
+     * \brief Wakes up the other thread if it sleeps on \c waiting
+     *
+     * The index was just stored with \c seq_cst, and \ref sleep stores the
+     * flag before reading the index the same way, so either the sleeping
+     * thread sees the new index or this one sees the flag.
+     */
+    void wake(const std::atomic<bool> &waiting, std::condition_variable &cv)
+    {
+        if (waiting.load(std::memory_order_seq_cst)) {
+            // Taking the mutex makes sure the other thread is not between
+            // checking the queue and waiting
+            std::lock_guard<std::mutex> lock(_mutex);
+            cv.notify_one();
+        }
+    }
+
+    /// \brief Sleeps on \c cv until \c ready returns \c true
+    template<class Ready>
+    void sleep(std::atomic<bool> &waiting, std::condition_variable &cv, Ready &&ready)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        waiting.store(true, std::memory_order_seq_cst);
+        while (!ready()) {
+            cv.wait(lock);
+        }
+        waiting.store(false, std::memory_order_relaxed);
+    }
+
+public:
+    /// \brief Number of attempts made by \ref push and \ref pop before sleeping
+    static const constexpr int spin_count = 64;
+
+    /**
+     * \brief Constructor
+     *
+     * \param capacity The maximum number of elements in the queue.
+     */
+    explicit spsc_queue(std::size_t capacity) :
+        _buffer(capacity + 1)
+    {}
+
+    spsc_queue(const spsc_queue &) = delete;
+    spsc_queue &operator=(const spsc_queue &) = delete;
+
+    /**
+     * \brief Appends \c value to the queue.
+     *
+     * \return \c false if the queue is full.
+     */
+    bool try_push(const T &value)
+    {
+        std::size_t tail = _tail.load(std::memory_order_relaxed);
+        std::size_t next_tail = next(tail);
+        if (next_tail == _head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        _buffer[tail] = value;
+        _tail.store(next_tail, std::memory_order_seq_cst);
+        wake(_consumer_waiting, _not_empty);
+        return true;
+    }
+
+    /**
+     * \brief Removes the first element of the queue and stores it in \c value.
+     *
+     * \return \c false if the queue is empty.
+     */
+    bool try_pop(T &value)
+    {
+        std::size_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = std::move(_buffer[head]);
+        _head.store(next(head), std::memory_order_seq_cst);
+        wake(_producer_waiting, _not_full);
+        return true;
+    }
+
+    /**
+     * \brief Appends \c value to the queue, waiting until there is room.
+     */
+    void push(const T &value)
+    {
+        for (int i = 0; i < spin_count; ++i) {
+            if (try_push(value)) {
+                return;
+            }
+            std::this_thread::yield();
+        }
+
+        // Only the consumer can make room, and nobody else can take it
+        sleep(_producer_waiting, _not_full, [this]() {
+            return next(_tail.load(std::memory_order_relaxed))
+                != _head.load(std::memory_order_seq_cst);
+        });
+        try_push(value);
+    }
+
+    /**
+     * \brief Removes the first element of the queue, waiting until there is
+     *        one.
+     */
+    T pop()
+    {
+        T value;
+        for (int i = 0; i < spin_count; ++i) {
+            if (try_pop(value)) {
+                return value;
+            }
+            std::this_thread::yield();
+        }
+
+        // Only the producer can add an element, and nobody else can take it
+        sleep(_consumer_waiting, _not_empty, [this]() {
+            return _head.load(std::memory_order_relaxed)
+                != _tail.load(std::memory_order_seq_cst);
+        });
+        try_pop(value);
+        return value;
+    }
+};
+
+#endif // SPSC_QUEUE_H
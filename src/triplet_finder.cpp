@@ -0,0 +1,127 @@
+#include "triplet_finder.h"
+
+#include <cmath>
+
+#include "compact.h"
+
+namespace /* anonymous */
+{
+    /// \brief Returns <tt>phi2 - phi1</tt> in [-pi, pi]
+    float deltaphi(float phi1, float phi2)
+    {
+        float delta = phi2 - phi1;
+        if (delta > pi) {
+            delta -= 2 * pi;
+        } else if (delta <= -pi) {
+            delta += 2 * pi;
+        }
+        return delta;
+    }
+
+} // namespace anonymous
+
+float triplet_finder::dphi3(float phi1, float phi2, float phi3)
+{
+    float step = deltaphi(phi2, phi3);
+    float dphi3 = step - deltaphi(phi1, phi2);
+    return step < 0 ? -dphi3 : dphi3;
+}
+
+void triplet_finder::find(
+        const std::array<hit_span, geom::pixel_barrel_radius.size()> &layers,
+        const std::vector<geom::layer_pair> &pairs,
+        const std::pmr::vector<doublet_type> &doublets,
+        const std::pmr::vector<std::size_t> &pair_offsets)
+{
+    _triplets.clear();
+    _quadruplets.clear();
+
+    // Index the doublets of every pair by inner hit (counting sort)
+    _by_inner.resize(pairs.size());
+    for (std::size_t p = 0; p < pairs.size(); ++p) {
+        doublet_index &index = _by_inner[p];
+        index.offsets.assign(layers[pairs[p].inner].size() + 1, 0);
+        index.outer.resize(pair_offsets[p + 1] - pair_offsets[p]);
+
+        for (std::size_t d = pair_offsets[p]; d < pair_offsets[p + 1]; ++d) {
+            ++index.offsets[doublets[d].first + 1];
+        }
+        for (std::size_t i = 1; i < index.offsets.size(); ++i) {
+            index.offsets[i] += index.offsets[i - 1];
+        }
+        for (std::size_t d = pair_offsets[p]; d < pair_offsets[p + 1]; ++d) {
+            index.outer[index.offsets[doublets[d].first]++] = doublets[d].second;
+        }
+        // Every offset was moved to the next one, shift them back
+        for (std::size_t i = index.offsets.size() - 1; i > 0; --i) {
+            index.offsets[i] = index.offsets[i - 1];
+        }
+        index.offsets[0] = 0;
+    }
+
+    // Triplets: extend the doublets of pair p with those of pair q
+    for (std::size_t p = 0; p < pairs.size(); ++p) {
+        const hit_span &layer1 = layers[pairs[p].inner];
+        const hit_span &layer2 = layers[pairs[p].outer];
+
+        for (std::size_t q = 0; q < pairs.size(); ++q) {
+            if (pairs[q].inner != pairs[p].outer) {
+                continue;
+            }
+            const doublet_index &next = _by_inner[q];
+            const hit_span &layer3 = layers[pairs[q].outer];
+
+            for (std::size_t d = pair_offsets[p]; d < pair_offsets[p + 1]; ++d) {
+                const std::uint16_t i1 = doublets[d].first;
+                const std::uint16_t i2 = doublets[d].second;
+
+                for (std::uint32_t k = next.offsets[i2]; k < next.offsets[i2 + 1]; ++k) {
+                    const std::uint16_t i3 = next.outer[k];
+
+                    if (pass_triplet_cuts(layer1.phi[i1], layer1.z[i1],
+                                          layer2.phi[i2], layer2.z[i2],
+                                          layer3.phi[i3], layer3.z[i3])) {
+                        _triplets.push_back({
+                            { std::uint8_t(pairs[p].inner),
+                              std::uint8_t(pairs[p].outer),
+                              std::uint8_t(pairs[q].outer) },
+                            { i1, i2, i3 }
+                        });
+                    }
+                }
+            }
+        }
+    }
+
+    // Quadruplets: extend the triplets with one more doublet
+    for (const triplet_type &t : _triplets) {
+        for (std::size_t r = 0; r < pairs.size(); ++r) {
+            if (pairs[r].inner != t.layers[2]) {
+                continue;
+            }
+            const doublet_index &next = _by_inner[r];
+            const hit_span &layer4 = layers[pairs[r].outer];
+
+            const float z1 = layers[t.layers[0]].z[t.hits[0]];
+            const float z2 = layers[t.layers[1]].z[t.hits[1]];
+            const float z3 = layers[t.layers[2]].z[t.hits[2]];
+            const float phi2 = layers[t.layers[1]].phi[t.hits[1]];
+            const float phi3 = layers[t.layers[2]].phi[t.hits[2]];
+
+            for (std::uint32_t k = next.offsets[t.hits[2]]; k < next.offsets[t.hits[2] + 1]; ++k) {
+                const std::uint16_t i4 = next.outer[k];
+
+                float dphi = dphi3(phi2, phi3, layer4.phi[i4]);
+                float dz = z1 - z2 - z3 + layer4.z[i4];
+                if (quadruplet_dphi3_min < dphi && dphi < quadruplet_dphi3_max
+                    && std::abs(dz) < quadruplet_dz_max) {
+                    _quadruplets.push_back({
+                        { t.layers[0], t.layers[1], t.layers[2],
+                          std::uint8_t(pairs[r].outer) },
+                        { t.hits[0], t.hits[1], t.hits[2], i4 }
+                    });
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,125 @@
+#ifndef TRIPLET_FINDER_H
+#define TRIPLET_FINDER_H
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory_resource>
+#include <utility>
+#include <vector>
+
+#include "event.h"
+#include "geometry.h"
+
+/**
+ * \brief A fixed number of hits in distinct layers, stored as indices.
+ *
+ * Hit \c i is <tt>hits[i]</tt> in layer <tt>layers[i]</tt>, from the inside
+ * out.
+ */
+template<std::size_t N>
+struct hit_tuple
+{
+    std::array<std::uint8_t, N> layers;
+    std::array<std::uint16_t, N> hits;
+};
+
+/**
+ * \brief Builds triplets and quadruplets by chaining doublets.
+ *
+ * Doublets of every layer pair are indexed by their inner hit, in time linear
+ * in the number of hits and doublets. A doublet <tt>(a, b)</tt> is then
+ * extended outward with the doublets starting at \c b in a pair whose inner
+ * layer is the outer layer of the first one. Only the doublets sharing a hit
+ * are looked at, so the cost is proportional to the number of doublets times
+ * the (small) number of continuations of each.
+ *
+ * Triplets must bend consistently in the transverse plane (\c dphi3) and be
+ * close to a straight line in \c z. Quadruplets extend triplets with the same
+ * kind of cuts on their last three hits.
+ */
+class triplet_finder
+{
+public:
+    /// \brief A doublet, represented as indices within the two layers
+    using doublet_type = std::pair<std::uint16_t, std::uint16_t>;
+
+    using triplet_type = hit_tuple<3>;
+    using quadruplet_type = hit_tuple<4>;
+
+    /// \brief Allowed \c dphi3 range for triplets (rad)
+    static const constexpr float triplet_dphi3_min = -0.01f;
+    static const constexpr float triplet_dphi3_max = 0.05f;
+
+    /// \brief Maximum of <tt>|z1 + z3 - 2 z2|</tt> for triplets (cm)
+    static const constexpr float triplet_dz_max = 2.5f;
+
+    /// \brief Allowed \c dphi3 range for the last three hits of quadruplets
+    static const constexpr float quadruplet_dphi3_min = -0.03f;
+    static const constexpr float quadruplet_dphi3_max = 0.05f;
+
+    /// \brief Maximum of <tt>|z1 - z2 - z3 + z4|</tt> for quadruplets (cm)
+    static const constexpr float quadruplet_dz_max = 1.5f;
+
+    /**
+     * \brief Change of the azimutal step between three hits, signed such that
+     *        a constant bending direction gives positive values
+     *
+     * Safe at +-pi.
+     */
+    static float dphi3(float phi1, float phi2, float phi3);
+
+    /**
+     * \brief Returns \c true if three hits, from the inside out, pass the
+     *        triplet cuts
+     */
+    static bool pass_triplet_cuts(float phi1, float z1,
+                                  float phi2, float z2,
+                                  float phi3, float z3)
+    {
+        float dphi = dphi3(phi1, phi2, phi3);
+        float dz = z1 + z3 - 2 * z2;
+        return triplet_dphi3_min < dphi && dphi < triplet_dphi3_max
+            && std::abs(dz) < triplet_dz_max;
+    }
+
+    /**
+     * \brief Finds triplets and quadruplets.
+     *
+     * \param layers       Hits of every layer, as seen by the doublet finder
+     * \param pairs        Layer pairs the doublets were found in
+     * \param doublets     Doublets of all pairs
+     * \param pair_offsets The doublets of <tt>pairs[i]</tt> are
+     *                     <tt>doublets[pair_offsets[i]]</tt> to
+     *                     <tt>doublets[pair_offsets[i + 1]]</tt> (excluded)
+     */
+    void find(const std::array<hit_span, geom::pixel_barrel_radius.size()> &layers,
+              const std::vector<geom::layer_pair> &pairs,
+              const std::pmr::vector<doublet_type> &doublets,
+              const std::pmr::vector<std::size_t> &pair_offsets);
+
+    /// \brief Returns the triplets found by the last call to \ref find
+    const std::vector<triplet_type> &triplets() const { return _triplets; }
+
+    /// \brief Returns the quadruplets found by the last call to \ref find
+    const std::vector<quadruplet_type> &quadruplets() const { return _quadruplets; }
+
+private:
+    /**
+     * \brief Doublets of one pair, indexed by inner hit.
+     *
+     * The outer hits of the doublets starting at inner hit \c i are
+     * <tt>outer[offsets[i]]</tt> to <tt>outer[offsets[i + 1]]</tt> (excluded).
+     */
+    struct doublet_index
+    {
+        std::vector<std::uint32_t> offsets;
+        std::vector<std::uint16_t> outer;
+    };
+
+    std::vector<doublet_index> _by_inner;
+    std::vector<triplet_type> _triplets;
+    std::vector<quadruplet_type> _quadruplets;
+};
+
+#endif // TRIPLET_FINDER_H
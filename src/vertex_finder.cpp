@@ -0,0 +1,86 @@
+#include "vertex_finder.h"
+
+#include <algorithm>
+
+void z_windows::clear()
+{
+    _bins.fill(0);
+    _low = half_length;
+    _high = -half_length;
+}
+
+void z_windows::add(float low, float high)
+{
+    low = std::max(low, -half_length);
+    high = std::min(high, half_length);
+    if (low >= high) {
+        return;
+    }
+
+    // Every bin touched by the range
+    const int first = int((low + half_length) / bin_width);
+    const int last = std::min(bin_count - 1, int((high + half_length) / bin_width));
+    std::fill(_bins.begin() + first + 1, _bins.begin() + last + 2, 1);
+
+    _low = std::min(_low, first * bin_width - half_length);
+    _high = std::max(_high, (last + 1) * bin_width - half_length);
+}
+
+void vertex_finder::clear()
+{
+    _histogram.fill(0);
+    _entries = 0;
+}
+
+void vertex_finder::fill(float dz)
+{
+    const float x = (dz + bin_count * bin_width / 2) / bin_width;
+    if (x >= 0 && x < bin_count) {
+        ++_histogram[int(x)];
+        ++_entries;
+    }
+}
+
+std::size_t vertex_finder::find_peaks()
+{
+    _vertices.clear();
+    _windows.clear();
+
+    // Sum of three bins around bin i
+    auto smoothed = [this](int i) {
+        int sum = _histogram[i];
+        if (i > 0) {
+            sum += _histogram[i - 1];
+        }
+        if (i + 1 < bin_count) {
+            sum += _histogram[i + 1];
+        }
+        return sum;
+    };
+
+    // Peaks must stand above the combinatorial background
+    const int threshold = std::max<int>(min_peak_entries, 3 * _entries / bin_count + 1);
+
+    int previous = 0;
+    int current = smoothed(0);
+    for (int i = 0; i < bin_count; ++i) {
+        const int next = i + 1 < bin_count ? smoothed(i + 1) : 0;
+
+        // The first bin of a plateau is the maximum
+        if (current >= threshold && current > previous && current >= next) {
+            float sum = 0, weighted = 0;
+            for (int j = std::max(0, i - 1); j <= std::min(bin_count - 1, i + 1); ++j) {
+                sum += _histogram[j];
+                weighted += _histogram[j] * (j + 0.5f);
+            }
+            const float z = weighted / sum * bin_width - bin_count * bin_width / 2;
+            _vertices.push_back(z);
+            _windows.add(z - window_half_width, z + window_half_width);
+        }
+
+        previous = current;
+        current = next;
+    }
+
+    return _vertices.size();
+}
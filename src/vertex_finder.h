@@ -0,0 +1,125 @@
+#ifndef VERTEX_FINDER_H
+#define VERTEX_FINDER_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * \brief Returns the \c z of the line through two hits where it crosses the
+ *        beam line, relative to the beam spot (cm)
+ *
+ * \c rb_proj is the projection of the beam spot position on the direction of
+ * the inner hit.
+ */
+inline float beam_line_dz(float inner_r, float inner_z,
+                          float outer_r, float outer_z,
+                          float rb_proj, float bs_z)
+{
+    return inner_z - bs_z - (inner_r - rb_proj) * (outer_z - inner_z) / (outer_r - inner_r);
+}
+
+/**
+ * \brief A set of ranges along the beam line, relative to the beam spot.
+ *
+ * Stored as a bitmap over bins of \ref bin_width covering the beam spot, so
+ * lookups are a single array access without branches.
+ */
+class z_windows
+{
+public:
+    /// \brief Half length of the covered region (cm)
+    static const constexpr float half_length = 11;
+
+    /// \brief Resolution of the bitmap (cm)
+    static const constexpr float bin_width = 0.05f;
+
+    /// \brief Number of bins in the bitmap
+    static const constexpr int bin_count = 440;
+
+    /// \brief Removes all ranges
+    void clear();
+
+    /// \brief Adds the range from \c low to \c high (cm)
+    void add(float low, float high);
+
+    /// \brief Returns \c true if \c dz is within one of the ranges
+    bool contains(float dz) const
+    {
+        // Branchless: values out of range land in the empty bins at both ends
+        const float x = (dz + half_length) * (1 / bin_width) + 1;
+        return _bins[int(std::min(std::max(x, 0.f), float(bin_count + 1)))];
+    }
+
+    /// \brief Returns the lower end of the lowest range
+    float low() const { return _low; }
+
+    /// \brief Returns the upper end of the highest range
+    float high() const { return _high; }
+
+private:
+    /// \brief One flag per bin, with an empty bin at both ends
+    std::array<std::uint8_t, bin_count + 2> _bins{};
+    float _low = half_length, _high = -half_length;
+};
+
+/**
+ * \brief Finds primary vertices along the beam line.
+ *
+ * The \c z of the points where doublets cross the beam line are histogrammed
+ * in bins of 1 mm. Vertices are the local maxima of the histogram smoothed
+ * over three bins that stand above the average; their position is the mean of
+ * the three bins. Each vertex then opens a window of \ref window_half_width
+ * around it.
+ *
+ * A few hundred doublets are enough: at high pileup, most doublets come from
+ * one of the vertices and the combinatorial ones are spread over the whole
+ * beam spot.
+ */
+class vertex_finder
+{
+public:
+    /// \brief Histogram bin width (cm)
+    static const constexpr float bin_width = 0.1f;
+
+    /// \brief Number of histogram bins, covering the beam spot
+    static const constexpr int bin_count = 220;
+
+    /// \brief Minimum number of entries in three bins to make a vertex
+    static const constexpr int min_peak_entries = 4;
+
+    /// \brief Half width of the window opened around each vertex (cm)
+    static const constexpr float window_half_width = 0.5f;
+
+    /// \brief Number of doublets worth filling
+    static const constexpr std::size_t max_samples = 4096;
+
+    /// \brief Empties the histogram
+    void clear();
+
+    /// \brief Adds a doublet crossing the beam line at \c dz from the beam spot
+    void fill(float dz);
+
+    /**
+     * \brief Finds the vertices in the histogram and builds \ref windows.
+     *
+     * \return The number of vertices found.
+     */
+    std::size_t find_peaks();
+
+    /// \brief Positions of the vertices, relative to the beam spot (cm)
+    const std::vector<float> &vertices() const { return _vertices; }
+
+    /// \brief Ranges around the vertices
+    const z_windows &windows() const { return _windows; }
+
+private:
+    std::array<int, bin_count> _histogram{};
+    std::size_t _entries = 0;
+    std::vector<float> _vertices;
+    z_windows _windows;
+};
+
+#endif // VERTEX_FINDER_H